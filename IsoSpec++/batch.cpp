@@ -0,0 +1,320 @@
+/*
+ *   Copyright (C) 2015-2016 Mateusz Łącki and Michał Startek.
+ *
+ *   This file is part of IsoSpec.
+ *
+ *   IsoSpec is free software: you can redistribute it and/or modify
+ *   it under the terms of the Simplified ("2-clause") BSD licence.
+ *
+ *   IsoSpec is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ *   You should have received a copy of the Simplified BSD Licence
+ *   along with IsoSpec.  If not, see <https://opensource.org/licenses/BSD-2-Clause>.
+ */
+
+
+#include <vector>
+#include <atomic>
+#include <limits>
+#include <stdexcept>
+#include <string.h>
+#include <pthread.h>
+#include <sys/sysinfo.h>
+#include "batch.h"
+#include "isoSpec++.h"
+#include "marginalCache.h"
+#include "formula.h"
+
+
+// Molecules per unit of work
+#define BATCH_CHUNK_SIZE 64
+
+
+IsoBatchResult::IsoBatchResult() :
+no_molecules(0),
+offsets(nullptr),
+masses(nullptr),
+probs(nullptr)
+{}
+
+IsoBatchResult::~IsoBatchResult()
+{
+    delete[] offsets;
+    delete[] masses;
+    delete[] probs;
+}
+
+
+namespace {
+
+struct BatchChunk
+{
+    // The first used entries are configurations, the rest of capacity is room for more
+    double* masses;
+    double* probs;
+    size_t used;
+    size_t capacity;
+    std::vector<size_t> counts;     // Per molecule
+
+    BatchChunk() : masses(nullptr), probs(nullptr), used(0), capacity(0) {};
+    BatchChunk(const BatchChunk& other) = delete;
+    BatchChunk& operator=(const BatchChunk& other) = delete;
+    ~BatchChunk() { release(); };
+
+    void grow()
+    {
+        const size_t new_capacity = std::max<size_t>(2 * capacity, 1024);
+        double* new_masses = new double[new_capacity];
+        double* new_probs = new double[new_capacity];
+        if(used > 0)
+        {
+            memcpy(new_masses, masses, used * sizeof(double));
+            memcpy(new_probs, probs, used * sizeof(double));
+        }
+        release();
+        masses = new_masses;
+        probs = new_probs;
+        capacity = new_capacity;
+    }
+
+    void release()
+    {
+        delete[] masses;
+        delete[] probs;
+        masses = nullptr;
+        probs = nullptr;
+    }
+};
+
+struct BatchJob
+{
+    // Either formulas or counts of elements
+    const char* const* formulas;
+    const int* counts;
+    const int* elements;            // In the per-element tables
+    size_t no_elements;
+
+    size_t no_molecules;
+    double threshold;
+    bool absolute;
+    MarginalCache* cache;           // nullptr: the global one
+
+    BatchChunk* chunks;
+    size_t no_chunks;
+    std::atomic<size_t> next_chunk;
+    std::atomic<size_t> first_invalid;
+    std::atomic<bool> out_of_memory;
+
+    IsoBatchResult* out;
+
+    BatchJob() : chunks(nullptr), no_chunks(0) {};
+    ~BatchJob() { delete[] chunks; };
+};
+
+Iso make_iso(const BatchJob& job, size_t idx, std::vector<int>& elements, std::vector<int>& atomCounts)
+{
+    if(job.formulas != nullptr)
+        return Iso(job.formulas[idx]);
+
+    elements.clear();
+    atomCounts.clear();
+    const int* row = job.counts + idx * job.no_elements;
+    for(size_t ii = 0; ii < job.no_elements; ii++)
+        if(row[ii] > 0)
+        {
+            elements.push_back(job.elements[ii]);
+            atomCounts.push_back(row[ii]);
+        }
+    return Iso(static_cast<int>(atomCounts.size()), elements.data(), atomCounts.data());
+}
+
+// Appends the configurations of one molecule to the chunk, returns how many there were
+size_t run_molecule(Iso&& iso, const BatchJob& job, BatchChunk& chunk)
+{
+    IsoThresholdGenerator gen(std::move(iso), job.threshold, job.absolute);
+    const size_t start = chunk.used;
+    while(true)
+    {
+        if(chunk.capacity - chunk.used < 256)
+            chunk.grow();
+        const size_t room = chunk.capacity - chunk.used;
+        const size_t got = gen.fill(chunk.masses + chunk.used, chunk.probs + chunk.used, room);
+        chunk.used += got;
+        if(got < room)
+            break;
+    }
+    return chunk.used - start;
+}
+
+void* batch_compute(void* arg)
+{
+    BatchJob& job = *reinterpret_cast<BatchJob*>(arg);
+    // With a single thread this is the caller's, whose cache has to be there afterwards
+    MarginalCache* prev_cache = MarginalCache::get_thread_cache();
+    MarginalCache::set_thread_cache(job.cache);
+
+    std::vector<int> elements, atomCounts;
+
+    size_t c;
+    while((c = job.next_chunk.fetch_add(1, std::memory_order_relaxed)) < job.no_chunks)
+    {
+        BatchChunk& chunk = job.chunks[c];
+        const size_t end = std::min(job.no_molecules, (c+1) * BATCH_CHUNK_SIZE);
+        for(size_t ii = c * BATCH_CHUNK_SIZE; ii < end; ii++)
+        {
+            size_t cnt = 0;
+            try
+            {
+                Iso iso = make_iso(job, ii, elements, atomCounts);
+                if(iso.getDimNumber() > 0)
+                    cnt = run_molecule(std::move(iso), job, chunk);
+            }
+            catch(std::invalid_argument&)
+            {
+                size_t prev = job.first_invalid.load();
+                while(ii < prev and not job.first_invalid.compare_exchange_weak(prev, ii)) {};
+            }
+            catch(std::bad_alloc&)
+            {
+                job.out_of_memory.store(true);
+            }
+            chunk.counts.push_back(cnt);
+        }
+    }
+
+    MarginalCache::set_thread_cache(prev_cache);
+    return NULL;
+}
+
+void* batch_copy(void* arg)
+{
+    BatchJob& job = *reinterpret_cast<BatchJob*>(arg);
+
+    size_t c;
+    while((c = job.next_chunk.fetch_add(1, std::memory_order_relaxed)) < job.no_chunks)
+    {
+        BatchChunk& chunk = job.chunks[c];
+        const size_t offset = job.out->offsets[c * BATCH_CHUNK_SIZE];
+        if(chunk.used > 0)
+        {
+            memcpy(job.out->masses + offset, chunk.masses, chunk.used * sizeof(double));
+            memcpy(job.out->probs + offset, chunk.probs, chunk.used * sizeof(double));
+        }
+        // Give the memory back as we go
+        chunk.release();
+    }
+    return NULL;
+}
+
+void run_threads(void* (*func)(void*), BatchJob& job, unsigned int n_threads)
+{
+    job.next_chunk.store(0);
+    if(n_threads <= 1)
+    {
+        func(&job);
+        return;
+    }
+    pthread_t* threads = new pthread_t[n_threads];
+    unsigned int started = 0;
+    while(started < n_threads and pthread_create(&threads[started], NULL, func, &job) == 0)
+        started++;
+    // Out of threads: the chunks are shared out dynamically, so we just join in
+    if(started < n_threads)
+        func(&job);
+    for(unsigned int ii = 0; ii < started; ii++)
+        pthread_join(threads[ii], NULL);
+    delete[] threads;
+}
+
+void run_batch(BatchJob& job, size_t no_molecules, const IsoBatchOptions& options, IsoBatchResult& out)
+{
+    delete[] out.offsets;
+    delete[] out.masses;
+    delete[] out.probs;
+    out.no_molecules = 0;
+    out.offsets = nullptr;
+    out.masses = nullptr;
+    out.probs = nullptr;
+
+    job.no_molecules = no_molecules;
+    job.threshold = options.threshold;
+    job.absolute = options.absolute;
+    job.no_chunks = (job.no_molecules + BATCH_CHUNK_SIZE - 1) / BATCH_CHUNK_SIZE;
+    job.chunks = new BatchChunk[job.no_chunks];
+    // Here, so that the workers never allocate outside their exception handlers
+    for(size_t c = 0; c < job.no_chunks; c++)
+        job.chunks[c].counts.reserve(BATCH_CHUNK_SIZE);
+    job.first_invalid.store(std::numeric_limits<size_t>::max());
+    job.out_of_memory.store(false);
+    job.out = &out;
+
+    // Molecules share marginals through the global cache if it is on, or a cache of the batch
+    MarginalCache batch_cache;
+    job.cache = nullptr;
+    if(not MarginalCache::global().enabled())
+    {
+        batch_cache.set_capacity(options.cache_capacity);
+        job.cache = &batch_cache;
+    }
+
+    unsigned int n_threads = options.n_threads > 0 ? options.n_threads : get_nprocs();
+    if(n_threads > job.no_chunks)
+        n_threads = static_cast<unsigned int>(job.no_chunks);
+
+    run_threads(batch_compute, job, n_threads);
+
+    if(job.out_of_memory.load())
+        throw std::bad_alloc();
+    if(job.first_invalid.load() != std::numeric_limits<size_t>::max())
+        throw std::invalid_argument("Invalid formula");
+
+    out.offsets = new size_t[job.no_molecules + 1];
+    size_t total = 0;
+    size_t idx = 0;
+    for(size_t c = 0; c < job.no_chunks; c++)
+        for(size_t ii = 0; ii < job.chunks[c].counts.size(); ii++)
+        {
+            out.offsets[idx++] = total;
+            total += job.chunks[c].counts[ii];
+        }
+    out.offsets[idx] = total;
+    out.masses = new double[total];
+    out.probs = new double[total];
+    out.no_molecules = job.no_molecules;
+
+    run_threads(batch_copy, job, n_threads);
+}
+
+} // namespace
+
+
+void isoThresholdBatch(const char* const* formulas, size_t no_molecules, const IsoBatchOptions& options, IsoBatchResult& out)
+{
+    BatchJob job;
+    job.formulas = formulas;
+    job.counts = nullptr;
+    job.elements = nullptr;
+    job.no_elements = 0;
+    run_batch(job, no_molecules, options, out);
+}
+
+void isoThresholdBatch(const char* const* element_symbols, size_t no_elements, const int* counts, size_t no_molecules, const IsoBatchOptions& options, IsoBatchResult& out)
+{
+    // The symbols are looked up once for the whole batch
+    std::vector<int> elements(no_elements);
+    for(size_t ii = 0; ii < no_elements; ii++)
+    {
+        elements[ii] = find_element_index(element_symbols[ii], strlen(element_symbols[ii]));
+        if(elements[ii] < 0)
+            throw std::invalid_argument("Invalid element symbol");
+    }
+
+    BatchJob job;
+    job.formulas = nullptr;
+    job.counts = counts;
+    job.elements = elements.data();
+    job.no_elements = no_elements;
+    run_batch(job, no_molecules, options, out);
+}
@@ -0,0 +1,68 @@
+/*
+ *   Copyright (C) 2015-2016 Mateusz Łącki and Michał Startek.
+ *
+ *   This file is part of IsoSpec.
+ *
+ *   IsoSpec is free software: you can redistribute it and/or modify
+ *   it under the terms of the Simplified ("2-clause") BSD licence.
+ *
+ *   IsoSpec is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ *   You should have received a copy of the Simplified BSD Licence
+ *   along with IsoSpec.  If not, see <https://opensource.org/licenses/BSD-2-Clause>.
+ */
+
+
+/*
+ * Threshold isotope patterns of many molecules at once, for throughput: the molecules are
+ * spread over a pool of threads in chunks, marginals are shared between molecules through
+ * a MarginalCache, and the results end up in one contiguous buffer.
+ */
+
+#ifndef BATCH_HPP
+#define BATCH_HPP
+
+#include <cstddef>
+
+
+struct IsoBatchResult
+{
+    size_t no_molecules;
+    size_t* offsets;        // Molecule ii has configurations [offsets[ii], offsets[ii+1])
+    double* masses;
+    double* probs;          // Probabilities, not logarithms
+
+    IsoBatchResult();
+    IsoBatchResult(const IsoBatchResult& other) = delete;
+    IsoBatchResult& operator=(const IsoBatchResult& other) = delete;
+    ~IsoBatchResult();
+
+    inline size_t get_no_confs() const { return offsets != nullptr ? offsets[no_molecules] : 0; };
+};
+
+struct IsoBatchOptions
+{
+    double threshold;
+    bool absolute;
+    unsigned int n_threads;         // 0: as many as there are processors
+    // Used if the global MarginalCache is disabled: the batch then gets its own, of that
+    // many configurations, for the duration of the call
+    size_t cache_capacity;
+
+    IsoBatchOptions(double _threshold, bool _absolute = false) :
+    threshold(_threshold), absolute(_absolute), n_threads(0), cache_capacity(1 << 22) {};
+};
+
+/*
+ * The molecules are given as formulas, or as a matrix of counts (no_molecules rows of
+ * no_elements each) of the given elements. A molecule with no atoms has no configurations.
+ * Throws std::invalid_argument if a formula or an element symbol is invalid; out is
+ * then left empty.
+ */
+void isoThresholdBatch(const char* const* formulas, size_t no_molecules, const IsoBatchOptions& options, IsoBatchResult& out);
+
+void isoThresholdBatch(const char* const* element_symbols, size_t no_elements, const int* counts, size_t no_molecules, const IsoBatchOptions& options, IsoBatchResult& out);
+
+#endif
@@ -0,0 +1,247 @@
+/*
+ *   Copyright (C) 2015-2016 Mateusz Łącki and Michał Startek.
+ *
+ *   This file is part of IsoSpec.
+ *
+ *   IsoSpec is free software: you can redistribute it and/or modify
+ *   it under the terms of the Simplified ("2-clause") BSD licence.
+ *
+ *   IsoSpec is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ *   You should have received a copy of the Simplified BSD Licence
+ *   along with IsoSpec.  If not, see <https://opensource.org/licenses/BSD-2-Clause>.
+ */
+
+
+#include <cmath>
+#include <vector>
+#include <complex>
+#include <limits>
+#include <algorithm>
+#include <string.h>
+#include "binnedSpectrum.h"
+#include "marginalTrek++.h"
+#include "misc.h"
+
+
+namespace {
+
+// values[ii] is the probability at fine grid point offset+ii
+struct Histogram
+{
+    long offset;
+    std::vector<double> values;
+    size_t nonzero;
+};
+
+// In place, radix 2; roots[k] = exp(-2 pi i k / n) for k < n/2
+void fft(std::complex<double>* a, size_t n, const std::complex<double>* roots, bool inverse)
+{
+    for(size_t ii = 1, jj = 0; ii < n; ii++)
+    {
+        size_t bit = n >> 1;
+        for(; jj & bit; bit >>= 1)
+            jj ^= bit;
+        jj ^= bit;
+        if(ii < jj)
+            std::swap(a[ii], a[jj]);
+    }
+
+    for(size_t len = 2; len <= n; len <<= 1)
+    {
+        const size_t step = n / len;
+        for(size_t start = 0; start < n; start += len)
+            for(size_t kk = 0; kk < len/2; kk++)
+            {
+                const std::complex<double> w = inverse ? std::conj(roots[kk*step]) : roots[kk*step];
+                const std::complex<double> u = a[start+kk];
+                const std::complex<double> v = a[start+kk+len/2] * w;
+                a[start+kk] = u + v;
+                a[start+kk+len/2] = u - v;
+            }
+    }
+}
+
+void convolve_direct(const Histogram& a, const Histogram& b, Histogram& out)
+{
+    // Over the nonzero entries of the sparser one
+    const Histogram& sparse = a.nonzero <= b.nonzero ? a : b;
+    const Histogram& dense = a.nonzero <= b.nonzero ? b : a;
+    const size_t dense_len = dense.values.size();
+    double* target = out.values.data();
+    for(size_t ii = 0; ii < sparse.values.size(); ii++)
+    {
+        const double p = sparse.values[ii];
+        if(p == 0.0)
+            continue;
+        const double* source = dense.values.data();
+        for(size_t jj = 0; jj < dense_len; jj++)
+            target[ii+jj] += p * source[jj];
+    }
+}
+
+/*
+ * Returns an estimate of the rounding error per point: the FFT error grows like eps*log2(n)
+ * relative to the norms of the inputs (Percival's analysis of FFT convolution has a constant
+ * of a few units per level), and the inputs being nonnegative, their sums bound those norms.
+ * It is a rule of thumb, not a proof for this packed variant; the test holds it against
+ * convolve_direct.
+ */
+double convolve_fft(const Histogram& a, const Histogram& b, Histogram& out, size_t n)
+{
+    // Both real sequences at once, as the real and imaginary parts
+    std::vector<std::complex<double> > z(n), prod(n), roots(n/2);
+    for(size_t kk = 0; kk < n/2; kk++)
+        roots[kk] = std::polar(1.0, -2.0 * M_PI * static_cast<double>(kk) / static_cast<double>(n));
+    for(size_t ii = 0; ii < a.values.size(); ii++)
+        z[ii].real(a.values[ii]);
+    for(size_t ii = 0; ii < b.values.size(); ii++)
+        z[ii].imag(b.values[ii]);
+
+    fft(z.data(), n, roots.data(), false);
+    for(size_t kk = 0; kk < n; kk++)
+    {
+        const std::complex<double> zk = z[kk];
+        const std::complex<double> zc = std::conj(z[(n-kk) & (n-1)]);
+        // A = (zk + zc) / 2, B = (zk - zc) / 2i
+        prod[kk] = (zk + zc) * (zk - zc) * std::complex<double>(0.0, -0.25);
+    }
+    fft(prod.data(), n, roots.data(), true);
+
+    double sum_a = 0.0, sum_b = 0.0;
+    for(size_t ii = 0; ii < a.values.size(); ii++)
+        sum_a += a.values[ii];
+    for(size_t ii = 0; ii < b.values.size(); ii++)
+        sum_b += b.values[ii];
+    const double err = 8.0 * log2(static_cast<double>(n)) * std::numeric_limits<double>::epsilon() * sum_a * sum_b;
+
+    // What is left of the zeros is rounding noise, possibly negative
+    const double scale = 1.0 / static_cast<double>(n);
+    for(size_t ii = 0; ii < out.values.size(); ii++)
+        out.values[ii] = std::max(0.0, prod[ii].real() * scale);
+
+    return err;
+}
+
+// Returns the estimate of the rounding error per point
+double convolve(const Histogram& a, const Histogram& b, Histogram& out, BinnedConvolution convolution)
+{
+    out.offset = a.offset + b.offset;
+    out.values.assign(a.values.size() + b.values.size() - 1, 0.0);
+
+    size_t n = 1;
+    while(n < out.values.size())
+        n <<= 1;
+    const double direct_cost = static_cast<double>(std::min(a.nonzero, b.nonzero)) * static_cast<double>(a.nonzero <= b.nonzero ? b.values.size() : a.values.size());
+    const double fft_cost = 4.0 * static_cast<double>(n) * log2(static_cast<double>(n));
+
+    double err = 0.0;
+    if(convolution == BINNED_CONVOLUTION_DIRECT or (convolution == BINNED_CONVOLUTION_AUTO and direct_cost <= fft_cost))
+        convolve_direct(a, b, out);
+    else
+        err = convolve_fft(a, b, out, n);
+
+    out.nonzero = 0;
+    for(size_t ii = 0; ii < out.values.size(); ii++)
+        if(out.values[ii] > 0.0)
+            out.nonzero++;
+    return err;
+}
+
+}
+
+
+BinnedSpectrum::BinnedSpectrum(Iso&& iso, double _bucket_width, double threshold, bool absolute, unsigned int sub_buckets, int tabSize, int hashSize,
+                               BinnedConvolution convolution) :
+bucket_width(_bucket_width),
+first_bucket(0),
+n_buckets(0),
+probs(nullptr),
+total_prob(0.0),
+extra_prob(0.0),
+max_mass_shift(0.0),
+prob_error(0.0)
+{
+    const int dimNumber = iso.getDimNumber();
+    const double Lcutoff = absolute ? log(threshold) : log(threshold) + iso.getModeLProb();
+    if(dimNumber == 0 or sub_buckets == 0 or not (bucket_width > 0.0))
+        return;
+
+    PrecalculatedMarginal** PMs = iso.get_sorted_marginal_set(Lcutoff, true, tabSize, hashSize);
+
+    const double fine_width = bucket_width / sub_buckets;
+    std::vector<Histogram> hists(dimNumber);
+    double product = 1.0;
+    bool empty = false;
+    for(int ii = 0; ii < dimNumber; ii++)
+    {
+        const PrecalculatedMarginal* PM = PMs[ii];
+        const unsigned int no_confs = PM->get_no_confs();
+        if(no_confs == 0)
+        {
+            empty = true;
+            break;
+        }
+        long lo = std::numeric_limits<long>::max(), hi = std::numeric_limits<long>::min();
+        for(unsigned int jj = 0; jj < no_confs; jj++)
+        {
+            const long idx = lround(PM->get_mass(jj) / fine_width);
+            lo = std::min(lo, idx);
+            hi = std::max(hi, idx);
+        }
+        hists[ii].offset = lo;
+        hists[ii].values.assign(hi - lo + 1, 0.0);
+        for(unsigned int jj = 0; jj < no_confs; jj++)
+            hists[ii].values[lround(PM->get_mass(jj) / fine_width) - lo] += PM->get_eProb(jj);
+        hists[ii].nonzero = 0;
+        for(size_t jj = 0; jj < hists[ii].values.size(); jj++)
+            if(hists[ii].values[jj] > 0.0)
+                hists[ii].nonzero++;
+        product *= PM->get_cumEProbs_ptr()[no_confs];
+    }
+
+    if(not empty)
+        extra_prob = std::max(0.0, product - threshold_total_prob(PMs, dimNumber, Lcutoff));
+
+    dealloc_table(PMs, dimNumber);
+    if(empty)
+        return;
+
+    // The narrow ones first, so that the intermediate results stay small as long as possible
+    std::sort(hists.begin(), hists.end(), [](const Histogram& a, const Histogram& b) { return a.values.size() < b.values.size(); });
+    Histogram acc, tmp;
+    acc.offset = 0;
+    acc.values.assign(1, 1.0);
+    acc.nonzero = 1;
+    double fine_error = 0.0;
+    for(int ii = 0; ii < dimNumber; ii++)
+    {
+        // Errors already there are spread by the convolution, but not amplified: it sums to at most 1
+        fine_error += convolve(acc, hists[ii], tmp, convolution);
+        std::swap(acc, tmp);
+    }
+
+    // Back to the buckets: fine point s is at mass s*fine_width, in bucket floor(s / sub_buckets)
+    const long sub = static_cast<long>(sub_buckets);
+    auto bucket_of = [sub](long s) { return s >= 0 ? s / sub : -((-s + sub - 1) / sub); };
+    first_bucket = bucket_of(acc.offset);
+    n_buckets = bucket_of(acc.offset + static_cast<long>(acc.values.size()) - 1) - first_bucket + 1;
+    probs = new double[n_buckets];
+    memset(probs, 0, n_buckets * sizeof(double));
+    for(size_t ii = 0; ii < acc.values.size(); ii++)
+        probs[bucket_of(acc.offset + static_cast<long>(ii)) - first_bucket] += acc.values[ii];
+
+    Summator s;
+    for(unsigned long ii = 0; ii < n_buckets; ii++)
+        s.add(probs[ii]);
+    total_prob = s.get();
+    max_mass_shift = 0.5 * fine_width * dimNumber;
+    prob_error = fine_error * sub_buckets;
+}
+
+BinnedSpectrum::~BinnedSpectrum()
+{
+    delete[] probs;
+}
@@ -0,0 +1,81 @@
+/*
+ *   Copyright (C) 2015-2016 Mateusz Łącki and Michał Startek.
+ *
+ *   This file is part of IsoSpec.
+ *
+ *   IsoSpec is free software: you can redistribute it and/or modify
+ *   it under the terms of the Simplified ("2-clause") BSD licence.
+ *
+ *   IsoSpec is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ *   You should have received a copy of the Simplified BSD Licence
+ *   along with IsoSpec.  If not, see <https://opensource.org/licenses/BSD-2-Clause>.
+ */
+
+
+/*
+ * Binned isotope patterns without enumerating the configurations: each marginal (above its
+ * share of the threshold, as in IsoThresholdGenerator) is binned on a grid sub_buckets times
+ * finer than the buckets, the histograms are convolved, and the result is summed up into the
+ * buckets. Bucket ii holds the masses in [(first_bucket+ii)*bucket_width, (first_bucket+ii+1)*bucket_width),
+ * as in Spectrum.
+ *
+ * Compared to binning the configurations above the threshold, the result differs in three ways,
+ * all reported:
+ *  - every configuration is moved by at most get_max_mass_shift() (each marginal is rounded to
+ *    the fine grid), so it may land in a neighbouring bucket if it lies that close to the edge,
+ *  - it includes the configurations of the marginals which are, together, below the threshold:
+ *    get_extra_prob() of them in total,
+ *  - convolutions done by FFT add rounding noise, of about get_prob_error() per bucket at most.
+ *    This is an estimate (the usual O(eps log n) growth of FFT errors, scaled by the masses
+ *    convolved), not a proven bound; the direct convolution is exact up to ordinary rounding.
+ */
+
+#ifndef BINNEDSPECTRUM_HPP
+#define BINNEDSPECTRUM_HPP
+
+#include "isoSpec++.h"
+
+
+// How the histograms are convolved. AUTO picks, per convolution, whichever is cheaper for
+// the sizes and numbers of nonzero points at hand; the others are mostly there for testing.
+enum BinnedConvolution
+{
+    BINNED_CONVOLUTION_AUTO = 0,
+    BINNED_CONVOLUTION_DIRECT = 1,
+    BINNED_CONVOLUTION_FFT = 2
+};
+
+class BinnedSpectrum
+{
+private:
+    double bucket_width;
+    long first_bucket;
+    unsigned long n_buckets;
+    double* probs;
+    double total_prob;
+    double extra_prob;
+    double max_mass_shift;
+    double prob_error;
+
+public:
+    BinnedSpectrum(Iso&& iso, double bucket_width, double threshold, bool absolute = true, unsigned int sub_buckets = 16, int tabSize = 1000, int hashSize = 1000,
+                   BinnedConvolution convolution = BINNED_CONVOLUTION_AUTO);
+    BinnedSpectrum(const BinnedSpectrum& other) = delete;
+    BinnedSpectrum& operator=(const BinnedSpectrum& other) = delete;
+    ~BinnedSpectrum();
+
+    inline unsigned long get_n_buckets() const { return n_buckets; };
+    inline const double* get_probs() const { return probs; };
+    // Lower end of bucket ii
+    inline double get_bucket_mass(unsigned long ii) const { return static_cast<double>(first_bucket + static_cast<long>(ii)) * bucket_width; };
+    inline double get_total_prob() const { return total_prob; };
+    inline double get_extra_prob() const { return extra_prob; };
+    inline double get_max_mass_shift() const { return max_mass_shift; };
+    // 0.0 unless some convolution was done by FFT
+    inline double get_prob_error() const { return prob_error; };
+};
+
+#endif
@@ -0,0 +1,84 @@
+/*
+ *   Copyright (C) 2015-2016 Mateusz Łącki and Michał Startek.
+ *
+ *   This file is part of IsoSpec.
+ *
+ *   IsoSpec is free software: you can redistribute it and/or modify
+ *   it under the terms of the Simplified ("2-clause") BSD licence.
+ *
+ *   IsoSpec is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ *   You should have received a copy of the Simplified BSD Licence
+ *   along with IsoSpec.  If not, see <https://opensource.org/licenses/BSD-2-Clause>.
+ */
+
+
+#include "confSet.h"
+
+// Above that many configurations in the simplex (bits of the bitmap) we hash instead
+#define CONFSET_DENSE_LIMIT (size_t(1) << 20)
+
+
+ConfSet::ConfSet(int _dim, int atomCnt, int hashSize) :
+dim(_dim),
+confBytes(_dim*sizeof(int)),
+bitmap(nullptr),
+binom(nullptr),
+rowSize(atomCnt + _dim),
+slots(nullptr),
+mask(0),
+used(0)
+{
+    // C(atomCnt+dim-1, dim-1) configurations, computed so that it stops as soon as it is too many
+    size_t total = 1;
+    for(int jj = 1; jj < dim and total <= CONFSET_DENSE_LIMIT; jj++)
+        total = total * (atomCnt + jj) / jj;
+
+    if(total <= CONFSET_DENSE_LIMIT)
+    {
+        bitmap = new uint64_t[total/64 + 1];
+        memset(bitmap, 0, (total/64 + 1) * sizeof(uint64_t));
+        binom = new size_t[(dim-1)*rowSize + 1];
+        for(int jj = 0; jj < dim-1; jj++)
+        {
+            size_t* row = binom + jj*rowSize;
+            // C(x, jj+1) = C(x-1, jj) + C(x-1, jj+1)
+            row[0] = 0;
+            for(size_t x = 1; x < rowSize; x++)
+                row[x] = (jj == 0 ? 1 : binom[(jj-1)*rowSize + x-1]) + row[x-1];
+        }
+        return;
+    }
+
+    size_t capacity = 16;
+    while(capacity < 2 * static_cast<size_t>(hashSize > 0 ? hashSize : 1))
+        capacity <<= 1;
+    slots = new Slot[capacity];
+    memset(slots, 0, capacity * sizeof(Slot));
+    mask = capacity - 1;
+}
+
+ConfSet::~ConfSet()
+{
+    delete[] bitmap;
+    delete[] binom;
+    delete[] slots;
+}
+
+void ConfSet::grow()
+{
+    Slot* old = slots;
+    const size_t old_capacity = mask + 1;
+
+    slots = new Slot[2*old_capacity];
+    memset(slots, 0, 2 * old_capacity * sizeof(Slot));
+    mask = 2*old_capacity - 1;
+
+    for(size_t ii = 0; ii < old_capacity; ii++)
+        if(old[ii].conf != nullptr)
+            place(old[ii].conf, old[ii].hash);
+
+    delete[] old;
+}
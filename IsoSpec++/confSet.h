@@ -0,0 +1,129 @@
+/*
+ *   Copyright (C) 2015-2016 Mateusz Łącki and Michał Startek.
+ *
+ *   This file is part of IsoSpec.
+ *
+ *   IsoSpec is free software: you can redistribute it and/or modify
+ *   it under the terms of the Simplified ("2-clause") BSD licence.
+ *
+ *   IsoSpec is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ *   You should have received a copy of the Simplified BSD Licence
+ *   along with IsoSpec.  If not, see <https://opensource.org/licenses/BSD-2-Clause>.
+ */
+
+
+#ifndef CONFSET_HPP
+#define CONFSET_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string.h>
+#include "conf.h"
+
+
+/*
+ * Set of the configurations of a single marginal (atomCnt atoms over dim isotopes), for
+ * keeping track of what the exploration has already visited.
+ *
+ * If the whole simplex is small, configurations are ranked in the combinatorial number
+ * system and the set is a bitmap: a lookup is a single bit test. Otherwise it is an
+ * open addressing (linear probing) table of pointers to the configurations, which have to
+ * stay alive as long as the set does; they are in the marginals' allocators anyway.
+ */
+class ConfSet
+{
+private:
+    struct Slot
+    {
+        size_t hash;
+        const int* conf;
+    };
+
+    const int dim;
+    const size_t confBytes;
+
+    // Dense: binom[j*(atomCnt+dim)+x] = C(x, j+1)
+    uint64_t* bitmap;
+    size_t* binom;
+    size_t rowSize;
+
+    // Sparse
+    Slot* slots;
+    size_t mask;
+    size_t used;
+
+public:
+    // hashSize is a hint of how many configurations are going to be inserted
+    ConfSet(int dim, int atomCnt, int hashSize = 1000);
+    ConfSet(const ConfSet& other) = delete;
+    ConfSet& operator=(const ConfSet& other) = delete;
+    ~ConfSet();
+
+    inline bool contains(const int* conf) const
+    {
+        if(bitmap != nullptr)
+        {
+            const size_t r = rank(conf);
+            return (bitmap[r >> 6] >> (r & 63)) & 1;
+        }
+        const size_t h = hash(conf);
+        for(size_t ii = h & mask; slots[ii].conf != nullptr; ii = (ii+1) & mask)
+            if(slots[ii].hash == h and memcmp(slots[ii].conf, conf, confBytes) == 0)
+                return true;
+        return false;
+    }
+
+    // Does not check whether conf is already there
+    inline void insert(const int* conf)
+    {
+        if(bitmap != nullptr)
+        {
+            const size_t r = rank(conf);
+            bitmap[r >> 6] |= uint64_t(1) << (r & 63);
+            return;
+        }
+        if(2*(used+1) > mask+1)
+            grow();
+        place(conf, hash(conf));
+        used++;
+    }
+
+private:
+    // Rank among all configurations of the simplex: the partial sums (shifted to be
+    // strictly increasing) as a combination, in the combinatorial number system
+    inline size_t rank(const int* conf) const
+    {
+        size_t r = 0;
+        int s = 0;
+        for(int jj = 0; jj < dim-1; jj++)
+        {
+            s += conf[jj];
+            r += binom[jj*rowSize + s + jj];
+        }
+        return r;
+    }
+
+    inline size_t hash(const int* conf) const
+    {
+        uint64_t h = 0;
+        for(int ii = 0; ii < dim; ii++)
+            h = (h + static_cast<unsigned int>(conf[ii])) * 0x9E3779B97F4A7C15ULL;
+        return static_cast<size_t>(h ^ (h >> 32));
+    }
+
+    inline void place(const int* conf, size_t h)
+    {
+        size_t ii = h & mask;
+        while(slots[ii].conf != nullptr)
+            ii = (ii+1) & mask;
+        slots[ii].hash = h;
+        slots[ii].conf = conf;
+    }
+
+    void grow();
+};
+
+#endif
@@ -23,6 +23,8 @@
 #include "cwrapper.h"
 #include "misc.h"
 #include "marginalTrek++.h"
+#include "marginalCache.h"
+#include "batch.h"
 #include "isoSpec++.h"
 
 
@@ -114,6 +116,333 @@ void* setupIsoLayered( int      _dimNumber,
 }
 
 
+void* setupIsoThreshold( int             _dimNumber,
+                         const int*      _isotopeNumbers,
+                         const int*      _atomCounts,
+                         const double*   _isotopeMasses,
+                         const double*   _isotopeProbabilities,
+                         const double    _threshold,
+                         int             _absolute,
+                         int             tabSize,
+                         int             hashSize
+)
+{
+    const double** IM = new const double*[_dimNumber];
+    const double** IP = new const double*[_dimNumber];
+    int idx = 0;
+    for(int i=0; i<_dimNumber; i++)
+    {
+        IM[i] = &_isotopeMasses[idx];
+        IP[i] = &_isotopeProbabilities[idx];
+        idx += _isotopeNumbers[i];
+    }
+
+    IsoThresholdGenerator* iso;
+    try {
+        iso = new IsoThresholdGenerator(
+            Iso(_dimNumber, _isotopeNumbers, _atomCounts, IM, IP),
+            _threshold,
+            _absolute != 0,
+            tabSize,
+            hashSize
+        );
+    }
+    catch (std::bad_alloc& ba) {
+        iso = NULL;
+    }
+
+    delete[] IM;
+    delete[] IP;
+
+    return reinterpret_cast<void*>(iso);
+}
+
+size_t getIsoThresholdConfNo(void* iso)
+{
+    return reinterpret_cast<IsoThresholdGenerator*>(iso)->count();
+}
+
+size_t getIsoThresholdConfs( void*   iso,
+                             size_t  capacity,
+                             double* res_mass,
+                             double* res_prob,
+                             int*    res_isoCounts
+)
+{
+    IsoThresholdGenerator* gen = reinterpret_cast<IsoThresholdGenerator*>(iso);
+
+    if(res_isoCounts == NULL)
+        return gen->fill(res_mass, res_prob, capacity);
+
+    const int allDim = gen->getAllDim();
+    size_t cnt = 0;
+    while(cnt < capacity and gen->advanceToNextConfiguration())
+    {
+        res_mass[cnt] = gen->mass();
+        res_prob[cnt] = gen->eprob();
+        gen->get_isotope_counts(res_isoCounts + cnt*allDim);
+        cnt++;
+    }
+    return cnt;
+}
+
+void destroyIsoThreshold(void* iso)
+{
+    if (iso != NULL)
+    {
+        delete reinterpret_cast<IsoThresholdGenerator*>(iso);
+    }
+}
+
+int getIsoThresholdMaxExtraNeutrons(void* iso)
+{
+    return reinterpret_cast<IsoThresholdGenerator*>(iso)->max_extra_neutrons();
+}
+
+void getIsoThresholdNeutronAggregates(void* iso, double* res_prob, double* res_mass)
+{
+    reinterpret_cast<IsoThresholdGenerator*>(iso)->aggregate_by_neutrons(res_prob, res_mass);
+}
+
+
+void* setupIsoThresholdBoundMass( int             _dimNumber,
+                                  const int*      _isotopeNumbers,
+                                  const int*      _atomCounts,
+                                  const double*   _isotopeMasses,
+                                  const double*   _isotopeProbabilities,
+                                  const double    _threshold,
+                                  int             _absolute,
+                                  double          min_mass,
+                                  double          max_mass,
+                                  int             tabSize,
+                                  int             hashSize
+)
+{
+    const double** IM = new const double*[_dimNumber];
+    const double** IP = new const double*[_dimNumber];
+    int idx = 0;
+    for(int i=0; i<_dimNumber; i++)
+    {
+        IM[i] = &_isotopeMasses[idx];
+        IP[i] = &_isotopeProbabilities[idx];
+        idx += _isotopeNumbers[i];
+    }
+
+    IsoThresholdGeneratorBoundMass* iso;
+    try {
+        iso = new IsoThresholdGeneratorBoundMass(
+            Iso(_dimNumber, _isotopeNumbers, _atomCounts, IM, IP),
+            _threshold,
+            min_mass,
+            max_mass,
+            _absolute != 0,
+            tabSize,
+            hashSize
+        );
+    }
+    catch (std::bad_alloc& ba) {
+        iso = NULL;
+    }
+
+    delete[] IM;
+    delete[] IP;
+
+    return reinterpret_cast<void*>(iso);
+}
+
+size_t getIsoThresholdBoundMassConfs( void*   iso,
+                                      size_t  capacity,
+                                      double* res_mass,
+                                      double* res_prob
+)
+{
+    return reinterpret_cast<IsoThresholdGeneratorBoundMass*>(iso)->fill(res_mass, res_prob, capacity);
+}
+
+void destroyIsoThresholdBoundMass(void* iso)
+{
+    if (iso != NULL)
+    {
+        delete reinterpret_cast<IsoThresholdGeneratorBoundMass*>(iso);
+    }
+}
+
+void* setupIsoThresholdMultiWindow( int             _dimNumber,
+                                    const int*      _isotopeNumbers,
+                                    const int*      _atomCounts,
+                                    const double*   _isotopeMasses,
+                                    const double*   _isotopeProbabilities,
+                                    const double    _threshold,
+                                    int             _absolute,
+                                    const double*   window_mins,
+                                    const double*   window_maxs,
+                                    unsigned int    no_windows,
+                                    int             tabSize,
+                                    int             hashSize
+)
+{
+    const double** IM = new const double*[_dimNumber];
+    const double** IP = new const double*[_dimNumber];
+    int idx = 0;
+    for(int i=0; i<_dimNumber; i++)
+    {
+        IM[i] = &_isotopeMasses[idx];
+        IP[i] = &_isotopeProbabilities[idx];
+        idx += _isotopeNumbers[i];
+    }
+
+    IsoThresholdGeneratorBoundMass* iso;
+    try {
+        iso = new IsoThresholdGeneratorBoundMass(
+            Iso(_dimNumber, _isotopeNumbers, _atomCounts, IM, IP),
+            _threshold,
+            window_mins,
+            window_maxs,
+            no_windows,
+            _absolute != 0,
+            tabSize,
+            hashSize
+        );
+    }
+    catch (std::exception& e) {
+        iso = NULL;
+    }
+
+    delete[] IM;
+    delete[] IP;
+
+    return reinterpret_cast<void*>(iso);
+}
+
+size_t getIsoThresholdMultiWindowConfs( void*         iso,
+                                        size_t        capacity,
+                                        double*       res_mass,
+                                        double*       res_prob,
+                                        unsigned int* res_window
+)
+{
+    return reinterpret_cast<IsoThresholdGeneratorBoundMass*>(iso)->fill(res_mass, res_prob, capacity, res_window);
+}
+
+
+int getTopKConfs( int             _dimNumber,
+                  const int*      _isotopeNumbers,
+                  const int*      _atomCounts,
+                  const double*   _isotopeMasses,
+                  const double*   _isotopeProbabilities,
+                  int             K,
+                  double*         res_mass,
+                  double*         res_logProb,
+                  int*            res_isoCounts
+)
+{
+    if(K <= 0)
+        return 0;
+
+    const double** IM = new const double*[_dimNumber];
+    const double** IP = new const double*[_dimNumber];
+    int idx = 0;
+    for(int i=0; i<_dimNumber; i++)
+    {
+        IM[i] = &_isotopeMasses[idx];
+        IP[i] = &_isotopeProbabilities[idx];
+        idx += _isotopeNumbers[i];
+    }
+
+    int ret;
+    try {
+        Iso iso(_dimNumber, _isotopeNumbers, _atomCounts, IM, IP);
+        ret = getTopK(std::move(iso), K, res_mass, res_logProb, res_isoCounts);
+    }
+    catch (std::bad_alloc& ba) {
+        ret = -1;
+    }
+
+    delete[] IM;
+    delete[] IP;
+
+    return ret;
+}
+
+
+void setMarginalCacheCapacity(size_t capacity)
+{
+    MarginalCache::global().set_capacity(capacity);
+}
+
+void clearMarginalCache()
+{
+    MarginalCache::global().clear();
+}
+
+void getMarginalCacheStats(size_t* hits, size_t* misses, size_t* entries, size_t* confs)
+{
+    MarginalCacheStats stats = MarginalCache::global().get_stats();
+    *hits = stats.hits;
+    *misses = stats.misses;
+    *entries = stats.entries;
+    *confs = stats.confs;
+}
+
+int saveMarginalCache(const char* path)
+{
+    return MarginalCache::global().save(path) ? 1 : 0;
+}
+
+int mapMarginalCacheFile(const char* path)
+{
+    return MarginalCache::global().map_file(path) ? 1 : 0;
+}
+
+void* isoThresholdBatchFormulas(const char**  formulas,
+                                size_t        no_molecules,
+                                double        threshold,
+                                int           absolute,
+                                unsigned int  n_threads
+)
+{
+    IsoBatchResult* res = new IsoBatchResult();
+    IsoBatchOptions options(threshold, absolute != 0);
+    options.n_threads = n_threads;
+    try {
+        isoThresholdBatch(formulas, no_molecules, options, *res);
+    }
+    catch (std::exception& e) {
+        delete res;
+        res = NULL;
+    }
+    return reinterpret_cast<void*>(res);
+}
+
+size_t getBatchConfNo(void* batch)
+{
+    return reinterpret_cast<IsoBatchResult*>(batch)->get_no_confs();
+}
+
+const size_t* getBatchOffsets(void* batch)
+{
+    return reinterpret_cast<IsoBatchResult*>(batch)->offsets;
+}
+
+const double* getBatchMasses(void* batch)
+{
+    return reinterpret_cast<IsoBatchResult*>(batch)->masses;
+}
+
+const double* getBatchProbs(void* batch)
+{
+    return reinterpret_cast<IsoBatchResult*>(batch)->probs;
+}
+
+void destroyBatch(void* batch)
+{
+    if (batch != NULL)
+    {
+        delete reinterpret_cast<IsoBatchResult*>(batch);
+    }
+}
+
+
 int getIsotopesNo(void* iso)
 {
     return reinterpret_cast<IsoSpec*>(iso)->getNoIsotopesTotal();
@@ -25,6 +25,8 @@
 #define ALGO_THRESHOLD_RELATIVE 3
 #define ALGO_LAYERED_ESTIMATE 4
 
+#include <stddef.h>
+
 
 #ifdef __cplusplus
 extern "C" {
@@ -64,6 +66,123 @@ void* setupIsoThreshold( int             _dimNumber,
                          int             hashSize
 );
 
+// Writes the K most probable configurations (in descending order) into the res_ arrays,
+// res_isoCounts may be NULL. Returns how many were written, or -1 if out of memory.
+int getTopKConfs( int             _dimNumber,
+                  const int*      _isotopeNumbers,
+                  const int*      _atomCounts,
+                  const double*   _isotopeMasses,
+                  const double*   _isotopeProbabilities,
+                  int             K,
+                  double*         res_mass,
+                  double*         res_logProb,
+                  int*            res_isoCounts
+);
+
+// Two-pass interface to the threshold generator (setupIsoThreshold): getIsoThresholdConfNo
+// gives the exact number of configurations, then getIsoThresholdConfs writes up to capacity
+// of them into caller-allocated arrays. res_prob are probabilities (not logarithms), and
+// res_isoCounts (allDim ints per configuration) may be NULL if not needed.
+size_t getIsoThresholdConfNo(void* iso);
+
+size_t getIsoThresholdConfs( void*   iso,
+                             size_t  capacity,
+                             double* res_mass,
+                             double* res_prob,
+                             int*    res_isoCounts
+);
+
+void destroyIsoThreshold(void* iso);
+
+// Instead of the configurations: their total probability and mean mass (weighted by
+// probability) per number of extra neutrons, 0..getIsoThresholdMaxExtraNeutrons(iso)
+int getIsoThresholdMaxExtraNeutrons(void* iso);
+
+void getIsoThresholdNeutronAggregates(void* iso, double* res_prob, double* res_mass);
+
+// Configurations above the threshold with masses in [min_mass, max_mass], in no particular
+// order: getIsoThresholdBoundMassConfs writes up to capacity further ones on every call,
+// and returns how many, so it is done when that is less than capacity.
+void* setupIsoThresholdBoundMass( int             _dimNumber,
+                                  const int*      _isotopeNumbers,
+                                  const int*      _atomCounts,
+                                  const double*   _isotopeMasses,
+                                  const double*   _isotopeProbabilities,
+                                  const double    _threshold,
+                                  int             _absolute,
+                                  double          min_mass,
+                                  double          max_mass,
+                                  int             tabSize,
+                                  int             hashSize
+);
+
+size_t getIsoThresholdBoundMassConfs( void*   iso,
+                                      size_t  capacity,
+                                      double* res_mass,
+                                      double* res_prob
+);
+
+void destroyIsoThresholdBoundMass(void* iso);
+
+// The same for several windows, sorted and disjoint (NULL if they are not, or out of memory),
+// in one pass: the ones written into res_window are indices of the windows the configurations
+// are in. The results are destroyed with destroyIsoThresholdBoundMass.
+void* setupIsoThresholdMultiWindow( int             _dimNumber,
+                                    const int*      _isotopeNumbers,
+                                    const int*      _atomCounts,
+                                    const double*   _isotopeMasses,
+                                    const double*   _isotopeProbabilities,
+                                    const double    _threshold,
+                                    int             _absolute,
+                                    const double*   window_mins,
+                                    const double*   window_maxs,
+                                    unsigned int    no_windows,
+                                    int             tabSize,
+                                    int             hashSize
+);
+
+size_t getIsoThresholdMultiWindowConfs( void*         iso,
+                                        size_t        capacity,
+                                        double*       res_mass,
+                                        double*       res_prob,
+                                        unsigned int* res_window
+);
+
+// Marginal tables cache shared by all threshold generators: capacity is in configurations,
+// 0 (the default) disables it. Statistics are counted since the last clear.
+void setMarginalCacheCapacity(size_t capacity);
+
+void clearMarginalCache();
+
+void getMarginalCacheStats(size_t* hits, size_t* misses, size_t* entries, size_t* confs);
+
+// Saves the cached tables to a file, which later runs or other processes map read-only
+// with mapMarginalCacheFile. Both return 1 on success and 0 on failure.
+int saveMarginalCache(const char* path);
+
+int mapMarginalCacheFile(const char* path);
+
+// Threshold configurations of many molecules at once, over n_threads threads (0: all
+// processors). Returns NULL if a formula is invalid or memory runs out. Molecule ii has
+// configurations offsets[ii] to offsets[ii+1]-1 of the masses and probs arrays, which
+// belong to the batch and go away with destroyBatch.
+void* isoThresholdBatchFormulas(const char**  formulas,
+                                size_t        no_molecules,
+                                double        threshold,
+                                int           absolute,
+                                unsigned int  n_threads
+);
+
+size_t getBatchConfNo(void* batch);
+
+const size_t* getBatchOffsets(void* batch);
+
+const double* getBatchMasses(void* batch);
+
+const double* getBatchProbs(void* batch);
+
+void destroyBatch(void* batch);
+
 int getIsotopesNo(void* iso);
 
 int getIsoConfNo(void* iso);
@@ -312,7 +312,7 @@ const int elem_table_atomicNo [NUMBER_OF_ISOTOPIC_ENTRIES] = {
 };
 
 
-const double elem_table_mass [NUMBER_OF_ISOTOPIC_ENTRIES] = {
+ALIGNED_TABLE const double elem_table_mass [NUMBER_OF_ISOTOPIC_ENTRIES] = {
 1.00782503227,
 2.01410177819,
 3.016029322,
@@ -2064,7 +2064,7 @@ true,
 };
 
 
-const double elem_table_probability [NUMBER_OF_ISOTOPIC_ENTRIES] = {
+ALIGNED_TABLE const double elem_table_probability [NUMBER_OF_ISOTOPIC_ENTRIES] = {
 0.999884290164307909520857720053754746913909912109375000000000,
 0.000115709835692033314582735648023970043141162022948265075684,
 0.000001342999991941999914655050951672876635711872950196266174,
@@ -2356,7 +2356,7 @@ const double elem_table_probability [NUMBER_OF_ISOTOPIC_ENTRIES] = {
 };
 
 
-const double elem_table_log_probability [NUMBER_OF_ISOTOPIC_ENTRIES] = {
+ALIGNED_TABLE const double elem_table_log_probability [NUMBER_OF_ISOTOPIC_ENTRIES] = {
 -0.000115716530591520062594239337538937206772970966994762420654,
 -9.064424917075021070900220365729182958602905273437500000000000,
 -13.520604646423175054792409355286508798599243164062500000000000,
@@ -2647,6 +2647,183 @@ const double elem_table_log_probability [NUMBER_OF_ISOTOPIC_ENTRIES] = {
 0.000000000000000000000000000000000000000000000000000000000000,
 };
 
+
+// Per element: where its isotopes start in the tables above, and how many there are
+const int elem_table_element_first [NUMBER_OF_ELEMENTS] = {
+0,
+2,
+4,
+6,
+7,
+9,
+11,
+13,
+16,
+17,
+20,
+21,
+24,
+25,
+28,
+29,
+33,
+35,
+38,
+41,
+47,
+48,
+53,
+55,
+59,
+60,
+64,
+65,
+70,
+72,
+77,
+79,
+84,
+85,
+91,
+93,
+99,
+101,
+105,
+106,
+111,
+112,
+119,
+126,
+127,
+133,
+135,
+143,
+145,
+155,
+157,
+165,
+166,
+175,
+176,
+183,
+185,
+189,
+190,
+197,
+204,
+206,
+213,
+214,
+221,
+222,
+228,
+229,
+236,
+238,
+244,
+246,
+251,
+253,
+260,
+262,
+268,
+269,
+276,
+278,
+282,
+283,
+286,
+287,
+};
+
+
+const int elem_table_element_isotopeNo [NUMBER_OF_ELEMENTS] = {
+2,
+2,
+2,
+1,
+2,
+2,
+2,
+3,
+1,
+3,
+1,
+3,
+1,
+3,
+1,
+4,
+2,
+3,
+3,
+6,
+1,
+5,
+2,
+4,
+1,
+4,
+1,
+5,
+2,
+5,
+2,
+5,
+1,
+6,
+2,
+6,
+2,
+4,
+1,
+5,
+1,
+7,
+7,
+1,
+6,
+2,
+8,
+2,
+10,
+2,
+8,
+1,
+9,
+1,
+7,
+2,
+4,
+1,
+7,
+7,
+2,
+7,
+1,
+7,
+1,
+6,
+1,
+7,
+2,
+6,
+2,
+5,
+2,
+7,
+2,
+6,
+1,
+7,
+2,
+4,
+1,
+3,
+1,
+1,
+};
+
 #ifdef __cplusplus
 }
 #endif
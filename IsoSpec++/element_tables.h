@@ -25,6 +25,14 @@ extern "C" {
 
 
 #define NUMBER_OF_ISOTOPIC_ENTRIES 288
+#define NUMBER_OF_ELEMENTS 84
+
+// The double tables start on a cache line
+#if defined(__cplusplus) && __cplusplus >= 201103L
+#define ALIGNED_TABLE alignas(64)
+#else
+#define ALIGNED_TABLE
+#endif
 
 extern const int elem_table_atomicNo[NUMBER_OF_ISOTOPIC_ENTRIES];
 extern const double elem_table_probability[NUMBER_OF_ISOTOPIC_ENTRIES];
@@ -36,6 +44,12 @@ extern const char* elem_table_symbol[NUMBER_OF_ISOTOPIC_ENTRIES];
 extern const bool elem_table_Radioactive[NUMBER_OF_ISOTOPIC_ENTRIES];
 extern const double elem_table_log_probability[NUMBER_OF_ISOTOPIC_ENTRIES];
 
+// The isotopes of an element are consecutive in the tables above: element ii (in order of
+// appearance, not atomic number) has elem_table_element_isotopeNo[ii] of them, starting at
+// elem_table_element_first[ii]. Its masses, probabilities etc. are contiguous there.
+extern const int elem_table_element_first[NUMBER_OF_ELEMENTS];
+extern const int elem_table_element_isotopeNo[NUMBER_OF_ELEMENTS];
+
 
 #ifdef __cplusplus
 }
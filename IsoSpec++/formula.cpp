@@ -0,0 +1,204 @@
+/*
+ *   Copyright (C) 2015-2016 Mateusz Łącki and Michał Startek.
+ *
+ *   This file is part of IsoSpec.
+ *
+ *   IsoSpec is free software: you can redistribute it and/or modify
+ *   it under the terms of the Simplified ("2-clause") BSD licence.
+ *
+ *   IsoSpec is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ *   You should have received a copy of the Simplified BSD Licence
+ *   along with IsoSpec.  If not, see <https://opensource.org/licenses/BSD-2-Clause>.
+ */
+
+
+#include <limits>
+#include <stdexcept>
+#include "formula.h"
+#include "element_tables.h"
+
+
+const double certain_isotope_probability[1] = {1.0};
+
+// Symbols are [A-Z][a-z]?: 26 first letters times 27 (no second letter, or a-z)
+#define SYMBOL_SLOTS (26*27)
+
+namespace {
+
+struct SymbolIndex
+{
+    signed char element[SYMBOL_SLOTS];
+
+    SymbolIndex()
+    {
+        for(int ii = 0; ii < SYMBOL_SLOTS; ii++)
+            element[ii] = -1;
+        for(int ii = 0; ii < NUMBER_OF_ELEMENTS; ii++)
+        {
+            const char* s = elem_table_symbol[elem_table_element_first[ii]];
+            element[(s[0] - 'A') * 27 + (s[1] == '\0' ? 0 : s[1] - 'a' + 1)] = ii;
+        }
+    }
+};
+
+// Built on first use, which is thread-safe for function-local statics
+inline const SymbolIndex& symbol_index()
+{
+    static const SymbolIndex index;
+    return index;
+}
+
+inline bool is_upper(char c) { return c >= 'A' and c <= 'Z'; }
+inline bool is_lower(char c) { return c >= 'a' and c <= 'z'; }
+inline bool is_digit(char c) { return c >= '0' and c <= '9'; }
+
+// Reads an optional count at p, 1 if there is none
+long long read_count(const char*& p)
+{
+    if(not is_digit(*p))
+        return 1;
+    long long ret = 0;
+    while(is_digit(*p))
+    {
+        ret = ret * 10 + (*p - '0');
+        if(ret > std::numeric_limits<int>::max())
+            throw std::invalid_argument("Invalid formula");
+        p++;
+    }
+    return ret;
+}
+
+// Reads a symbol at p, returns the index of its first isotope
+int read_element(const char*& p, int* isotopeNo)
+{
+    if(not is_upper(*p))
+        throw std::invalid_argument("Invalid formula");
+    const size_t len = is_lower(p[1]) ? 2 : 1;
+    const int ret = find_element(p, len, isotopeNo);
+    if(ret < 0)
+        throw std::invalid_argument("Invalid formula");
+    p += len;
+    return ret;
+}
+
+// The count after the parenthesis opened at p
+long long group_count(const char* p)
+{
+    int depth = 0;
+    do
+    {
+        if(*p == '(')
+            depth++;
+        else if(*p == ')')
+            depth--;
+        else if(*p == '\0')
+            throw std::invalid_argument("Invalid formula");
+        p++;
+    } while(depth > 0);
+    return read_count(p);
+}
+
+} // namespace
+
+
+int find_element_index(const char* symbol, size_t len)
+{
+    if(len < 1 or len > 2 or not is_upper(symbol[0]) or (len == 2 and not is_lower(symbol[1])))
+        return -1;
+    return symbol_index().element[(symbol[0] - 'A') * 27 + (len == 1 ? 0 : symbol[1] - 'a' + 1)];
+}
+
+int find_element(const char* symbol, size_t len, int* isotopeNo)
+{
+    const int element = find_element_index(symbol, len);
+    if(element < 0)
+        return -1;
+    if(isotopeNo != nullptr)
+        *isotopeNo = elem_table_element_isotopeNo[element];
+    return elem_table_element_first[element];
+}
+
+unsigned int parse_formula_entries(const char* formula, FormulaEntry* out)
+{
+    // Multipliers of the open parentheses
+    long long multipliers[MAX_FORMULA_DEPTH+1];
+    int depth = 0;
+    multipliers[0] = 1;
+    unsigned int no_entries = 0;
+
+    const char* p = formula;
+    while(*p != '\0')
+    {
+        if(*p == '(')
+        {
+            if(depth == MAX_FORMULA_DEPTH)
+                throw std::invalid_argument("Invalid formula");
+            const long long m = multipliers[depth] * group_count(p);
+            if(m > std::numeric_limits<int>::max())
+                throw std::invalid_argument("Invalid formula");
+            multipliers[++depth] = m;
+            p++;
+            continue;
+        }
+        if(*p == ')')
+        {
+            if(depth == 0)
+                throw std::invalid_argument("Invalid formula");
+            depth--;
+            p++;
+            read_count(p);
+            continue;
+        }
+
+        int first, isotopeNo;
+        bool labelled = false;
+        if(*p == '[')
+        {
+            p++;
+            if(not is_digit(*p))
+                throw std::invalid_argument("Invalid formula");
+            const long long massNo = read_count(p);
+            first = read_element(p, &isotopeNo);
+            if(*p != ']')
+                throw std::invalid_argument("Invalid formula");
+            p++;
+            int ii = 0;
+            while(ii < isotopeNo and elem_table_massNo[first+ii] != massNo)
+                ii++;
+            if(ii == isotopeNo)
+                throw std::invalid_argument("Invalid formula");
+            first += ii;
+            isotopeNo = 1;
+            labelled = true;
+        }
+        else
+            first = read_element(p, &isotopeNo);
+
+        const long long cnt = read_count(p) * multipliers[depth];
+
+        unsigned int idx = 0;
+        while(idx < no_entries and (out[idx].first != first or out[idx].labelled != labelled))
+            idx++;
+        if(idx == no_entries)
+        {
+            if(no_entries == MAX_FORMULA_ENTRIES)
+                throw std::invalid_argument("Invalid formula");
+            out[idx].first = first;
+            out[idx].isotopeNo = isotopeNo;
+            out[idx].atomCnt = 0;
+            out[idx].labelled = labelled;
+            no_entries++;
+        }
+        if(out[idx].atomCnt + cnt > std::numeric_limits<int>::max())
+            throw std::invalid_argument("Invalid formula");
+        out[idx].atomCnt += static_cast<int>(cnt);
+    }
+
+    if(depth != 0 or no_entries == 0)
+        throw std::invalid_argument("Invalid formula");
+
+    return no_entries;
+}
@@ -0,0 +1,62 @@
+/*
+ *   Copyright (C) 2015-2016 Mateusz Łącki and Michał Startek.
+ *
+ *   This file is part of IsoSpec.
+ *
+ *   IsoSpec is free software: you can redistribute it and/or modify
+ *   it under the terms of the Simplified ("2-clause") BSD licence.
+ *
+ *   IsoSpec is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ *   You should have received a copy of the Simplified BSD Licence
+ *   along with IsoSpec.  If not, see <https://opensource.org/licenses/BSD-2-Clause>.
+ */
+
+
+#ifndef FORMULA_HPP
+#define FORMULA_HPP
+
+#include <cstddef>
+
+// At most that many distinct elements (and labelled isotopes) in a formula
+#define MAX_FORMULA_ENTRIES 128
+// and that deep nesting of parentheses
+#define MAX_FORMULA_DEPTH 32
+
+
+/*
+ * Index of the element with the given symbol in the per-element tables (elem_table_element_*),
+ * or -1 if there is no such element. A symbol is one capital letter and at most one small
+ * one, which makes the lookup a direct table index.
+ */
+int find_element_index(const char* symbol, size_t len);
+
+// The same, but gives the index of the element's first isotope in the element tables and
+// the number of its isotopes
+int find_element(const char* symbol, size_t len, int* isotopeNo);
+
+// One element or labelled isotope of a formula, with the total number of its atoms
+struct FormulaEntry
+{
+    int first;              // In the element tables
+    int isotopeNo;          // 1 for a labelled isotope
+    int atomCnt;
+    bool labelled;
+};
+
+/*
+ * Formulas are sequences of elements, each optionally followed by its count (1 if none),
+ * e.g. "C6H12O6" or "CH3COOH". Parentheses group, as in "C2H5(CH2)10OH", and a single
+ * isotope is given as its mass number and symbol in brackets, as in "[13C]2C4H12O6".
+ * Repeated elements are summed up, the entries are in the order of first appearance.
+ * Writes the entries to out (which has room for MAX_FORMULA_ENTRIES) and returns how many
+ * there are. Allocates nothing; throws std::invalid_argument on invalid formulas.
+ */
+unsigned int parse_formula_entries(const char* formula, FormulaEntry* out);
+
+// Probability tables for labelled isotopes: the isotope is certain
+extern const double certain_isotope_probability[1];
+
+#endif
@@ -20,7 +20,8 @@
 
 #include <cmath>
 
-static inline double logFactorial(int n) { return lgamma(n+1); }
+// lgamma_r, as lgamma writes the global signgam, a race once marginals are built on several threads
+static inline double logFactorial(int n) { int sign; return lgamma_r(n+1, &sign); }
 double NormalCDFInverse(double p);
 double NormalCDFInverse(double p, double mean, double stdev);
 double NormalCDF(double x, double mean, double stdev);
@@ -38,8 +38,10 @@
 #include "summator.h"
 #include "marginalTrek++.h"
 #include "isoSpec++.h"
+#include "formula.h"
 #include "misc.h"
 #include "element_tables.h"
+#include "runKernels.h"
 
 
 using namespace std;
@@ -78,15 +80,19 @@ modeLProb(other.modeLProb)
 
 
 Iso::Iso(const Iso& other, bool fullcopy) : 
-disowned(fullcopy ? throw std::logic_error("Not implemented") : true),
+disowned(not fullcopy),
 dimNumber(other.dimNumber),
 isotopeNumbers(fullcopy ? array_copy<int>(other.isotopeNumbers, dimNumber) : other.isotopeNumbers),
 atomCounts(fullcopy ? array_copy<int>(other.atomCounts, dimNumber) : other.atomCounts),
 confSize(other.confSize),
 allDim(other.allDim),
-marginals(fullcopy ? throw std::logic_error("Not implemented") : other.marginals),
+marginals(fullcopy ? new Marginal*[dimNumber] : other.marginals),
 modeLProb(other.modeLProb)
-{}
+{
+    if(fullcopy)
+        for(int ii=0; ii<dimNumber; ii++)
+            marginals[ii] = new Marginal(*other.marginals[ii]);
+}
 
 
 inline void Iso::setupMarginals(const double** _isotopeMasses, const double** _isotopeProbabilities)
@@ -94,16 +100,27 @@ inline void Iso::setupMarginals(const double** _isotopeMasses, const double** _i
     if (marginals == nullptr)
     {
         marginals = new Marginal*[dimNumber];
-        for(int i=0; i<dimNumber;i++) 
+        int i = 0;
+        try
+        {
+            for(; i<dimNumber;i++) 
+            {
+	        allDim += isotopeNumbers[i];
+	        marginals[i] = new Marginal(
+                    _isotopeMasses[i],
+                    _isotopeProbabilities[i],
+                    isotopeNumbers[i],
+                    atomCounts[i]
+                 );
+                 modeLProb += marginals[i]->getModeLProb();
+            }
+        }
+        catch(...)
         {
-	    allDim += isotopeNumbers[i];
-	    marginals[i] = new Marginal(
-                _isotopeMasses[i],
-                _isotopeProbabilities[i],
-                isotopeNumbers[i],
-                atomCounts[i]
-             );
-             modeLProb += marginals[i]->getModeLProb();
+            // Called from constructors, so the destructor will not clean up after us
+            dealloc_table(marginals, i);
+            marginals = nullptr;
+            throw;
         }
     }
 
@@ -182,110 +199,86 @@ allDim(0)
 }
 
 
-inline int str_to_int(const string& s)
-{
-	char* endptr[1];
-	const char* c_s = s.c_str();
-	int ret = (int) strtol(c_s, endptr, 10);
-	if (c_s == endptr[0])
-		throw invalid_argument("Invalid formula");
-	return ret;
-}
-
 Iso::Iso(const char* formula) :
 disowned(false),
+allDim(0),
 marginals(nullptr),
 modeLProb(0.0)
 {
-std::vector<const double*> isotope_masses;
-std::vector<const double*> isotope_probabilities;
-
-dimNumber = parse_formula(formula, isotope_masses, isotope_probabilities, &isotopeNumbers, &atomCounts, &confSize);
-
-setupMarginals(isotope_masses.data(), isotope_probabilities.data());
-}
+    FormulaEntry entries[MAX_FORMULA_ENTRIES];
+    const double* isotope_masses[MAX_FORMULA_ENTRIES];
+    const double* isotope_probabilities[MAX_FORMULA_ENTRIES];
 
-unsigned int parse_formula(const char* formula, std::vector<const double*>& isotope_masses, std::vector<const double*>& isotope_probabilities, int** isotopeNumbers, int** atomCounts, unsigned int* confSize)
-{
-// This function is NOT guaranteed to be secure againt malicious input. It should be used only for debugging.
+    dimNumber = parse_formula_entries(formula, entries);
+    isotopeNumbers = new int[dimNumber];
+    atomCounts = new int[dimNumber];
+    confSize = dimNumber * sizeof(int);
 
-    string cpp_formula(formula);
-    int last_modeswitch = 0;
-    int mode = 0;
-    int pos = 0;
-    std::vector<string> elements;
-    std::vector<int> numbers;
-    while(formula[pos] != '\0')
+    for(int ii = 0; ii < dimNumber; ii++)
     {
-        if(isdigit(formula[pos]) && mode == 0)
-        {
-            elements.push_back(cpp_formula.substr(last_modeswitch, pos-last_modeswitch));
-            last_modeswitch = pos;
-            mode = 1;
-        }
-        else if(isalpha(formula[pos]) && mode == 1)
-        {
-            numbers.push_back(str_to_int(cpp_formula.substr(last_modeswitch, pos-last_modeswitch)));
-            last_modeswitch = pos;
-            mode = 0;
-        }
-        pos++;
+        isotopeNumbers[ii] = entries[ii].isotopeNo;
+        atomCounts[ii] = entries[ii].atomCnt;
+        isotope_masses[ii] = &elem_table_mass[entries[ii].first];
+        isotope_probabilities[ii] = entries[ii].labelled ? certain_isotope_probability : &elem_table_probability[entries[ii].first];
     }
 
-    numbers.push_back(str_to_int(cpp_formula.substr(last_modeswitch, pos)));
-
-
-    if(elements.size() != numbers.size())
-        throw invalid_argument("Invalid formula");
+    setupMarginals(isotope_masses, isotope_probabilities);
+}
 
-    std::vector<int> element_indexes;
+Iso::Iso(int _dimNumber, const int* _elements, const int* _atomCounts) :
+disowned(false),
+dimNumber(_dimNumber),
+isotopeNumbers(new int[_dimNumber]),
+atomCounts(array_copy<int>(_atomCounts, _dimNumber)),
+confSize(_dimNumber * sizeof(int)),
+allDim(0),
+marginals(nullptr),
+modeLProb(0.0)
+{
+    std::vector<const double*> isotope_masses(dimNumber);
+    std::vector<const double*> isotope_probabilities(dimNumber);
 
-    for (unsigned int i=0; i<elements.size(); i++)
+    // The destructor does not run if we throw
+    try
     {
-        int idx = -1;
-        for(int j=0; j<NUMBER_OF_ISOTOPIC_ENTRIES; j++)
+        for(int ii = 0; ii < dimNumber; ii++)
         {
-            if (elements[i].compare(elem_table_symbol[j]) == 0)
-            {
-                idx = j;
-                break;
-            }
+            if(_elements[ii] < 0 or _elements[ii] >= NUMBER_OF_ELEMENTS)
+                throw std::invalid_argument("Invalid element");
+            const int first = elem_table_element_first[_elements[ii]];
+            isotopeNumbers[ii] = elem_table_element_isotopeNo[_elements[ii]];
+            isotope_masses[ii] = &elem_table_mass[first];
+            isotope_probabilities[ii] = &elem_table_probability[first];
         }
-        if(idx < 0)
-            throw invalid_argument("Invalid formula");
-        element_indexes.push_back(idx);
 
+        setupMarginals(isotope_masses.data(), isotope_probabilities.data());
     }
-
-    vector<int> _isotope_numbers;
-
-    for(vector<int>::iterator it = element_indexes.begin(); it != element_indexes.end(); ++it)
+    catch(...)
     {
-        int num = 0;
-        int at_idx = *it;
-        int atomicNo = elem_table_atomicNo[at_idx];
-        while(at_idx < NUMBER_OF_ISOTOPIC_ENTRIES && elem_table_atomicNo[at_idx] == atomicNo)
-        {
-            at_idx++;
-            num++;
-        }
-        _isotope_numbers.push_back(num);
+        delete[] isotopeNumbers;
+        delete[] atomCounts;
+        throw;
     }
+}
 
-    for(vector<int>::iterator it = element_indexes.begin(); it != element_indexes.end(); ++it)
-    {
-        isotope_masses.push_back(&elem_table_mass[*it]);
-        isotope_probabilities.push_back(&elem_table_probability[*it]);
-    };
-
-    const unsigned int dimNumber = elements.size();
+unsigned int parse_formula(const char* formula, std::vector<const double*>& isotope_masses, std::vector<const double*>& isotope_probabilities, int** isotopeNumbers, int** atomCounts, unsigned int* confSize)
+{
+    FormulaEntry entries[MAX_FORMULA_ENTRIES];
+    const unsigned int dimNumber = parse_formula_entries(formula, entries);
 
-    *isotopeNumbers = array_copy<int>(_isotope_numbers.data(), dimNumber);
-    *atomCounts = array_copy<int>(numbers.data(), dimNumber);
+    *isotopeNumbers = new int[dimNumber];
+    *atomCounts = new int[dimNumber];
     *confSize = dimNumber * sizeof(int);
 
-    return dimNumber;
+    for(unsigned int ii = 0; ii < dimNumber; ii++)
+    {
+        (*isotopeNumbers)[ii] = entries[ii].isotopeNo;
+        (*atomCounts)[ii] = entries[ii].atomCnt;
+        isotope_masses.push_back(&elem_table_mass[entries[ii].first]);
+        isotope_probabilities.push_back(entries[ii].labelled ? certain_isotope_probability : &elem_table_probability[entries[ii].first]);
+    }
 
+    return dimNumber;
 }
 
 
@@ -660,14 +653,85 @@ IsoGenerator::IsoGenerator(Iso&& iso) :
 
 
 
+/*
+ * The block fill() of the threshold generators. counter[0] is the last configuration of
+ * marginal 0 handed out, so each pass writes the run after it under the current prefix,
+ * as far as run_limit(lprefix, start) (which may also extend a lazy marginal) and the
+ * cutoff allow, and then moves on to the next prefix with carry().
+ */
+template<typename RunLimit, typename Carry>
+size_t IsoGenerator::fill_runs(PrecalculatedMarginal* M0, unsigned int* counter, double Lcutoff,
+                               double* out_masses, double* out_probs, size_t capacity,
+                               RunLimit run_limit, Carry carry)
+{
+    size_t written = 0;
+
+    while(written < capacity)
+    {
+        const unsigned int start = counter[0]+1;
+        const unsigned int limit = run_limit(partialLProbs[1], start);
+        const double* lProbs0 = M0->get_lProbs_ptr();
+        const double* masses0 = M0->get_masses_ptr();
+        const double* eProbs0 = M0->get_eProbs_ptr();
+        const unsigned int end = threshold_run_end(lProbs0, start, limit, partialLProbs[1], Lcutoff, capacity - written);
+
+        if(start < end)
+        {
+            emit_run(masses0 + start, eProbs0 + start, end - start, partialMasses[1], partialExpProbs[1], out_masses + written, out_probs + written);
+            written += end - start;
+            counter[0] = end-1;
+            partialLProbs[0] = partialLProbs[1] + lProbs0[end-1];
+            partialMasses[0] = out_masses[written-1];
+            partialExpProbs[0] = out_probs[written-1];
+            if(written == capacity)
+                break;
+        }
+
+        if(not carry())
+            break;
+
+        // carry() has already positioned us on the next valid configuration,
+        // step back so that the next run picks it up
+        counter[0]--;
+    }
+
+    return written;
+}
+
+
 IsoThresholdGeneratorBoundMass::IsoThresholdGeneratorBoundMass(Iso&& iso, double _threshold, double _min_mass, double _max_mass, bool _absolute, int tabSize, int hashSize)
-: IsoGenerator(std::move(iso)),
-min_mass(_min_mass),
-max_mass(_max_mass)
+: IsoGenerator(std::move(iso))
+{
+        init(_threshold, &_min_mass, &_max_mass, 1, _absolute, tabSize, hashSize);
+}
+
+IsoThresholdGeneratorBoundMass::IsoThresholdGeneratorBoundMass(Iso&& iso, double _threshold, const double* _window_mins, const double* _window_maxs, unsigned int _no_windows, bool _absolute, int tabSize, int hashSize)
+: IsoGenerator(std::move(iso))
+{
+        if(_no_windows == 0)
+            throw std::invalid_argument("No mass windows");
+        for(unsigned int ii=0; ii<_no_windows; ii++)
+            if(not (_window_mins[ii] <= _window_maxs[ii]) or (ii+1 < _no_windows and not (_window_maxs[ii] < _window_mins[ii+1])))
+                throw std::invalid_argument("Mass windows must be sorted and disjoint");
+
+        init(_threshold, _window_mins, _window_maxs, _no_windows, _absolute, tabSize, hashSize);
+}
+
+void IsoThresholdGeneratorBoundMass::init(double _threshold, const double* _window_mins, const double* _window_maxs, unsigned int _no_windows, bool _absolute, int tabSize, int hashSize)
 {
+        no_windows = _no_windows;
+        window_mins = new double[no_windows];
+        window_maxs = new double[no_windows];
+        memcpy(window_mins, _window_mins, no_windows*sizeof(double));
+        memcpy(window_maxs, _window_maxs, no_windows*sizeof(double));
+        min_mass = window_mins[0];
+        max_mass = window_maxs[no_windows-1];
+        cur_window = 0;
+        end_window = 0;
+        mass_slack = 1e-12 * (1.0 + getHeaviestPeakMass());
+
 	maxConfsLPSum 	= new double[dimNumber];
-        minMassCSum     = new double[dimNumber];
-        maxMassCSum     = new double[dimNumber];
+        modeLProbs      = new double[dimNumber];
 
         marginalResults = new RGTMarginal*[dimNumber];
 
@@ -683,52 +747,67 @@ max_mass(_max_mass)
                                                             tabSize, 
                                                             hashSize);
 
-            if(not marginalResults[ii]->inRange(0))
+            if(marginalResults[ii]->get_no_confs() == 0)
                 empty = true;
 	}
-	maxConfsLPSum[0] = marginalResults[0]->getModeLProb();
-        minMassCSum[0] = marginalResults[0]->getLightestConfMass();
-        maxMassCSum[0] = marginalResults[0]->getHeaviestConfMass();
 
-	for(int ii=1; ii<dimNumber; ii++)
+        // Only the innermost marginal is searched with exact bounds, so it should be the largest
+        std::stable_sort(marginalResults, marginalResults+dimNumber, [](const RGTMarginal* a, const RGTMarginal* b) { return a->get_no_confs() > b->get_no_confs(); });
+
+	for(int ii=0; ii<dimNumber; ii++)
         {
-	    maxConfsLPSum[ii] = maxConfsLPSum[ii-1] + marginalResults[ii]->getModeLProb();
-            minMassCSum[ii] = minMassCSum[ii-1] + marginalResults[ii]->getLightestConfMass();
-            maxMassCSum[ii] = maxMassCSum[ii-1] + marginalResults[ii]->getHeaviestConfMass();
+            modeLProbs[ii] = marginalResults[ii]->getModeLProb();
+	    maxConfsLPSum[ii] = (ii > 0 ? maxConfsLPSum[ii-1] : 0.0) + modeLProbs[ii];
         }
 
-
-        setup_ith_marginal_range(dimNumber-1);
-
-        for(int ii=0; ii<dimNumber-1; ii++)
-            marginalResults[0]->setup_search(2.0, 1.0, std::numeric_limits<double>::infinity(), -std::numeric_limits<double>::infinity());
-
+        // The inner searches start out finished, so that the first advance sets them up
+        if(not empty and dimNumber > 0)
+            setup_ith_marginal_range(dimNumber-1);
 }
 
 IsoThresholdGeneratorBoundMass::~IsoThresholdGeneratorBoundMass() 
 { 
     delete[] maxConfsLPSum;
+    delete[] modeLProbs;
+    delete[] window_mins;
+    delete[] window_maxs;
     dealloc_table(marginalResults, dimNumber);
-    delete[] minMassCSum;
-    delete[] maxMassCSum;
 }
 
 bool IsoThresholdGeneratorBoundMass::advanceToNextConfiguration()
 {
-	if(marginalResults[0]->next())
+        if(dimNumber == 0)
+            return false;
+
+        while(true)
         {
-	    recalc(0);
-            return true;
+            // The innermost marginal is searched window by window, a bit wider than the
+            // window, the total mass decides
+            while(true)
+            {
+                while(marginalResults[0]->next())
+                {
+                    recalc(0);
+                    if(in_window())
+                        return true;
+                }
+                if(cur_window + 1 >= end_window)
+                    break;
+                cur_window++;
+                setup_window_search();
+            }
+
+            if(not carry())
+                return false;
         }
-            
+}
 
-	// If we reached this point, a carry is needed
-	
+bool IsoThresholdGeneratorBoundMass::carry()
+{
 	int idx = 1;
         bool frombelow = true;
 
-
-        while(idx >= 0 and idx < dimNumber)
+        while(idx > 0 and idx < dimNumber)
         {
             if(frombelow)
             {
@@ -756,38 +835,78 @@ bool IsoThresholdGeneratorBoundMass::advanceToNextConfiguration()
                 }
             }
         }
-                
-        if(idx == dimNumber)
+
+        if(idx != 0)
             return false;
-        else
-            return true;
 
-        
+        setup_ith_marginal_range(0);
+        return true;
 }
 
+size_t IsoThresholdGeneratorBoundMass::fill(double* out_masses, double* out_probs, size_t capacity, unsigned int* out_windows)
+{
+    size_t written = 0;
+    while(written < capacity and advanceToNextConfiguration())
+    {
+        out_masses[written] = partialMasses[0];
+        out_probs[written] = partialExpProbs[0];
+        if(out_windows != nullptr)
+            out_windows[written] = cur_window;
+        written++;
+    }
+    return written;
+}
 
 void IsoThresholdGeneratorBoundMass::setup_ith_marginal_range(unsigned int idx)
 {
-    double lower_min = min_mass - partialMasses[idx+1];
-    double lower_max = max_mass - partialMasses[idx+1];
-    double rem_prob  = Lcutoff - partialLProbs[idx+1] - maxConfsLPSum[idx];
+    // Each marginal below idx can at best be at its mode, that bounds the probability left
+    // for the others, and so how light and how heavy they can get
+    const double rem_prob = Lcutoff - partialLProbs[idx+1] - maxConfsLPSum[idx];
+
+    if(idx == 0)
+    {
+        // Just the windows the innermost marginal can still reach
+        innermost_lProb = rem_prob + modeLProbs[0];
+        if(no_windows == 1)
+        {
+            cur_window = 0;
+            end_window = 1;
+        }
+        else
+        {
+            const double lightest = partialMasses[1] + marginalResults[0]->min_mass_above_lProb(innermost_lProb) - mass_slack;
+            const double heaviest = partialMasses[1] + marginalResults[0]->max_mass_above_lProb(innermost_lProb) + mass_slack;
+            cur_window = std::lower_bound(window_maxs, window_maxs+no_windows, lightest) - window_maxs;
+            end_window = std::upper_bound(window_mins, window_mins+no_windows, heaviest) - window_mins;
+            if(cur_window >= end_window)
+            {
+                marginalResults[0]->terminate_search();
+                return;
+            }
+        }
+        setup_window_search();
+        return;
+    }
+
+    double lower_min = min_mass - partialMasses[idx+1] - mass_slack;
+    double lower_max = max_mass - partialMasses[idx+1] + mass_slack;
 
     for(unsigned int ii=0; ii < idx; ii++)
     {
-        double p = rem_prob + marginalResults[ii]->getModeLProb();
+        const double p = rem_prob + modeLProbs[ii];
         lower_min -= marginalResults[ii]->max_mass_above_lProb(p);
         lower_max -= marginalResults[ii]->min_mass_above_lProb(p);
     }
 
+    // Nothing below fits in at all: lower_min is +inf or lower_max is -inf, the search is empty
+    marginalResults[idx]->setup_search(rem_prob + modeLProbs[idx], std::numeric_limits<double>::infinity(), lower_min, lower_max);
+}
 
-    marginalResults[idx]->setup_search(rem_prob+marginalResults[idx]->getModeLProb(), std::numeric_limits<double>::infinity(), lower_min, lower_max);
-    if(idx>2){
-    unsigned int cou = 0;
-    while(marginalResults[idx]->next())
-        cou++;
-    }
-    marginalResults[idx]->setup_search(rem_prob+marginalResults[idx]->getModeLProb(), std::numeric_limits<double>::infinity(), lower_min, lower_max);
-
+void IsoThresholdGeneratorBoundMass::setup_window_search()
+{
+    marginalResults[0]->setup_search(innermost_lProb, std::numeric_limits<double>::infinity(),
+                                     window_mins[cur_window] - partialMasses[1] - mass_slack,
+                                     window_maxs[cur_window] - partialMasses[1] + mass_slack);
 }
 
 /*
@@ -797,6 +916,16 @@ void IsoThresholdGeneratorBoundMass::setup_ith_marginal_range(unsigned int idx)
 
 
 
+void Iso::precalculate_marginals(PrecalculatedMarginal** target, int count, double Lrel, int tabSize, int hashSize)
+{
+    for(int ii = 0; ii<count; ii++)
+        target[ii] = new PrecalculatedMarginal(std::move(*(marginals[ii])),
+                                               Lrel + marginals[ii]->getModeLProb(),
+                                               true,
+                                               tabSize,
+                                               hashSize);
+}
+
 PrecalculatedMarginal** Iso::get_MT_marginal_set(double Lcutoff, bool absolute, int tabSize, int hashSize)
 {
     PrecalculatedMarginal** ret = new PrecalculatedMarginal*[dimNumber];
@@ -804,13 +933,7 @@ PrecalculatedMarginal** Iso::get_MT_marginal_set(double Lcutoff, bool absolute,
     if(absolute)
         Lcutoff -= modeLProb;
 
-    for(int ii = 0; ii<dimNumber - 1; ii++)
-        ret[ii] = new PrecalculatedMarginal(std::move(*(marginals[ii])),
-                                            Lcutoff + marginals[ii]->getModeLProb(),
-                                            true,
-                                            tabSize,
-                                            hashSize);
-
+    precalculate_marginals(ret, dimNumber - 1, Lcutoff, tabSize, hashSize);
 
     const unsigned int ii = dimNumber - 1;
     ret[ii] = new SyncMarginal(std::move(*(marginals[ii])),
@@ -875,7 +998,11 @@ bool IsoThresholdGeneratorMT::advanceToNextConfiguration()
 	}
 
 	// If we reached this point, a carry is needed
-	
+	return carry();
+}
+
+bool IsoThresholdGeneratorMT::carry()
+{
 	int idx = 0;
 
 	while(idx<dimNumber-2)
@@ -914,6 +1041,14 @@ bool IsoThresholdGeneratorMT::advanceToNextConfiguration()
 	return false;
 }
 
+size_t IsoThresholdGeneratorMT::fill(double* out_masses, double* out_probs, size_t capacity)
+{
+    PrecalculatedMarginal* M0 = marginalResults[0];
+    return fill_runs(M0, counter, Lcutoff, out_masses, out_probs, capacity,
+                     [M0](double, unsigned int) { return M0->get_no_confs(); },
+                     [this]() { return carry(); });
+}
+
 void IsoThresholdGeneratorMT::terminate_search()
 {
     for(int ii=0; ii<dimNumber; ii++)
@@ -925,195 +1060,1089 @@ void IsoThresholdGeneratorMT::terminate_search()
  */
 
 
+PrecalculatedMarginal** Iso::get_sorted_marginal_set(double Lcutoff, bool absolute, int tabSize, int hashSize)
+{
+    PrecalculatedMarginal** ret = new PrecalculatedMarginal*[dimNumber];
 
+    if(absolute)
+        Lcutoff -= modeLProb;
 
+    precalculate_marginals(ret, dimNumber, Lcutoff, tabSize, hashSize);
+    return ret;
+}
 
 
+/*
+ * Each marginal's configurations above its share of the threshold are binned by their log-probability
+ * relative to the marginal's mode, rounded to a multiple of w, and the per-marginal histograms (of
+ * counts and of probabilities) are convolved. A configuration with (relative) log-probability r lands
+ * in bin -r/w give or take dimNumber/2, which is where the bounds come from.
+ */
+ThresholdEstimate Iso::estimateThreshold(double threshold, bool absolute, unsigned int bins, int tabSize, int hashSize) const
+{
+    ThresholdEstimate ret = {0.0, 0.0, 0.0, 0.0, 0.0, 0.0};
+
+    const double Lcutoff = absolute ? log(threshold) : log(threshold) + modeLProb;
+    const double Lrel = Lcutoff - modeLProb;
+    if(Lrel > 0.0 or bins == 0)
+        return ret;
+
+    Iso copy(*this, true);
+    PrecalculatedMarginal** PMs = copy.get_sorted_marginal_set(Lcutoff, true, tabSize, hashSize);
+
+    const double w = std::max(-Lrel, 1e-12) / bins;
+    const unsigned int slack = (dimNumber+1)/2;
+    const unsigned int size = bins + slack + 1;     // beyond that nothing is above the threshold
+    std::vector<double> acc_count(size, 0.0), acc_prob(size, 0.0);
+    std::vector<double> h_count(size), h_prob(size);
+    std::vector<double> new_count(size), new_prob(size);
+    acc_count[0] = 1.0;
+    acc_prob[0] = 1.0;
+    unsigned int acc_top = 0;       // highest nonempty bin so far
 
+    for(int ii=0; ii<dimNumber; ii++)
+    {
+        std::fill(h_count.begin(), h_count.end(), 0.0);
+        std::fill(h_prob.begin(), h_prob.end(), 0.0);
+        const double mode = PMs[ii]->getModeLProb();
+        unsigned int h_top = 0;
+        for(unsigned int jj=0; jj<PMs[ii]->get_no_confs(); jj++)
+        {
+            const double b = floor((mode - PMs[ii]->get_lProb(jj)) / w + 0.5);
+            if(b >= size)
+                break;  // sorted: the rest is even further off
+            const unsigned int bin = static_cast<unsigned int>(b);
+            h_count[bin] += 1.0;
+            h_prob[bin] += PMs[ii]->get_eProb(jj);
+            h_top = std::max(h_top, bin);
+        }
 
+        std::fill(new_count.begin(), new_count.end(), 0.0);
+        std::fill(new_prob.begin(), new_prob.end(), 0.0);
+        for(unsigned int a=0; a<=acc_top; a++)
+        {
+            if(acc_count[a] == 0.0)
+                continue;
+            const unsigned int end = std::min(h_top+1, size-a);
+            for(unsigned int b=0; b<end; b++)
+            {
+                new_count[a+b] += acc_count[a] * h_count[b];
+                new_prob[a+b] += acc_prob[a] * h_prob[b];
+            }
+        }
+        acc_count.swap(new_count);
+        acc_prob.swap(new_prob);
+        acc_top = std::min(acc_top + h_top, size-1);
+    }
 
+    for(unsigned int k=0; k<size; k++)
+    {
+        if(k + slack <= bins)
+        {
+            ret.count_low += acc_count[k];
+            ret.prob_low += acc_prob[k];
+        }
+        if(k <= bins)
+        {
+            ret.count += acc_count[k];
+            ret.prob += acc_prob[k];
+        }
+        ret.count_high += acc_count[k];
+        ret.prob_high += acc_prob[k];
+    }
 
-IsoThresholdGenerator::IsoThresholdGenerator(Iso&& iso, double _threshold, bool _absolute, int tabSize, int hashSize)
-: IsoGenerator(std::move(iso)),
-Lcutoff(_absolute ? log(_threshold) : log(_threshold) + modeLProb)
-{
-	counter 	= new unsigned int[dimNumber];
-	maxConfsLPSum 	= new double[dimNumber-1];
-
-        marginalResults = new PrecalculatedMarginal*[dimNumber];
+    dealloc_table(PMs, dimNumber);
+    return ret;
+}
 
-        bool empty = false;
-	for(int ii=0; ii<dimNumber; ii++)
-	{
-	    counter[ii] = 0;
 
-            marginalResults[ii] = new PrecalculatedMarginal(std::move(*(marginals[ii])), 
-                                                            Lcutoff - modeLProb + marginals[ii]->getModeLProb(),
-                                                            true,
-                                                            tabSize, 
-                                                            hashSize);
+/*
+ * The odometer in the threshold generators carries once for every valid prefix over the
+ * outer marginals, while the innermost one is swept in a tight loop. Putting the marginals
+ * with the most configurations innermost (and the smallest ones outermost) keeps the number
+ * of prefixes, and thus of carries, low. Reorders PMs in place and returns the permutation:
+ * internal marginal ii is marginal ret[ii] in the caller's (formula) order.
+ */
+static unsigned int* order_marginals_by_size(PrecalculatedMarginal** PMs, int dimNumber)
+{
+    unsigned int* ret = new unsigned int[dimNumber];
+    PrecalculatedMarginal** tmp = array_copy<PrecalculatedMarginal*>(PMs, dimNumber);
 
-            if(not marginalResults[ii]->inRange(0))
-                empty = true;
-	}
+    for(int ii=0; ii<dimNumber; ii++)
+        ret[ii] = ii;
 
-	maxConfsLPSum[0] = marginalResults[0]->getModeLProb();
-	for(int ii=1; ii<dimNumber-1; ii++)
-	    maxConfsLPSum[ii] = maxConfsLPSum[ii-1] + marginalResults[ii]->getModeLProb();
+    std::stable_sort(ret, ret+dimNumber, [tmp](unsigned int a, unsigned int b) { return tmp[a]->get_no_confs() > tmp[b]->get_no_confs(); });
 
-        if(not empty)
-        {
-            recalc(dimNumber-1);
-            counter[0]--;
-        }
-        else
-            terminate_search();
-            
+    for(int ii=0; ii<dimNumber; ii++)
+        PMs[ii] = tmp[ret[ii]];
 
+    delete[] tmp;
+    return ret;
 }
 
-bool IsoThresholdGenerator::advanceToNextConfiguration()
+
+ThresholdWorkPool::ThresholdWorkPool(Iso& iso, double _threshold, bool _absolute, unsigned int _n_threads, unsigned int tasks_per_thread, int tabSize, int hashSize) :
+dimNumber(iso.getDimNumber()),
+Lcutoff(_absolute ? log(_threshold) : log(_threshold) + iso.getModeLProb()),
+n_threads(_n_threads > 0 ? _n_threads : 1),
+marginalResults(iso.get_sorted_marginal_set(Lcutoff, true, tabSize, hashSize)),
+marginalOrder(order_marginals_by_size(marginalResults, dimNumber)),
+maxConfsLPSum(new double[dimNumber]),
+innerMass(new double[dimNumber+1])
 {
-	counter[0]++;
-	if(marginalResults[0]->inRange(counter[0]))
-	{
-		partialLProbs[0] = partialLProbs[1] + marginalResults[0]->get_lProb(counter[0]);
-		if(partialLProbs[0] >= Lcutoff)
-		{
-			partialMasses[0] = partialMasses[1] + marginalResults[0]->get_mass(counter[0]);
-                        partialExpProbs[0] = partialExpProbs[1] * marginalResults[0]->get_eProb(counter[0]);
-			return true;
-		}
-	}
+    bool empty = false;
+    for(int ii=0; ii<dimNumber; ii++)
+        if(not marginalResults[ii]->inRange(0))
+            empty = true;
 
-	// If we reached this point, a carry is needed
-	
-	int idx = 0;
+    // innerMass[ii] bounds the probability of everything below marginal ii, it is used
+    // to estimate how heavy a subtree is before deciding whether to split it further.
+    innerMass[0] = 1.0;
+    maxConfsLPSum[0] = marginalResults[0]->getModeLProb();
+    for(int ii=0; ii<dimNumber; ii++)
+    {
+        Summator s;
+        for(unsigned int jj=0; jj<marginalResults[ii]->get_no_confs(); jj++)
+            s.add(marginalResults[ii]->get_eProb(jj));
+        innerMass[ii+1] = innerMass[ii] * s.get();
+        if(ii > 0)
+            maxConfsLPSum[ii] = maxConfsLPSum[ii-1] + marginalResults[ii]->getModeLProb();
+    }
 
-	while(idx<dimNumber-1)
-	{
-		counter[idx] = 0;
-		idx++;
-		counter[idx]++;
-		if(marginalResults[idx]->inRange(counter[idx]))
-		{
-			partialLProbs[idx] = partialLProbs[idx+1] + marginalResults[idx]->get_lProb(counter[idx]);
-			if(partialLProbs[idx] + maxConfsLPSum[idx-1] >= Lcutoff)
-			{
-				partialMasses[idx] = partialMasses[idx+1] + marginalResults[idx]->get_mass(counter[idx]);
-                                partialExpProbs[idx] = partialExpProbs[idx+1] * marginalResults[idx]->get_eProb(counter[idx]);
-				recalc(idx-1);
-				return true;
-			}
-		}
-	}
+    grain = innerMass[dimNumber] / static_cast<double>(n_threads * (tasks_per_thread > 0 ? tasks_per_thread : 1));
 
-        terminate_search();
-	return false;
+    if(not empty)
+    {
+        unsigned int* prefix = new unsigned int[dimNumber];
+        split(dimNumber, prefix, 0.0, 0.0, 1.0);
+        delete[] prefix;
+    }
+
+    // Tasks come out of split() roughly heaviest-first within each level; sort them
+    // globally and deal them out round-robin, so that each deque starts with its
+    // heaviest work and ends with the small tasks, which are the ones being stolen.
+    const unsigned int no_tasks = tasks.size();
+    unsigned int* sorted = new unsigned int[no_tasks];
+    for(unsigned int ii=0; ii<no_tasks; ii++)
+        sorted[ii] = ii;
+    std::sort(sorted, sorted+no_tasks, [this](unsigned int a, unsigned int b) { return tasks[a].eprob > tasks[b].eprob; });
+
+    task_order = new unsigned int[no_tasks];
+    deques = new TaskDeque[n_threads];
+    unsigned int pos = 0;
+    for(unsigned int tid=0; tid<n_threads; tid++)
+    {
+        unsigned int head = pos;
+        for(unsigned int ii=tid; ii<no_tasks; ii+=n_threads)
+            task_order[pos++] = sorted[ii];
+        deques[tid].range.store((static_cast<unsigned long long>(head) << 32) | pos, std::memory_order_relaxed);
+    }
+    delete[] sorted;
 }
 
-void IsoThresholdGenerator::terminate_search()
+ThresholdWorkPool::~ThresholdWorkPool()
 {
-    for(int ii=0; ii<dimNumber; ii++)
-        counter[ii] = marginalResults[ii]->get_no_confs();
+    delete[] deques;
+    delete[] task_order;
+    delete[] innerMass;
+    delete[] maxConfsLPSum;
+    delete[] marginalOrder;
+    dealloc_table(marginalResults, dimNumber);
 }
 
-/*
- * ----------------------------------------------------------------------------------------------------------
- */
-
+void ThresholdWorkPool::split(unsigned int depth, unsigned int* prefix, double lprob, double mass, double eprob)
+{
+    const unsigned int midx = depth-1;
+    PrecalculatedMarginal* M = marginalResults[midx];
+    const double lower_bound = midx > 0 ? maxConfsLPSum[midx-1] : 0.0;
 
+    unsigned int group_start = 0;
+    double group_mass = 0.0;
+    unsigned int ii = 0;
 
+    for(; M->inRange(ii) and lprob + M->get_lProb(ii) + lower_bound >= Lcutoff; ii++)
+    {
+        const double child_eprob = eprob * M->get_eProb(ii);
+        const double estimate = child_eprob * innerMass[midx];
 
+        if(midx > 0 and estimate > grain)
+        {
+            // Too heavy for a single task: flush what we grouped so far and go one marginal deeper
+            if(group_start < ii)
+                add_task(depth, prefix, group_start, ii, lprob, mass, eprob);
+            prefix[midx] = ii;
+            split(midx, prefix, lprob + M->get_lProb(ii), mass + M->get_mass(ii), child_eprob);
+            group_start = ii+1;
+            group_mass = 0.0;
+        }
+        else
+        {
+            group_mass += estimate;
+            if(group_mass >= grain)
+            {
+                add_task(depth, prefix, group_start, ii+1, lprob, mass, eprob);
+                group_start = ii+1;
+                group_mass = 0.0;
+            }
+        }
+    }
 
+    if(group_start < ii)
+        add_task(depth, prefix, group_start, ii, lprob, mass, eprob);
+}
 
-/*
- * ------------------------------------------------------------------------------------------------------------------------
- */
-#if 0
+void ThresholdWorkPool::add_task(unsigned int depth, const unsigned int* prefix, unsigned int lo, unsigned int hi, double lprob, double mass, double eprob)
+{
+    ThresholdTask t;
+    t.depth = depth;
+    t.lo = lo;
+    t.hi = hi;
+    t.lprob = lprob;
+    t.mass = mass;
+    t.eprob = eprob;
+    tasks.push_back(t);
+    for(int ii=0; ii<dimNumber; ii++)
+        task_counters.push_back(static_cast<unsigned int>(ii) >= depth ? prefix[ii] : 0);
+}
 
-void IsoOrderedGenerator::IsoOrderedGenerator_init(const double    _cutOff)
+bool ThresholdWorkPool::pop(unsigned int thread_id, unsigned int& task_idx)
 {
-    logProbs        = new const vector<double>*[dimNumber];
-    masses          = new const vector<double>*[dimNumber];
-    marginalConfs   = new const vector<int*>*[dimNumber];
-    candidate	    = new int[dimNumber];
+    std::atomic<unsigned long long>& range = deques[thread_id].range;
+    unsigned long long current = range.load(std::memory_order_acquire);
+    while(true)
+    {
+        unsigned int head = current >> 32;
+        unsigned int tail = current & 0xFFFFFFFFULL;
+        if(head >= tail)
+            return false;
+        if(range.compare_exchange_weak(current, (static_cast<unsigned long long>(head+1) << 32) | tail, std::memory_order_acq_rel))
+        {
+            task_idx = task_order[head];
+            return true;
+        }
+    }
+}
 
-    for(int i = 0; i<dimNumber; i++)
+bool ThresholdWorkPool::steal(unsigned int thread_id, unsigned int victim, unsigned int& task_idx)
+{
+    // Take the upper half of the victim's remaining range: run its first task
+    // and republish the rest in our own (empty) deque, so it can be stolen further.
+    std::atomic<unsigned long long>& range = deques[victim].range;
+    unsigned long long current = range.load(std::memory_order_acquire);
+    unsigned int head, tail, taken;
+    while(true)
     {
-        masses[i] = &marginalResults[i]->conf_masses();
-        logProbs[i] = &marginalResults[i]->conf_probs();
-        marginalConfs[i] = &marginalResults[i]->confs();
+        head = current >> 32;
+        tail = current & 0xFFFFFFFFULL;
+        if(head >= tail)
+            return false;
+        taken = (tail - head + 1) / 2;
+        if(range.compare_exchange_weak(current, (static_cast<unsigned long long>(head) << 32) | (tail - taken), std::memory_order_acq_rel))
+            break;
     }
+    task_idx = task_order[tail - taken];
+    deques[thread_id].range.store((static_cast<unsigned long long>(tail - taken + 1) << 32) | tail, std::memory_order_release);
+    return true;
+}
 
-    topConf     = allocator.newConf();
-    memset(
-        reinterpret_cast<char*>(topConf) + sizeof(double),
-           0,
-           sizeof(int)*dimNumber
-    );
+bool ThresholdWorkPool::get_task(unsigned int thread_id, unsigned int& task_idx)
+{
+    if(pop(thread_id, task_idx))
+        return true;
 
-    *(reinterpret_cast<double*>(topConf)) =
-    combinedSum(
-        getConf(topConf),
-                logProbs,
-                dimNumber
-    );
+    for(unsigned int ii=1; ii<n_threads; ii++)
+        if(steal(thread_id, (thread_id + ii) % n_threads, task_idx))
+            return true;
 
-    pq.push(topConf);
-    cutOff = _cutOff;
+    return false;
+}
 
+
+IsoThresholdGeneratorWS::IsoThresholdGeneratorWS(Iso&& iso, ThresholdWorkPool& _pool, unsigned int _thread_id)
+: IsoGenerator(Iso(iso, false)),
+maxConfsLPSum(_pool.get_maxConfsLPSum()),
+Lcutoff(_pool.get_Lcutoff()),
+top(0),
+pool(_pool),
+thread_id(_thread_id),
+marginalResults(_pool.get_marginals()),
+marginalOrder(_pool.get_marginal_order())
+{
+	counter = new unsigned int[dimNumber+PADDING];
+        limits  = new unsigned int[dimNumber+PADDING];
+
+        // No task loaded yet: the first advanceToNextConfiguration() falls through to the pool.
+	for(int ii=0; ii<dimNumber; ii++)
+        {
+	    counter[ii] = 0;
+            limits[ii] = 0;
+        }
 }
 
+bool IsoThresholdGeneratorWS::load_task(unsigned int task_idx)
+{
+    const ThresholdTask& t = pool.task(task_idx);
+    const unsigned int* prefix = pool.task_prefix(task_idx);
 
-IsoOrderedGenerator::~IsoOrderedGenerator(){}
+    top = t.depth-1;
+    memcpy(counter + t.depth, prefix + t.depth, sizeof(unsigned int)*(dimNumber - t.depth));
+    partialLProbs[t.depth] = t.lprob;
+    partialMasses[t.depth] = t.mass;
+    partialExpProbs[t.depth] = t.eprob;
 
-bool IsoOrderedGenerator::advanceToNextConfiguration()
+    for(int ii=0; ii<top; ii++)
+    {
+        counter[ii] = 0;
+        limits[ii] = marginalResults[ii]->get_no_confs();
+    }
+    counter[top] = t.lo;
+    limits[top] = t.hi;
+
+    recalc(top);
+    return partialLProbs[top] + (top > 0 ? maxConfsLPSum[top-1] : 0.0) >= Lcutoff;
+}
+
+bool IsoThresholdGeneratorWS::advanceToNextConfiguration()
 {
-    if(pq.size() < 1)
-        return false;
+	counter[0]++;
+	if(counter[0] < limits[0])
+	{
+		partialLProbs[0] = partialLProbs[1] + marginalResults[0]->get_lProb(counter[0]);
+		if(partialLProbs[0] >= Lcutoff)
+		{
+			partialMasses[0] = partialMasses[1] + marginalResults[0]->get_mass(counter[0]);
+                        partialExpProbs[0] = partialExpProbs[1] * marginalResults[0]->get_eProb(counter[0]);
+			return true;
+		}
+	}
 
+	// If we reached this point, a carry is needed
+	return carry();
+}
 
-    topConf = pq.top();
-    pq.pop();
+bool IsoThresholdGeneratorWS::carry()
+{
+	int idx = 0;
 
-    int* topConfIsoCounts = getConf(topConf);
+	while(idx<top)
+	{
+		counter[idx] = 0;
+		idx++;
+		counter[idx]++;
+		if(counter[idx] < limits[idx])
+		{
+			partialLProbs[idx] = partialLProbs[idx+1] + marginalResults[idx]->get_lProb(counter[idx]);
+			if(partialLProbs[idx] + maxConfsLPSum[idx-1] >= Lcutoff)
+			{
+				partialMasses[idx] = partialMasses[idx+1] + marginalResults[idx]->get_mass(counter[idx]);
+                                partialExpProbs[idx] = partialExpProbs[idx+1] * marginalResults[idx]->get_eProb(counter[idx]);
+				recalc(idx-1);
+				return true;
+			}
+		}
+	}
+
+        // The current task is exhausted, get another one (possibly stealing it)
+        unsigned int task_idx;
+        while(pool.get_task(thread_id, task_idx))
+            if(load_task(task_idx))
+                return true;
+
+        terminate_search();
+	return false;
+}
+
+size_t IsoThresholdGeneratorWS::fill(double* out_masses, double* out_probs, size_t capacity)
+{
+    return fill_runs(marginalResults[0], counter, Lcutoff, out_masses, out_probs, capacity,
+                     [this](double, unsigned int) { return limits[0]; },
+                     [this]() { return carry(); });
+}
+
+void IsoThresholdGeneratorWS::terminate_search()
+{
+    top = 0;
+    for(int ii=0; ii<dimNumber; ii++)
+        counter[ii] = limits[ii] = 0;
+}
+
+/*
+ * ----------------------------------------------------------------------------------------------------------
+ */
+
+
+
+
+
+
+
+
+
+
+IsoThresholdGenerator::IsoThresholdGenerator(Iso&& iso, double _threshold, bool _absolute, int tabSize, int hashSize, bool lazy)
+: IsoGenerator(std::move(iso)),
+Lcutoff(_absolute ? log(_threshold) : log(_threshold) + modeLProb)
+{
+        marginalResults = new PrecalculatedMarginal*[dimNumber];
+
+	for(int ii=0; ii<dimNumber; ii++)
+            marginalResults[ii] = new PrecalculatedMarginal(std::move(*(marginals[ii])), 
+                                                            Lcutoff - modeLProb + marginals[ii]->getModeLProb(),
+                                                            true,
+                                                            tabSize, 
+                                                            hashSize,
+                                                            lazy);
+
+        setup();
+}
+
+IsoThresholdGenerator::IsoThresholdGenerator(Iso&& iso, const IsoThresholdGenerator& prev, double _threshold, bool _absolute, int tabSize, int hashSize)
+: IsoGenerator(std::move(iso)),
+Lcutoff(_absolute ? log(_threshold) : log(_threshold) + modeLProb)
+{
+        marginalResults = new PrecalculatedMarginal*[dimNumber];
+
+	for(int ii=0; ii<dimNumber; ii++)
+        {
+            const double lCutOff = Lcutoff - modeLProb + marginals[ii]->getModeLProb();
+            const PrecalculatedMarginal* base = nullptr;
+            for(int jj=0; jj<prev.dimNumber and base == nullptr; jj++)
+                if(marginals[ii]->same_element(*prev.marginalResults[jj]))
+                    base = prev.marginalResults[jj];
+
+            if(base != nullptr)
+                marginalResults[ii] = new PrecalculatedMarginal(std::move(*(marginals[ii])), *base, lCutOff, true, tabSize, hashSize);
+            else
+                marginalResults[ii] = new PrecalculatedMarginal(std::move(*(marginals[ii])), lCutOff, true, tabSize, hashSize);
+        }
+
+        setup();
+}
+
+IsoThresholdGenerator::IsoThresholdGenerator(Iso&& iso, PrecalculatedMarginal** PMs, double _Lcutoff)
+: IsoGenerator(std::move(iso)),
+Lcutoff(_Lcutoff)
+{
+        marginalResults = PMs;
+        setup();
+}
+
+void IsoThresholdGenerator::setup()
+{
+	counter 	= new unsigned int[dimNumber];
+	maxConfsLPSum 	= new double[dimNumber];
+
+        bool empty = false;
+	for(int ii=0; ii<dimNumber; ii++)
+	{
+	    counter[ii] = 0;
+            if(not marginalResults[ii]->inRange(0))
+                empty = true;
+	}
+
+        marginalOrder = order_marginals_by_size(marginalResults, dimNumber);
+
+        // Where the isotope counts of each (internal) marginal go in formula order
+        int* formulaOffsets = new int[dimNumber];
+        formulaOffsets[0] = 0;
+        for(int ii=1; ii<dimNumber; ii++)
+            formulaOffsets[ii] = formulaOffsets[ii-1] + isotopeNumbers[ii-1];
+        confOffsets = new int[dimNumber];
+        for(int ii=0; ii<dimNumber; ii++)
+            confOffsets[ii] = formulaOffsets[marginalOrder[ii]];
+        delete[] formulaOffsets;
+
+	maxConfsLPSum[0] = marginalResults[0]->getModeLProb();
+	for(int ii=1; ii<dimNumber-1; ii++)
+	    maxConfsLPSum[ii] = maxConfsLPSum[ii-1] + marginalResults[ii]->getModeLProb();
+
+        if(not empty)
+        {
+            recalc(dimNumber-1);
+            counter[0]--;
+        }
+        else
+            terminate_search();
+            
+
+}
+
+bool IsoThresholdGenerator::advanceToNextConfiguration()
+{
+	counter[0]++;
+	if(marginalResults[0]->inRange(counter[0]))
+	{
+		partialLProbs[0] = partialLProbs[1] + marginalResults[0]->get_lProb(counter[0]);
+		if(partialLProbs[0] >= Lcutoff)
+		{
+			partialMasses[0] = partialMasses[1] + marginalResults[0]->get_mass(counter[0]);
+                        partialExpProbs[0] = partialExpProbs[1] * marginalResults[0]->get_eProb(counter[0]);
+			return true;
+		}
+	}
+
+	// If we reached this point, a carry is needed
+	return carry();
+}
+
+bool IsoThresholdGenerator::carry()
+{
+	int idx = 0;
+
+	while(idx<dimNumber-1)
+	{
+		counter[idx] = 0;
+		idx++;
+		counter[idx]++;
+		if(marginalResults[idx]->inRange(counter[idx]))
+		{
+			partialLProbs[idx] = partialLProbs[idx+1] + marginalResults[idx]->get_lProb(counter[idx]);
+			if(partialLProbs[idx] + maxConfsLPSum[idx-1] >= Lcutoff)
+			{
+				partialMasses[idx] = partialMasses[idx+1] + marginalResults[idx]->get_mass(counter[idx]);
+                                partialExpProbs[idx] = partialExpProbs[idx+1] * marginalResults[idx]->get_eProb(counter[idx]);
+				recalc(idx-1);
+				return true;
+			}
+		}
+	}
+
+        terminate_search();
+	return false;
+}
 
-    // newaccepted.push_back(topConf);
-    currentLProb = *(reinterpret_cast<double*>(topConf));
-    currentMass = combinedSum( topConfIsoCounts, masses, dimNumber );
+size_t IsoThresholdGenerator::fill(double* out_masses, double* out_probs, size_t capacity)
+{
+    PrecalculatedMarginal* M0 = marginalResults[0];
+    return fill_runs(M0, counter, Lcutoff, out_masses, out_probs, capacity,
+                     [this, M0](double lprefix, unsigned int start)
+                     {
+                         // A lazy marginal 0 has to hold the whole run (past the end means we are done)
+                         if(start <= M0->get_no_confs())
+                             M0->extend_run(lprefix, Lcutoff);
+                         return M0->get_no_confs();
+                     },
+                     [this]() { return carry(); });
+}
+
+void IsoThresholdGenerator::terminate_search()
+{
+    for(int ii=0; ii<dimNumber; ii++)
+        counter[ii] = marginalResults[ii]->get_no_confs();
+}
+
+
+/*
+ * Visits every prefix over the outer marginals (1..dimNumber-1) that may still have
+ * configurations above Lcutoff. Since marginal 0 is sorted, the configurations below each
+ * prefix form the run [0, end) of it, so run(M0, lprefix, eprefix, end) is all there is to
+ * do per prefix: nothing is visited at the innermost level.
+ */
+template<typename RunVisitor>
+static void walk_threshold_runs(PrecalculatedMarginal* const * PMs, const double* maxConfsLPSum, int idx, double lprefix, double eprefix, double Lcutoff, RunVisitor& run)
+{
+    if(idx == 0)
+    {
+        PrecalculatedMarginal* M0 = PMs[0];
+        M0->extend_run(lprefix, Lcutoff);
+        run(M0, lprefix, eprefix, threshold_run_end(M0->get_lProbs_ptr(), 0, M0->get_no_confs(), lprefix, Lcutoff, M0->get_no_confs()));
+        return;
+    }
+
+    PrecalculatedMarginal* M = PMs[idx];
+    for(unsigned int ii = 0; M->inRange(ii); ii++)
+    {
+        const double lp = lprefix + M->get_lProb(ii);
+        if(lp + maxConfsLPSum[idx-1] < Lcutoff)
+            break;
+        walk_threshold_runs(PMs, maxConfsLPSum, idx-1, lp, eprefix * M->get_eProb(ii), Lcutoff, run);
+    }
+}
+
+template<typename RunVisitor>
+static void walk_threshold_runs(PrecalculatedMarginal* const * PMs, int dimNumber, double Lcutoff, RunVisitor& run)
+{
+    for(int ii = 0; ii < dimNumber; ii++)
+        if(not PMs[ii]->inRange(0))
+            return;
+
+    double* maxConfsLPSum = new double[dimNumber];
+    maxConfsLPSum[0] = PMs[0]->get_lProb(0);
+    for(int ii = 1; ii < dimNumber; ii++)
+        maxConfsLPSum[ii] = maxConfsLPSum[ii-1] + PMs[ii]->get_lProb(0);
+
+    walk_threshold_runs(PMs, maxConfsLPSum, dimNumber-1, 0.0, 1.0, Lcutoff, run);
+
+    delete[] maxConfsLPSum;
+}
+
+namespace {
+
+struct RunCount
+{
+    size_t count;
+
+    inline void operator()(const PrecalculatedMarginal*, double, double, unsigned int end) { count += end; }
+};
+
+// Number and total probability of the configurations above the threshold
+struct RunTotals
+{
+    size_t count;
+    Summator prob;
+
+    inline void operator()(const PrecalculatedMarginal* M0, double, double eprefix, unsigned int end)
+    {
+        count += end;
+        prob.add(eprefix * M0->get_cumEProbs_ptr()[end]);
+    }
+};
+
+// Log-probabilities and probabilities of the configurations in [Lcutoff, Lupper)
+struct RunBand
+{
+    double Lupper;
+    std::vector<std::pair<double, double> > band;
+
+    inline void operator()(const PrecalculatedMarginal* M0, double lprefix, double eprefix, unsigned int end)
+    {
+        const double* lProbs0 = M0->get_lProbs_ptr();
+        const double* eProbs0 = M0->get_eProbs_ptr();
+        for(unsigned int ii = threshold_run_end(lProbs0, 0, end, lprefix, Lupper, end); ii < end; ii++)
+            band.push_back(std::make_pair(lprefix + lProbs0[ii], eprefix * eProbs0[ii]));
+    }
+};
+
+}
+
+static RunTotals threshold_totals(PrecalculatedMarginal* const * PMs, int dimNumber, double Lcutoff)
+{
+    RunTotals totals;
+    totals.count = 0;
+    walk_threshold_runs(PMs, dimNumber, Lcutoff, totals);
+    return totals;
+}
+
+double threshold_total_prob(PrecalculatedMarginal* const * PMs, int dimNumber, double Lcutoff)
+{
+    if(dimNumber == 0)
+        return 1.0;
+    // Largest innermost, as the generator has it: far fewer prefixes to walk
+    PrecalculatedMarginal** ordered = array_copy<PrecalculatedMarginal*>(PMs, dimNumber);
+    delete[] order_marginals_by_size(ordered, dimNumber);
+    const double ret = threshold_totals(ordered, dimNumber, Lcutoff).prob.get();
+    delete[] ordered;
+    return ret;
+}
+
+void IsoThresholdGenerator::get_isotope_counts(int* target) const
+{
+    for(int ii = 0; ii < dimNumber; ii++)
+        memcpy(target + confOffsets[ii], marginalResults[ii]->get_conf(counter[ii]), isotopeNumbers[marginalOrder[ii]]*sizeof(int));
+}
+
+size_t IsoThresholdGenerator::count() const
+{
+    for(int ii = 0; ii < dimNumber; ii++)
+        if(not marginalResults[ii]->inRange(0))
+            return 0;
+
+    RunCount c = {0};
+    walk_threshold_runs(marginalResults, maxConfsLPSum, dimNumber-1, 0.0, 1.0, Lcutoff, c);
+    return c.count;
+}
+
+namespace {
+
+// Probabilities and probability-weighted masses, per number of extra neutrons
+struct NeutronTotals
+{
+    double* probs;
+    double* mass_sums;
+    std::vector<int> neutrons0;         // Of the configurations of the innermost marginal, so far
+};
+
+}
+
+static void walk_neutron_runs(PrecalculatedMarginal* const * PMs, const double* maxConfsLPSum, int* const * iso_neutrons, int idx, double lprefix, double eprefix, double mprefix, int nprefix, double Lcutoff, NeutronTotals& totals)
+{
+    if(idx == 0)
+    {
+        PrecalculatedMarginal* M0 = PMs[0];
+        M0->extend_run(lprefix, Lcutoff);
+        const unsigned int end = threshold_run_end(M0->get_lProbs_ptr(), 0, M0->get_no_confs(), lprefix, Lcutoff, M0->get_no_confs());
+
+        // Lazy marginals grow as we go
+        const int isotopeNo = M0->get_isotopeNo();
+        for(unsigned int ii = totals.neutrons0.size(); ii < end; ii++)
+        {
+            int n = 0;
+            for(int jj = 0; jj < isotopeNo; jj++)
+                n += M0->get_conf(ii)[jj] * iso_neutrons[0][jj];
+            totals.neutrons0.push_back(n);
+        }
+
+        const double* masses0 = M0->get_masses_ptr();
+        const double* eProbs0 = M0->get_eProbs_ptr();
+        const int* neutrons0 = totals.neutrons0.data();
+        double* probs = totals.probs + nprefix;
+        double* mass_sums = totals.mass_sums + nprefix;
+        for(unsigned int ii = 0; ii < end; ii++)
+        {
+            const double p = eprefix * eProbs0[ii];
+            probs[neutrons0[ii]] += p;
+            mass_sums[neutrons0[ii]] += p * (mprefix + masses0[ii]);
+        }
+        return;
+    }
+
+    PrecalculatedMarginal* M = PMs[idx];
+    const int isotopeNo = M->get_isotopeNo();
+    for(unsigned int ii = 0; M->inRange(ii); ii++)
+    {
+        const double lp = lprefix + M->get_lProb(ii);
+        if(lp + maxConfsLPSum[idx-1] < Lcutoff)
+            break;
+        int n = nprefix;
+        for(int jj = 0; jj < isotopeNo; jj++)
+            n += M->get_conf(ii)[jj] * iso_neutrons[idx][jj];
+        walk_neutron_runs(PMs, maxConfsLPSum, iso_neutrons, idx-1, lp, eprefix * M->get_eProb(ii), mprefix + M->get_mass(ii), n, Lcutoff, totals);
+    }
+}
+
+int IsoThresholdGenerator::max_extra_neutrons() const
+{
+    int ret = 0;
+    for(int ii = 0; ii < dimNumber; ii++)
+    {
+        int* iso_neutrons = new int[marginalResults[ii]->get_isotopeNo()];
+        marginalResults[ii]->get_extra_neutrons(iso_neutrons);
+        ret += marginalResults[ii]->get_atomCnt() * *std::max_element(iso_neutrons, iso_neutrons + marginalResults[ii]->get_isotopeNo());
+        delete[] iso_neutrons;
+    }
+    return ret;
+}
+
+void IsoThresholdGenerator::aggregate_by_neutrons(double* out_probs, double* out_masses) const
+{
+    const int max_n = max_extra_neutrons();
+    for(int n = 0; n <= max_n; n++)
+    {
+        out_probs[n] = 0.0;
+        out_masses[n] = 0.0;
+    }
+
+    if(dimNumber == 0)
+        return;
+    for(int ii = 0; ii < dimNumber; ii++)
+        if(not marginalResults[ii]->inRange(0))
+            return;
+
+    int** iso_neutrons = new int*[dimNumber];
+    for(int ii = 0; ii < dimNumber; ii++)
+    {
+        iso_neutrons[ii] = new int[marginalResults[ii]->get_isotopeNo()];
+        marginalResults[ii]->get_extra_neutrons(iso_neutrons[ii]);
+    }
+
+    NeutronTotals totals;
+    totals.probs = out_probs;
+    totals.mass_sums = out_masses;
+    walk_neutron_runs(marginalResults, maxConfsLPSum, iso_neutrons, dimNumber-1, 0.0, 1.0, 0.0, 0, Lcutoff, totals);
+
+    for(int n = 0; n <= max_n; n++)
+        if(out_probs[n] > 0.0)
+            out_masses[n] /= out_probs[n];
+
+    for(int ii = 0; ii < dimNumber; ii++)
+        delete[] iso_neutrons[ii];
+    delete[] iso_neutrons;
+}
+
+IsoThresholdGenerator* IsoThresholdGenerator::FromCoverage(Iso&& iso, double coverage, bool trim, int tabSize, int hashSize)
+{
+    const int dimNumber = iso.getDimNumber();
+    const double modeLProb = iso.getModeLProb();
+
+    // Lower the threshold (geometrically, in log space) until enough is covered. Marginals are
+    // rebuilt from the previous ones, each round has to cover strictly more of them.
+    double Lrel = coverage < 1.0 ? log1p(-coverage) - 1.0 : -std::numeric_limits<double>::infinity();
+    double Llo = modeLProb + Lrel;
+    double Lhi = modeLProb + 1.0;
+    PrecalculatedMarginal** PMs = iso.get_sorted_marginal_set(Llo, true, tabSize, hashSize);
+    RunTotals lo = threshold_totals(PMs, dimNumber, Llo);
+    RunTotals hi = lo;
+    hi.count = 0;
+    hi.prob = Summator();
+    while(lo.prob.get() < coverage and Llo > -std::numeric_limits<double>::infinity())
+    {
+        hi = lo;
+        Lhi = Llo;
+        Lrel *= 2.0;
+        // Beyond this the remaining probability is lost in rounding anyway
+        Llo = Lrel > -1500.0 ? modeLProb + Lrel : -std::numeric_limits<double>::infinity();
+        for(int ii = 0; ii < dimNumber; ii++)
+        {
+            PrecalculatedMarginal* pm = new PrecalculatedMarginal(std::move(*PMs[ii]), Llo - modeLProb + PMs[ii]->getModeLProb(), true, tabSize, hashSize);
+            delete PMs[ii];
+            PMs[ii] = pm;
+        }
+        lo = threshold_totals(PMs, dimNumber, Llo);
+    }
 
-    // totalProb.add( exp(*reinterpret_cast<double*>(topConf) ));
+    // From here on walk the marginals in the order the generator will use, so that the
+    // log-probabilities are summed up the same way and the cutoff found matches exactly
+    unsigned int* order = order_marginals_by_size(PMs, dimNumber);
 
+    // Bisect between the two, on the marginals built for the lower one, until the
+    // configurations in between are few enough to be trimmed directly (or, without
+    // trimming, as far as it goes)
+    const size_t max_band = trim ? std::max<size_t>(4096, lo.count / 256) : 1;
+    if(Llo > -std::numeric_limits<double>::infinity())
+        for(int iter = 0; iter < 128 and lo.count - hi.count > max_band; iter++)
+        {
+            const double Lmid = 0.5 * (Llo + Lhi);
+            if(Lmid <= Llo or Lmid >= Lhi)
+                break;
+            RunTotals mid = threshold_totals(PMs, dimNumber, Lmid);
+            if(mid.prob.get() >= coverage)
+            {
+                lo = mid;
+                Llo = Lmid;
+            }
+            else
+            {
+                hi = mid;
+                Lhi = Lmid;
+            }
+        }
+
+    double Lcutoff = Llo;
+    if(trim and lo.count > hi.count and lo.prob.get() >= coverage)
+    {
+        // Take just enough from the band [Llo, Lhi), most probable ones first
+        RunBand b;
+        b.Lupper = Lhi;
+        walk_threshold_runs(PMs, dimNumber, Llo, b);
+        std::sort(b.band.begin(), b.band.end(), std::greater<std::pair<double, double> >());
+
+        Summator s(hi.prob);
+        for(size_t ii = 0; ii < b.band.size(); ii++)
+        {
+            s.add(b.band[ii].second);
+            Lcutoff = b.band[ii].first;
+            if(s.get() >= coverage)
+                break;
+        }
+    }
+
+    PrecalculatedMarginal** ret = new PrecalculatedMarginal*[dimNumber];
+    for(int ii = 0; ii < dimNumber; ii++)
+        ret[order[ii]] = PMs[ii];
+    delete[] order;
+    delete[] PMs;
+
+    return new IsoThresholdGenerator(std::move(iso), ret, Lcutoff);
+}
+
+/*
+ * ----------------------------------------------------------------------------------------------------------
+ */
+
+
+
+
+
+
+/*
+ * ------------------------------------------------------------------------------------------------------------------------
+ */
+IsoOrderedGenerator::IsoOrderedGenerator(Iso&& iso, double _cutOff, int _tabSize, int _hashSize, size_t _maxConfs) :
+IsoGenerator(std::move(iso)),
+marginalResults(new MarginalTrek*[dimNumber]),
+logProbs(new const vector<double>*[dimNumber]),
+masses(new const vector<double>*[dimNumber]),
+cutOff(_cutOff),
+allocator(dimNumber, _tabSize),
+topConf(nullptr),
+toGo(_maxConfs)
+{
+    for(int ii = 0; ii<dimNumber; ii++)
+    {
+        marginalResults[ii] = new MarginalTrek(std::move(*(marginals[ii])), _tabSize, _hashSize);
+        logProbs[ii] = &marginalResults[ii]->conf_probs();
+        masses[ii] = &marginalResults[ii]->conf_masses();
+    }
+
+    void* initialConf = allocator.newConf();
+    memset(getConf(initialConf), 0, confSize);
+    *(reinterpret_cast<double*>(initialConf)) = combinedSum(getConf(initialConf), logProbs, dimNumber);
+
+    if(getLProb(initialConf) >= cutOff)
+        heap_push(initialConf);
+}
+
+
+IsoOrderedGenerator::~IsoOrderedGenerator()
+{
+    dealloc_table(marginalResults, dimNumber);
+    delete[] logProbs;
+    delete[] masses;
+}
+
+
+void IsoOrderedGenerator::heap_push(void* conf)
+{
+    const HeapEntry entry = {getLProb(conf), conf};
+    size_t idx = heap.size();
+    heap.push_back(entry);
+
+    while(idx > 0)
+    {
+        size_t parent = (idx - 1) / 4;
+        if(heap[parent].lprob >= entry.lprob)
+            break;
+        heap[idx] = heap[parent];
+        idx = parent;
+    }
+    heap[idx] = entry;
+}
+
+
+void* IsoOrderedGenerator::heap_pop()
+{
+    void* ret = heap[0].conf;
+    const HeapEntry last = heap.back();
+    heap.pop_back();
+    const size_t size = heap.size();
+    if(size == 0)
+        return ret;
+
+    // Sift the last entry down from the root, the 4 children of a node share a cache line
+    size_t idx = 0;
+    while(true)
+    {
+        size_t first = 4*idx + 1;
+        if(first >= size)
+            break;
+        size_t end = first + 4 < size ? first + 4 : size;
+        size_t best = first;
+        for(size_t child = first + 1; child < end; child++)
+            if(heap[child].lprob > heap[best].lprob)
+                best = child;
+        if(heap[best].lprob <= last.lprob)
+            break;
+        heap[idx] = heap[best];
+        idx = best;
+    }
+    heap[idx] = last;
+    return ret;
+}
+
+
+bool IsoOrderedGenerator::advanceToNextConfiguration()
+{
+    // The previous configuration is no longer needed by the caller
+    if(topConf != nullptr)
+        freeConfs.push_back(topConf);
+
+    if(heap.empty() or toGo == 0)
+    {
+        topConf = nullptr;
+        return false;
+    }
+
+    topConf = heap_pop();
+    toGo--;
+    int* topConfIsoCounts = getConf(topConf);
+
+    partialLProbs[0] = getLProb(topConf);
+    partialMasses[0] = combinedSum(topConfIsoCounts, masses, dimNumber);
+    partialExpProbs[0] = exp(partialLProbs[0]);
+
+    // Each configuration has exactly one parent: the one with the first nonzero coordinate
+    // decreased, so we only increase coordinates up to (and including) the first nonzero one.
     for(int j = 0; j < dimNumber; ++j)
     {
         // candidate cannot refer to a position that is
         // out of range of the stored marginal distribution.
         if(marginalResults[j]->probeConfigurationIdx(topConfIsoCounts[j] + 1))
         {
-            memcpy(candidate, topConfIsoCounts, confSize);
-            candidate[j]++;
-
-            double candidateLProb = combinedSum(candidate, logProbs, dimNumber);
+            void* candidate = newConf();
+            int* candidateIsoCounts = getConf(candidate);
+            memcpy(candidateIsoCounts, topConfIsoCounts, confSize);
+            candidateIsoCounts[j]++;
 
-            if (candidateLProb > cutOff)
-	    {
-                void*       acceptedCandidate                       = allocator.newConf();
-                int*        acceptedCandidateIsoCounts      = getConf(acceptedCandidate);
-                memcpy(     acceptedCandidateIsoCounts, candidate, confSize);
+            double candidateLProb = combinedSum(candidateIsoCounts, logProbs, dimNumber);
 
-                *(reinterpret_cast<double*>(acceptedCandidate)) = candidateLProb;
-                pq.push(acceptedCandidate);
-	    }
+            if(candidateLProb >= cutOff)
+            {
+                *(reinterpret_cast<double*>(candidate)) = candidateLProb;
+                heap_push(candidate);
+            }
+            else
+                freeConfs.push_back(candidate);
         }
         if(topConfIsoCounts[j] > 0)
             break;
     }
 
+    // Amortised: the frontier may grow up to twice the size that can still matter
+    if(heap.size() > 128 and toGo < heap.size() / 2)
+        prune_frontier();
 
     return true;
 }
-#endif
+
+
+/*
+ * Only the best toGo frontier entries can still be returned: every other entry (and all of
+ * its descendants, which are less probable than it) would come after toGo better ones.
+ */
+void IsoOrderedGenerator::prune_frontier()
+{
+    std::nth_element(heap.begin(), heap.begin() + toGo, heap.end(),
+                     [](const HeapEntry& a, const HeapEntry& b) { return a.lprob > b.lprob; });
+    for(size_t ii = toGo; ii < heap.size(); ii++)
+        freeConfs.push_back(heap[ii].conf);
+    heap.resize(toGo);
+
+    std::vector<HeapEntry> old;
+    old.swap(heap);
+    heap.reserve(old.size());
+    for(size_t ii = 0; ii < old.size(); ii++)
+        heap_push(old[ii].conf);
+}
+
+
+void IsoOrderedGenerator::get_isotope_counts(int* target) const
+{
+    const int* c = getConf(topConf);
+    for(int ii = 0; ii < dimNumber; ii++)
+    {
+        memcpy(target, marginalResults[ii]->confs()[c[ii]], isotopeNumbers[ii]*sizeof(int));
+        target += isotopeNumbers[ii];
+    }
+}
+
+
+size_t getTopK(Iso&& iso, size_t K, double* out_masses, double* out_lprobs, int* out_isotope_counts)
+{
+    const int allDim = iso.getAllDim();
+    IsoOrderedGenerator gen(std::move(iso), -std::numeric_limits<double>::infinity(), 1000, 1000, K);
+
+    size_t cnt = 0;
+    while(gen.advanceToNextConfiguration())
+    {
+        out_masses[cnt] = gen.mass();
+        out_lprobs[cnt] = gen.lprob();
+        if(out_isotope_counts != nullptr)
+            gen.get_isotope_counts(out_isotope_counts + cnt*allDim);
+        cnt++;
+    }
+    return cnt;
+}
+
 #ifndef BUILDING_R
 
 void printConfigurations(
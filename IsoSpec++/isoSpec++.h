@@ -41,9 +41,22 @@ unsigned int parse_formula(const char* formula, std::vector<const double*>& isot
 class IsoSpecLayered;
 class IsoThresholdGenerator;
 
+// What a threshold will produce, see Iso::estimateThreshold. The true values lie within the
+// _low and _high bounds, which come from the resolution of the histograms used.
+struct ThresholdEstimate
+{
+    double count;
+    double count_low, count_high;
+    double prob;
+    double prob_low, prob_high;
+};
+
 class Iso {
 private:
 	void setupMarginals(const double** _isotopeMasses, const double** _isotopeProbabilities);
+        // Replaces the first count marginals with tables of their configurations above
+        // Lrel (relative to the mode of the whole molecule)
+        void precalculate_marginals(PrecalculatedMarginal** target, int count, double Lrel, int tabSize, int hashSize);
 public:
         bool disowned;
 protected:
@@ -66,6 +79,11 @@ public:
 
 	Iso(const char* formula);
 
+        // The elements are indices into the per-element tables (see element_tables.h and
+        // find_element_index), so their isotopes need not be looked up. Throws
+        // std::invalid_argument on an invalid index.
+        Iso(int _dimNumber, const int* _elements, const int* _atomCounts);
+
         Iso(Iso&& other);
 
         Iso(const Iso& other, bool fullcopy);
@@ -76,7 +94,13 @@ public:
 	double getHeaviestPeakMass() const;
         inline double getModeLProb() const { return modeLProb; };
         inline int getDimNumber() const { return dimNumber; };
+        inline int getAllDim() const { return allDim; };
         PrecalculatedMarginal** get_MT_marginal_set(double Lcutoff, bool absolute, int tabSize, int hashSize);
+        PrecalculatedMarginal** get_sorted_marginal_set(double Lcutoff, bool absolute, int tabSize, int hashSize);
+
+        // Predicts the number and total probability of configurations above the threshold
+        // without enumerating them, from histograms of the marginals' log-probabilities.
+        ThresholdEstimate estimateThreshold(double threshold, bool absolute = true, unsigned int bins = 1024, int tabSize = 1000, int hashSize = 1000) const;
 
 };
 
@@ -226,53 +250,72 @@ public:
         inline IsoGenerator(Iso&& iso);
 	inline virtual ~IsoGenerator() { delete[] partialLProbs; delete[] partialMasses; delete[] partialExpProbs; };
 
+protected:
+        // Shared by the fill() of the threshold generators, see isoSpec++.cpp
+        template<typename RunLimit, typename Carry>
+        size_t fill_runs(PrecalculatedMarginal* M0, unsigned int* counter, double Lcutoff,
+                         double* out_masses, double* out_probs, size_t capacity,
+                         RunLimit run_limit, Carry carry);
+
 };
 
-#if 0
+/*
+ * Streams configurations in order of descending probability, optionally stopping at an
+ * (absolute) log-probability cutOff. Nothing is materialised: consumers may stop after
+ * the first N peaks, and memory is bounded by the size of the frontier. If the number of
+ * wanted peaks is known up front (maxConfs), the frontier is kept at O(maxConfs) entries.
+ */
 class IsoOrderedGenerator : public IsoGenerator
 {
 private:
-        MarginalTrek** marginalResults;
-	double cutOff;
-	std::priority_queue<void*,std::vector<void*>,ConfOrder> pq;
-	void IsoOrderedGenerator_init(double _cutoff);
-	void* 				topConf;
-	DirtyAllocator          	allocator;
+        struct HeapEntry
+        {
+            double lprob;
+            void* conf;
+        };
+
+        MarginalTrek**                  marginalResults;
         const std::vector<double>**     logProbs;
         const std::vector<double>**     masses;
-        const std::vector<int*>**       marginalConfs;
-	double 				currentLProb;
-	double 				currentMass;
-	int*				candidate;
+        const double                    cutOff;
+        DirtyAllocator                  allocator;
+        std::vector<HeapEntry>          heap;           // 4-ary max-heap of the frontier
+        std::vector<void*>              freeConfs;      // popped nodes, for reuse
+        void*                           topConf;
+        size_t                          toGo;           // how many more we may return
 
 public:
 	virtual bool advanceToNextConfiguration();
-	virtual const double& lprob() const { return currentLProb; };
-	virtual const double& mass() const { return currentMass; };
-
-	inline IsoOrderedGenerator(int             _dimNumber,
-                                   const int*      _isotopeNumbers,
-                                   const int*      _atomCounts,
-                                   const double**  _isotopeMasses,
-                                   const double**  _isotopeProbabilities,
-                                   const double    _cutOff   = -std::numeric_limits<double>::infinity(),
-                                   int             _tabSize  = 1000,
-                                   int             _hashSize = 1000) : 
-			IsoGenerator(_dimNumber, _isotopeNumbers, _atomCounts, _isotopeMasses, _isotopeProbabilities, _tabSize, _hashSize),
-			allocator(dimNumber, _tabSize)
-			{ IsoOrderedGenerator_init(_cutOff); };
-
-	inline IsoOrderedGenerator(const char* formula,
-                		   double  _cutOff   = std::numeric_limits<double>::infinity(),
-		                   int     _tabSize  = 1000,
-                		   int     _hashSize = 1000) : IsoGenerator(formula, _tabSize, _hashSize),
-				   			       allocator(dimNumber, _tabSize)
-				   			       { IsoOrderedGenerator_init(_cutOff); };
+        virtual inline void get_conf_signature(unsigned int* target) { const int* c = getConf(topConf); for(int ii=0; ii<dimNumber; ii++) target[ii] = c[ii]; };
+        // Writes the isotope counts of the current configuration, allDim ints
+        void get_isotope_counts(int* target) const;
+
+        IsoOrderedGenerator(Iso&& iso, double _cutOff = -std::numeric_limits<double>::infinity(), int _tabSize = 1000, int _hashSize = 1000,
+                            size_t _maxConfs = std::numeric_limits<size_t>::max());
 
 	virtual ~IsoOrderedGenerator();
 
+private:
+        inline void* newConf()
+        {
+            if(freeConfs.empty())
+                return allocator.newConf();
+            void* ret = freeConfs.back();
+            freeConfs.pop_back();
+            return ret;
+        }
+        void heap_push(void* conf);
+        void* heap_pop();
+        void prune_frontier();
 };
-#endif
+
+/*
+ * Writes the K most probable configurations in descending order of probability, returns
+ * how many were written (fewer than K only if the whole distribution is smaller). The
+ * isotope counts (allDim ints per configuration) are written only if out_isotope_counts
+ * is not null. Work and memory are proportional to K, not to any probability region.
+ */
+size_t getTopK(Iso&& iso, size_t K, double* out_masses, double* out_lprobs, int* out_isotope_counts = nullptr);
 
 class IsoThresholdGenerator : public IsoGenerator
 {
@@ -281,20 +324,57 @@ private:
 	double* maxConfsLPSum;
 	const double Lcutoff;
         PrecalculatedMarginal** marginalResults;
+        unsigned int* marginalOrder;
+        int* confOffsets;
 
 public:
 	virtual bool advanceToNextConfiguration();
-        virtual inline void get_conf_signature(unsigned int* target) { memcpy(target, counter, sizeof(unsigned int)*dimNumber); };
+        virtual inline void get_conf_signature(unsigned int* target) { for(int ii=0; ii<dimNumber; ii++) target[marginalOrder[ii]] = counter[ii]; };
 //	virtual const int* const & conf() const;
 
-        IsoThresholdGenerator(Iso&& iso, double  _threshold, bool _absolute = true, int _tabSize  = 1000, int _hashSize = 1000);
-
-	inline virtual ~IsoThresholdGenerator() { delete[] counter; delete[] maxConfsLPSum; 
+        // With lazy, the marginals are only extended as far as the enumeration reaches, which
+        // makes the first configurations cheap if the caller stops early.
+        IsoThresholdGenerator(Iso&& iso, double  _threshold, bool _absolute = true, int _tabSize  = 1000, int _hashSize = 1000, bool lazy = false);
+        // The same, for a molecule which differs from the one of prev by a few atoms: marginals
+        // are derived from the ones of prev where possible (see PrecalculatedMarginal). That
+        // needs prev to reach as low as the new cutoffs, e.g. with an absolute threshold on a
+        // growing molecule, or a lower threshold for prev. prev is only used during construction.
+        IsoThresholdGenerator(Iso&& iso, const IsoThresholdGenerator& prev, double _threshold, bool _absolute = true, int _tabSize = 1000, int _hashSize = 1000);
+        // Takes ownership of PMs, which have to be sorted and cover _Lcutoff (an absolute log-probability)
+        IsoThresholdGenerator(Iso&& iso, PrecalculatedMarginal** PMs, double _Lcutoff);
+
+        // Picks the threshold so that the configurations above it sum up to at least coverage.
+        // With trim, the ones with the lowest probability are cut off until just enough remain
+        // (up to ties), which gives the same set as IsoSpecLayered.
+        static IsoThresholdGenerator* FromCoverage(Iso&& iso, double coverage, bool trim = true, int _tabSize = 1000, int _hashSize = 1000);
+
+        // Writes up to capacity further configurations as structure-of-arrays, returns how many were written.
+        // Can be freely mixed with advanceToNextConfiguration(); afterwards lprob() etc. describe the last one written.
+        size_t fill(double* out_masses, double* out_probs, size_t capacity);
+
+        // Writes the isotope counts of the current configuration (allDim ints, in formula order)
+        void get_isotope_counts(int* target) const;
+
+        // Number of configurations above the threshold, in total, regardless of how far the
+        // enumeration has got. Counts whole innermost runs, nothing is computed per configuration.
+        size_t count() const;
+
+        // Fine structure aggregated by the number of extra neutrons (over the lightest isotopes
+        // of the elements): for n = 0..max_extra_neutrons(), the total probability of the
+        // configurations above the threshold with n extra neutrons, and their mean mass
+        // weighted by probability (0.0 if there are none). Like count(), it does not depend
+        // on the enumeration, and nothing is output per configuration.
+        int max_extra_neutrons() const;
+        void aggregate_by_neutrons(double* out_probs, double* out_masses) const;
+
+	inline virtual ~IsoThresholdGenerator() { delete[] counter; delete[] maxConfsLPSum; delete[] marginalOrder; delete[] confOffsets;
                                                     dealloc_table(marginalResults, dimNumber);};
 
         void terminate_search();
 
 private:
+        void setup();
+        bool carry();
 	inline void recalc(int idx)
 	{
 		for(; idx >=0; idx--)
@@ -310,35 +390,67 @@ private:
 };
 
 
+// Total probability of the configurations with log-probability at or above Lcutoff, from
+// marginals sorted by descending log-probability, without enumerating them
+double threshold_total_prob(PrecalculatedMarginal* const * PMs, int dimNumber, double Lcutoff);
+
+
+/*
+ * Configurations above the threshold with masses in [min_mass, max_mass], in no particular
+ * order. Each marginal is searched in a range tree for the configurations which can still
+ * end up in the window: the lighter and heavier the marginals below it can get (with what
+ * is left of the probability) bound the masses at every level, so narrow windows cost
+ * little more than what they contain. The largest marginal is innermost.
+ *
+ * Several windows, sorted and disjoint, are handled in one pass: the outer marginals are
+ * searched for all of them at once, the innermost one window by window, and window() tells
+ * which one the current configuration is in. The configurations come window by window for
+ * each configuration of the outer marginals, not all of a window first.
+ */
 class IsoThresholdGeneratorBoundMass : public IsoGenerator
 {
 private:
-	double* maxConfsLPSum, *minMassCSum, *maxMassCSum;
+	double* maxConfsLPSum;          // Of the modes of the marginals up to (and including) ii
+        double* modeLProbs;
 	double Lcutoff;
-        double min_mass, max_mass;
+        double* window_mins;
+        double* window_maxs;
+        unsigned int no_windows;
+        unsigned int cur_window, end_window;    // Of the innermost marginal, for the current outer configuration
+        double min_mass, max_mass;      // Of all the windows
+        double innermost_lProb;
+        double mass_slack;              // Against rounding in the bounds of the inner searches
         RGTMarginal** marginalResults;
 
 public:
 	virtual bool advanceToNextConfiguration();
-//        virtual inline void get_conf_signature(unsigned int* target);
-//	virtual const int* const & conf() const;
 
         IsoThresholdGeneratorBoundMass(Iso&& iso, double  _threshold, double min_mass, double max_mass, bool _absolute = true, int _tabSize  = 1000, int _hashSize = 1000);
 
+        // Throws std::invalid_argument unless window_mins[ii] <= window_maxs[ii] < window_mins[ii+1]
+        IsoThresholdGeneratorBoundMass(Iso&& iso, double  _threshold, const double* window_mins, const double* window_maxs, unsigned int no_windows, bool _absolute = true, int _tabSize  = 1000, int _hashSize = 1000);
+
 	virtual ~IsoThresholdGeneratorBoundMass();
 
+        inline unsigned int window() const { return cur_window; };
+        inline unsigned int get_no_windows() const { return no_windows; };
+
+        // Writes up to capacity further configurations, returns how many were written;
+        // out_windows may be nullptr
+        size_t fill(double* out_masses, double* out_probs, size_t capacity, unsigned int* out_windows = nullptr);
+
 private:
+        void init(double _threshold, const double* _window_mins, const double* _window_maxs, unsigned int _no_windows, bool _absolute, int tabSize, int hashSize);
+        bool carry();
 	void setup_ith_marginal_range(unsigned int idx);
+        void setup_window_search();
         inline void recalc(int idx)
         {
             partialLProbs[idx] = partialLProbs[idx+1] + marginalResults[idx]->current_lProb();
             partialMasses[idx] = partialMasses[idx+1] + marginalResults[idx]->current_mass();
             partialExpProbs[idx] = partialExpProbs[idx+1] * marginalResults[idx]->current_eProb();
         }
-        
-
-
-
+        inline bool in_window() const { return window_mins[cur_window] <= partialMasses[0] and partialMasses[0] <= window_maxs[cur_window]; };
 };
 
 
@@ -359,10 +471,15 @@ public:
 
         IsoThresholdGeneratorMT(Iso&& iso, double  _threshold, PrecalculatedMarginal** marginals, bool _absolute = true);
 
+        // Writes up to capacity further configurations as structure-of-arrays, returns how many were written.
+        // Can be freely mixed with advanceToNextConfiguration(); afterwards lprob() etc. describe the last one written.
+        size_t fill(double* out_masses, double* out_probs, size_t capacity);
+
 	inline virtual ~IsoThresholdGeneratorMT() { delete[] counter; delete[] maxConfsLPSum;};
         void terminate_search();
 
 private:
+        bool carry();
 	inline void recalc(int idx)
 	{
 		for(; idx >=0; idx--)
@@ -378,6 +495,102 @@ private:
 };
 
 
+/*
+ * A task is a subtree of the threshold search: marginals [depth, dimNumber) are fixed
+ * by the stored counters, marginal depth-1 runs over [lo, hi) and all marginals below
+ * it are free.
+ */
+struct ThresholdTask
+{
+        unsigned int depth;
+        unsigned int lo, hi;
+        double lprob, mass, eprob;
+};
+
+class ThresholdWorkPool
+{
+private:
+        struct TaskDeque
+        {
+            char padding[PADDING]; // against false-sharing cache lines...
+            std::atomic<unsigned long long> range; // head in the upper 32 bits, tail in the lower ones
+        };
+
+        const int dimNumber;
+        const double Lcutoff;
+        const unsigned int n_threads;
+        PrecalculatedMarginal** marginalResults;
+        unsigned int* marginalOrder;
+        double* maxConfsLPSum;
+        double* innerMass;
+        double grain;
+        std::vector<ThresholdTask> tasks;
+        std::vector<unsigned int> task_counters;
+        unsigned int* task_order;
+        TaskDeque* deques;
+
+        void split(unsigned int depth, unsigned int* prefix, double lprob, double mass, double eprob);
+        void add_task(unsigned int depth, const unsigned int* prefix, unsigned int lo, unsigned int hi, double lprob, double mass, double eprob);
+        bool pop(unsigned int thread_id, unsigned int& task_idx);
+        bool steal(unsigned int thread_id, unsigned int victim, unsigned int& task_idx);
+
+public:
+        ThresholdWorkPool(Iso& iso, double _threshold, bool _absolute, unsigned int _n_threads, unsigned int tasks_per_thread = 16, int tabSize = 1000, int hashSize = 1000);
+        ~ThresholdWorkPool();
+
+        bool get_task(unsigned int thread_id, unsigned int& task_idx);
+        inline const ThresholdTask& task(unsigned int task_idx) const { return tasks[task_idx]; };
+        inline const unsigned int* task_prefix(unsigned int task_idx) const { return &task_counters[task_idx*dimNumber]; };
+        inline unsigned int get_no_tasks() const { return tasks.size(); };
+        inline unsigned int get_n_threads() const { return n_threads; };
+        inline double get_Lcutoff() const { return Lcutoff; };
+        inline PrecalculatedMarginal* const * get_marginals() const { return marginalResults; };
+        inline const unsigned int* get_marginal_order() const { return marginalOrder; };
+        inline const double* get_maxConfsLPSum() const { return maxConfsLPSum; };
+};
+
+
+class IsoThresholdGeneratorWS : public IsoGenerator
+{
+private:
+	unsigned int* counter;
+        unsigned int* limits;
+	const double* maxConfsLPSum;
+	const double Lcutoff;
+        int top;
+        ThresholdWorkPool& pool;
+        const unsigned int thread_id;
+        PrecalculatedMarginal* const * marginalResults;
+        const unsigned int* marginalOrder;
+
+public:
+	virtual bool advanceToNextConfiguration();
+        virtual inline void get_conf_signature(unsigned int* target) { for(int ii=0; ii<dimNumber; ii++) target[marginalOrder[ii]] = counter[ii]; };
+
+        IsoThresholdGeneratorWS(Iso&& iso, ThresholdWorkPool& _pool, unsigned int _thread_id);
+
+        // Writes up to capacity further configurations as structure-of-arrays, returns how many were written.
+        // Can be freely mixed with advanceToNextConfiguration(); afterwards lprob() etc. describe the last one written.
+        size_t fill(double* out_masses, double* out_probs, size_t capacity);
+
+	inline virtual ~IsoThresholdGeneratorWS() { delete[] counter; delete[] limits; };
+        void terminate_search();
+
+private:
+        bool carry();
+        bool load_task(unsigned int task_idx);
+	inline void recalc(int idx)
+	{
+		for(; idx >=0; idx--)
+		{
+			partialLProbs[idx] = partialLProbs[idx+1] + marginalResults[idx]->get_lProb(counter[idx]);
+			partialMasses[idx] = partialMasses[idx+1] + marginalResults[idx]->get_mass(counter[idx]);
+                        partialExpProbs[idx] = partialExpProbs[idx+1] * marginalResults[idx]->get_eProb(counter[idx]);
+		}
+	}
+};
+
+
 
 
 
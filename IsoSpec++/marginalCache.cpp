@@ -0,0 +1,449 @@
+/*
+ *   Copyright (C) 2015-2016 Mateusz Łącki and Michał Startek.
+ *
+ *   This file is part of IsoSpec.
+ *
+ *   IsoSpec is free software: you can redistribute it and/or modify
+ *   it under the terms of the Simplified ("2-clause") BSD licence.
+ *
+ *   IsoSpec is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ *   You should have received a copy of the Simplified BSD Licence
+ *   along with IsoSpec.  If not, see <https://opensource.org/licenses/BSD-2-Clause>.
+ */
+
+
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <utility>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "marginalCache.h"
+#include "summator.h"
+
+
+/*
+ * Cache file layout: the header, n_entries MarginalFileEntry records, then the keys and
+ * the arrays, each 8-byte aligned. Offsets are from the start of the file. It is written
+ * and read in the native byte order, which the header records.
+ */
+#define MARGINAL_FILE_MAGIC "IsoSpecM"
+#define MARGINAL_FILE_VERSION 1
+#define MARGINAL_FILE_BYTE_ORDER 0x01020304
+
+struct MarginalFileHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t n_entries;
+    uint64_t file_len;
+};
+
+struct MarginalFileEntry
+{
+    uint64_t key_offset;
+    uint64_t key_len;
+    double lCutOff;
+    uint64_t no_confs;
+    uint32_t isotopeNo;
+    uint32_t padding;
+    uint64_t confs_offset;
+    uint64_t lProbs_offset;
+    uint64_t masses_offset;
+    uint64_t eProbs_offset;
+    uint64_t cumEProbs_offset;      // no_confs+1 entries
+};
+
+static inline uint64_t align8(uint64_t x) { return (x + 7) & ~uint64_t(7); }
+
+// Number of leading lProbs at or above lCutOff, lProbs being sorted
+static unsigned int prefix_len(const double* lProbs, unsigned int size, double lCutOff)
+{
+    unsigned int lo = 0, hi = size;
+    while(lo < hi)
+    {
+        unsigned int mid = lo + (hi - lo) / 2;
+        if(lProbs[mid] >= lCutOff)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+
+MarginalCache::MarginalCache() :
+capacity(0),
+held_confs(0),
+hits(0),
+mapped_hits(0),
+misses(0),
+evictions(0),
+has_mapped(false)
+{}
+
+MarginalCache::~MarginalCache()
+{
+    for(size_t ii = 0; ii < mappings.size(); ii++)
+        munmap(mappings[ii].first, mappings[ii].second);
+}
+
+MarginalCache& MarginalCache::global()
+{
+    static MarginalCache cache;
+    return cache;
+}
+
+static thread_local MarginalCache* thread_cache = nullptr;
+
+MarginalCache& MarginalCache::current()
+{
+    return thread_cache != nullptr ? *thread_cache : global();
+}
+
+void MarginalCache::set_thread_cache(MarginalCache* cache)
+{
+    thread_cache = cache;
+}
+
+MarginalCache* MarginalCache::get_thread_cache()
+{
+    return thread_cache;
+}
+
+std::string MarginalCache::make_key(int isotopeNo, int atomCnt, const double* atom_masses, const double* atom_lProbs)
+{
+    std::string key(2*sizeof(int) + 2*isotopeNo*sizeof(double), '\0');
+    char* p = &key[0];
+    memcpy(p, &isotopeNo, sizeof(int));
+    p += sizeof(int);
+    memcpy(p, &atomCnt, sizeof(int));
+    p += sizeof(int);
+    memcpy(p, atom_masses, isotopeNo*sizeof(double));
+    p += isotopeNo*sizeof(double);
+    memcpy(p, atom_lProbs, isotopeNo*sizeof(double));
+    return key;
+}
+
+void MarginalCache::set_capacity(size_t confs)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    capacity.store(confs, std::memory_order_relaxed);
+    evict_down_to(confs);
+}
+
+void MarginalCache::clear()
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    entries.clear();
+    lru.clear();
+    held_confs = 0;
+    hits = mapped_hits = misses = evictions = 0;
+}
+
+MarginalCacheStats MarginalCache::get_stats() const
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    MarginalCacheStats ret;
+    ret.hits = hits;
+    ret.mapped_hits = mapped_hits;
+    ret.misses = misses;
+    ret.evictions = evictions;
+    ret.entries = entries.size();
+    ret.confs = held_confs;
+    return ret;
+}
+
+bool MarginalCache::find(const std::string& key, double lCutOff, std::shared_ptr<const MarginalTable>& out, unsigned int& out_len, MappedMarginalTable& mapped_out)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+
+    out.reset();
+    mapped_out.lProbs = nullptr;
+
+    auto it = entries.find(key);
+    if(it == entries.end() or it->second.table->lCutOff > lCutOff)
+    {
+        auto mit = mapped.find(key);
+        if(mit == mapped.end() or mit->second.second->lCutOff > lCutOff)
+        {
+            misses++;
+            return false;
+        }
+        hits++;
+        mapped_hits++;
+
+        const char* base = mit->second.first;
+        const MarginalFileEntry* e = mit->second.second;
+        mapped_out.confs = reinterpret_cast<const int*>(base + e->confs_offset);
+        mapped_out.lProbs = reinterpret_cast<const double*>(base + e->lProbs_offset);
+        mapped_out.masses = reinterpret_cast<const double*>(base + e->masses_offset);
+        mapped_out.eProbs = reinterpret_cast<const double*>(base + e->eProbs_offset);
+        mapped_out.cumEProbs = reinterpret_cast<const double*>(base + e->cumEProbs_offset);
+        mapped_out.no_confs = prefix_len(mapped_out.lProbs, static_cast<unsigned int>(e->no_confs), lCutOff);
+        return true;
+    }
+    hits++;
+    lru.splice(lru.begin(), lru, it->second.lru_pos);
+
+    // The table is sorted, so what we need is a prefix of it
+    out = it->second.table;
+    out_len = prefix_len(out->lProbs.data(), out->lProbs.size(), lCutOff);
+    return true;
+}
+
+void MarginalCache::insert(const std::string& key, MarginalTable&& table)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+
+    const size_t size = table.lProbs.size();
+    if(capacity.load(std::memory_order_relaxed) == 0 or size > capacity.load(std::memory_order_relaxed))
+        return;
+
+    auto it = entries.find(key);
+    if(it != entries.end())
+    {
+        if(it->second.table->lCutOff <= table.lCutOff)
+            return;
+        // Ours reaches further: replace
+        held_confs -= it->second.table->lProbs.size();
+        lru.erase(it->second.lru_pos);
+        entries.erase(it);
+    }
+
+    evict_down_to(capacity.load(std::memory_order_relaxed) - size);
+
+    lru.push_front(key);
+    Entry& e = entries[key];
+    e.table = std::make_shared<const MarginalTable>(std::move(table));
+    e.lru_pos = lru.begin();
+    held_confs += size;
+}
+
+void MarginalCache::evict_down_to(size_t confs)
+{
+    while(held_confs > confs)
+    {
+        auto it = entries.find(lru.back());
+        held_confs -= it->second.table->lProbs.size();
+        entries.erase(it);
+        lru.pop_back();
+        evictions++;
+    }
+}
+
+/*
+ * One table to be written out, from memory or from a mapped file
+ */
+struct TableToSave
+{
+    const std::string* key;
+    double lCutOff;
+    uint64_t no_confs;
+    uint32_t isotopeNo;
+    const int* confs;
+    const double* lProbs;
+    const double* masses;
+    const double* eProbs;
+    const double* cumEProbs;        // nullptr: to be computed
+};
+
+static bool write_padded(FILE* f, const void* data, uint64_t len)
+{
+    static const char zeros[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+    if(len > 0 and fwrite(data, 1, len, f) != len)
+        return false;
+    const uint64_t pad = align8(len) - len;
+    return pad == 0 or fwrite(zeros, 1, pad, f) == pad;
+}
+
+bool MarginalCache::save(const char* path) const
+{
+    std::lock_guard<std::mutex> lock(mtx);
+
+    std::vector<TableToSave> tables;
+    for(auto it = entries.begin(); it != entries.end(); ++it)
+    {
+        const MarginalTable& t = *it->second.table;
+        TableToSave ts;
+        ts.key = &it->first;
+        ts.lCutOff = t.lCutOff;
+        ts.no_confs = t.lProbs.size();
+        memcpy(&ts.isotopeNo, it->first.data(), sizeof(int));
+        ts.confs = t.confs.data();
+        ts.lProbs = t.lProbs.data();
+        ts.masses = t.masses.data();
+        ts.eProbs = t.eProbs.data();
+        ts.cumEProbs = nullptr;
+        tables.push_back(ts);
+    }
+    for(auto it = mapped.begin(); it != mapped.end(); ++it)
+    {
+        auto mem = entries.find(it->first);
+        const char* base = it->second.first;
+        const MarginalFileEntry* e = it->second.second;
+        if(mem != entries.end() and mem->second.table->lCutOff <= e->lCutOff)
+            continue;
+        if(mem != entries.end())
+            // The mapped one reaches further
+            for(size_t ii = 0; ii < tables.size(); ii++)
+                if(tables[ii].key == &mem->first)
+                {
+                    tables[ii] = tables.back();
+                    tables.pop_back();
+                    break;
+                }
+        TableToSave ts;
+        ts.key = &it->first;
+        ts.lCutOff = e->lCutOff;
+        ts.no_confs = e->no_confs;
+        ts.isotopeNo = e->isotopeNo;
+        ts.confs = reinterpret_cast<const int*>(base + e->confs_offset);
+        ts.lProbs = reinterpret_cast<const double*>(base + e->lProbs_offset);
+        ts.masses = reinterpret_cast<const double*>(base + e->masses_offset);
+        ts.eProbs = reinterpret_cast<const double*>(base + e->eProbs_offset);
+        ts.cumEProbs = reinterpret_cast<const double*>(base + e->cumEProbs_offset);
+        tables.push_back(ts);
+    }
+
+    // Lay the file out (the header and the entries are multiples of 8 bytes)
+    std::vector<MarginalFileEntry> index(tables.size());
+    uint64_t offset = sizeof(MarginalFileHeader) + tables.size() * sizeof(MarginalFileEntry);
+    for(size_t ii = 0; ii < tables.size(); ii++)
+    {
+        const TableToSave& ts = tables[ii];
+        MarginalFileEntry& e = index[ii];
+        memset(&e, 0, sizeof(e));
+        e.key_offset = offset;
+        e.key_len = ts.key->size();
+        offset += align8(e.key_len);
+        e.lCutOff = ts.lCutOff;
+        e.no_confs = ts.no_confs;
+        e.isotopeNo = ts.isotopeNo;
+        e.confs_offset = offset;
+        offset += align8(ts.no_confs * ts.isotopeNo * sizeof(int));
+        e.lProbs_offset = offset;
+        offset += ts.no_confs * sizeof(double);
+        e.masses_offset = offset;
+        offset += ts.no_confs * sizeof(double);
+        e.eProbs_offset = offset;
+        offset += ts.no_confs * sizeof(double);
+        e.cumEProbs_offset = offset;
+        offset += (ts.no_confs + 1) * sizeof(double);
+    }
+
+    MarginalFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MARGINAL_FILE_MAGIC, 8);
+    header.version = MARGINAL_FILE_VERSION;
+    header.byte_order = MARGINAL_FILE_BYTE_ORDER;
+    header.n_entries = tables.size();
+    header.file_len = offset;
+
+    // Written next to the target and renamed over it, so that readers never see half of it
+    const std::string tmp_path = std::string(path) + ".tmp";
+    FILE* f = fopen(tmp_path.c_str(), "wb");
+    if(f == NULL)
+        return false;
+
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+    for(size_t ii = 0; ok and ii < index.size(); ii++)
+        ok = fwrite(&index[ii], sizeof(MarginalFileEntry), 1, f) == 1;
+
+    std::vector<double> cumEProbs;
+    for(size_t ii = 0; ok and ii < tables.size(); ii++)
+    {
+        const TableToSave& ts = tables[ii];
+        const double* cum = ts.cumEProbs;
+        if(cum == nullptr)
+        {
+            cumEProbs.resize(ts.no_confs + 1);
+            Summator s;
+            cumEProbs[0] = 0.0;
+            for(uint64_t jj = 0; jj < ts.no_confs; jj++)
+            {
+                s.add(ts.eProbs[jj]);
+                cumEProbs[jj+1] = s.get();
+            }
+            cum = cumEProbs.data();
+        }
+        ok = write_padded(f, ts.key->data(), ts.key->size())
+         and write_padded(f, ts.confs, ts.no_confs * ts.isotopeNo * sizeof(int))
+         and write_padded(f, ts.lProbs, ts.no_confs * sizeof(double))
+         and write_padded(f, ts.masses, ts.no_confs * sizeof(double))
+         and write_padded(f, ts.eProbs, ts.no_confs * sizeof(double))
+         and write_padded(f, cum, (ts.no_confs + 1) * sizeof(double));
+    }
+
+    ok = (fclose(f) == 0) and ok;
+    if(ok)
+        ok = rename(tmp_path.c_str(), path) == 0;
+    if(not ok)
+        remove(tmp_path.c_str());
+    return ok;
+}
+
+bool MarginalCache::map_file(const char* path)
+{
+    int fd = open(path, O_RDONLY);
+    if(fd < 0)
+        return false;
+    struct stat st;
+    if(fstat(fd, &st) != 0 or static_cast<uint64_t>(st.st_size) < sizeof(MarginalFileHeader))
+    {
+        close(fd);
+        return false;
+    }
+    const uint64_t len = st.st_size;
+    void* addr = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(addr == MAP_FAILED)
+        return false;
+
+    // Check everything, so that lookups do not have to
+    const char* base = reinterpret_cast<const char*>(addr);
+    const MarginalFileHeader* header = reinterpret_cast<const MarginalFileHeader*>(base);
+    bool ok = memcmp(header->magic, MARGINAL_FILE_MAGIC, 8) == 0
+          and header->version == MARGINAL_FILE_VERSION
+          and header->byte_order == MARGINAL_FILE_BYTE_ORDER
+          and header->file_len == len
+          and header->n_entries <= (len - sizeof(MarginalFileHeader)) / sizeof(MarginalFileEntry);
+
+    const MarginalFileEntry* index = reinterpret_cast<const MarginalFileEntry*>(base + sizeof(MarginalFileHeader));
+    for(uint64_t ii = 0; ok and ii < header->n_entries; ii++)
+    {
+        const MarginalFileEntry& e = index[ii];
+        const uint64_t n = e.no_confs;
+        ok = e.isotopeNo > 0 and e.isotopeNo < 1024 and n < (uint64_t(1) << 32)
+         and e.key_offset <= len and e.key_len <= len - e.key_offset and e.key_len == 2*sizeof(int) + 2*e.isotopeNo*sizeof(double)
+         and e.confs_offset % 8 == 0 and e.confs_offset <= len and n * e.isotopeNo * sizeof(int) <= len - e.confs_offset
+         and e.lProbs_offset % 8 == 0 and e.lProbs_offset <= len and n * sizeof(double) <= len - e.lProbs_offset
+         and e.masses_offset % 8 == 0 and e.masses_offset <= len and n * sizeof(double) <= len - e.masses_offset
+         and e.eProbs_offset % 8 == 0 and e.eProbs_offset <= len and n * sizeof(double) <= len - e.eProbs_offset
+         and e.cumEProbs_offset % 8 == 0 and e.cumEProbs_offset <= len and (n+1) * sizeof(double) <= len - e.cumEProbs_offset;
+    }
+    if(not ok)
+    {
+        munmap(addr, len);
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(mtx);
+    mappings.push_back(std::make_pair(addr, static_cast<size_t>(len)));
+    for(uint64_t ii = 0; ii < header->n_entries; ii++)
+    {
+        const MarginalFileEntry* e = &index[ii];
+        std::string key(base + e->key_offset, e->key_len);
+        auto it = mapped.find(key);
+        if(it == mapped.end() or it->second.second->lCutOff > e->lCutOff)
+            mapped[key] = std::make_pair(base, e);
+    }
+    has_mapped.store(true, std::memory_order_relaxed);
+    return true;
+}
@@ -0,0 +1,145 @@
+/*
+ *   Copyright (C) 2015-2016 Mateusz Łącki and Michał Startek.
+ *
+ *   This file is part of IsoSpec.
+ *
+ *   IsoSpec is free software: you can redistribute it and/or modify
+ *   it under the terms of the Simplified ("2-clause") BSD licence.
+ *
+ *   IsoSpec is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ *   You should have received a copy of the Simplified BSD Licence
+ *   along with IsoSpec.  If not, see <https://opensource.org/licenses/BSD-2-Clause>.
+ */
+
+
+#ifndef MARGINALCACHE_HPP
+#define MARGINALCACHE_HPP
+
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <mutex>
+#include <memory>
+#include <atomic>
+
+
+/*
+ * Sorted configuration table of a marginal, down to (and including) lCutOff.
+ */
+struct MarginalTable
+{
+    double lCutOff;
+    std::vector<int> confs;         // isotopeNo ints per configuration
+    std::vector<double> lProbs;
+    std::vector<double> masses;
+    std::vector<double> eProbs;
+};
+
+/*
+ * View of a table in a file mapped with MarginalCache::map_file(). It points into the
+ * mapping, which is read-only and stays for the lifetime of the cache.
+ */
+struct MappedMarginalTable
+{
+    unsigned int no_confs;
+    const int* confs;
+    const double* lProbs;
+    const double* masses;
+    const double* eProbs;
+    const double* cumEProbs;        // no_confs+1 entries
+};
+
+struct MarginalFileEntry;
+
+struct MarginalCacheStats
+{
+    size_t hits;                    // Including mapped_hits
+    size_t mapped_hits;
+    size_t misses;
+    size_t evictions;
+    size_t entries;
+    size_t confs;
+};
+
+/*
+ * Least recently used cache of marginal tables, shared by PrecalculatedMarginals (and so
+ * by the generators building on them), keyed by the element's isotopic data and atom
+ * count. A table computed with some cutoff serves any request with a higher one. The size
+ * is bounded by the total number of configurations held.
+ *
+ * The tables can be saved to a file, which other processes (or later runs) map read-only
+ * with map_file(): mapped tables are shared through the page cache and are used in place,
+ * without copying. Tables in memory are looked up first, then the mapped ones.
+ *
+ * The cache is off (capacity 0) until set_capacity() or map_file() is called. All methods
+ * are thread-safe.
+ */
+class MarginalCache
+{
+private:
+    struct Entry
+    {
+        std::shared_ptr<const MarginalTable> table;
+        std::list<std::string>::iterator lru_pos;
+    };
+
+    mutable std::mutex mtx;
+    std::atomic<size_t> capacity;
+    std::unordered_map<std::string, Entry> entries;
+    std::list<std::string> lru;     // Most recently used first
+    size_t held_confs;
+    size_t hits, mapped_hits, misses, evictions;
+
+    std::vector<std::pair<void*, size_t> > mappings;
+    // Start of the mapping and the entry in it
+    std::unordered_map<std::string, std::pair<const char*, const MarginalFileEntry*> > mapped;
+    std::atomic<bool> has_mapped;
+
+public:
+    MarginalCache();
+    MarginalCache(const MarginalCache& other) = delete;
+    MarginalCache& operator=(const MarginalCache& other) = delete;
+    ~MarginalCache();
+
+    static MarginalCache& global();
+    // The one PrecalculatedMarginals built by the calling thread use: global(), unless the
+    // thread has set another one (nullptr goes back to global())
+    static MarginalCache& current();
+    static void set_thread_cache(MarginalCache* cache);
+    // The one set for the calling thread, nullptr if none
+    static MarginalCache* get_thread_cache();
+
+    static std::string make_key(int isotopeNo, int atomCnt, const double* atom_masses, const double* atom_lProbs);
+
+    inline bool enabled() const { return capacity.load(std::memory_order_relaxed) > 0 or has_mapped.load(std::memory_order_relaxed); };
+    // In configurations. Evicts as needed, 0 disables (and empties) the in-memory part.
+    void set_capacity(size_t confs);
+    inline size_t get_capacity() const { return capacity.load(std::memory_order_relaxed); };
+    // Empties the in-memory part and resets the statistics; mapped files stay
+    void clear();
+    MarginalCacheStats get_stats() const;
+
+    // On a hit, either the configurations at or above lCutOff are the first out_len ones of
+    // out, which stays valid after an eviction, or, if they come from a mapped file,
+    // mapped_out points at them (then mapped_out.lProbs != nullptr and out is empty).
+    // Nothing is copied while the lock is held.
+    bool find(const std::string& key, double lCutOff, std::shared_ptr<const MarginalTable>& out, unsigned int& out_len, MappedMarginalTable& mapped_out);
+    // Takes over the table's contents; nothing happens if a table reaching as far is there
+    void insert(const std::string& key, MarginalTable&& table);
+
+    // Writes all tables (in memory and mapped) to path; it is replaced atomically, so it can
+    // be in use by other processes. Returns false on I/O errors.
+    bool save(const char* path) const;
+    // Returns false if the file cannot be read or is not a valid cache file
+    bool map_file(const char* path);
+
+private:
+    void evict_down_to(size_t confs);
+};
+
+#endif
@@ -21,12 +21,12 @@
 #include <stdlib.h>
 #include <tuple>
 #include <unordered_map>
-#include <unordered_set>
 #include <queue>
 #include <utility>
 #include <iostream>
 #include <string.h>
 #include <limits>
+#include <functional>
 #include "lang.h"
 #include "marginalTrek++.h"
 #include "conf.h"
@@ -35,6 +35,7 @@
 #include "summator.h"
 #include "element_tables.h"
 #include "misc.h"
+#include "marginalCache.h"
 
 
 
@@ -133,6 +134,15 @@ void printMarginal( const std::tuple<double*,double*,int*,int>& results, int dim
 double* getMLogProbs(const double* probs, int isoNo)
 {
     double* ret = new double[isoNo];
+
+    // Straight from the element tables, the logarithms are there too
+    std::less_equal<const double*> le;
+    if(le(elem_table_probability, probs) and le(probs + isoNo, elem_table_probability + NUMBER_OF_ISOTOPIC_ENTRIES))
+    {
+        memcpy(ret, elem_table_log_probability + (probs - elem_table_probability), isoNo*sizeof(double));
+        return ret;
+    }
+
     for(int i = 0; i < isoNo; i++)
     {
         ret[i] = log(probs[i]);
@@ -161,6 +171,15 @@ atom_lProbs(getMLogProbs(_probs, isotopeNo)),
 mode_conf(initialConfigure(atomCnt, isotopeNo, _probs, atom_lProbs))
 {}
 
+Marginal::Marginal(const Marginal& other) :
+disowned(false),
+isotopeNo(other.isotopeNo),
+atomCnt(other.atomCnt),
+atom_masses(array_copy<double>(other.atom_masses, isotopeNo)),
+atom_lProbs(array_copy<double>(other.atom_lProbs, isotopeNo)),
+mode_conf(array_copy<int>(other.mode_conf, isotopeNo))
+{}
+
 Marginal::Marginal(Marginal&& other) : 
 disowned(other.disowned),
 isotopeNo(other.isotopeNo),
@@ -201,11 +220,31 @@ double Marginal::getHeaviestConfMass() const
     return ret_mass*atomCnt;
 }
 
+void Marginal::get_extra_neutrons(int* target) const
+{
+    // Rounding the mass differences agrees with elem_table_extraNeutrons for all the
+    // elements there, and works for isotopes given by their masses just as well
+    // Not getLightestConfMass() / atomCnt, which is 0/0 for an element with no atoms
+    double lightest = atom_masses[0];
+    for(unsigned int ii=1; ii < isotopeNo; ii++)
+        if( lightest > atom_masses[ii] )
+            lightest = atom_masses[ii];
+    for(unsigned int ii=0; ii < isotopeNo; ii++)
+        target[ii] = static_cast<int>(lround(atom_masses[ii] - lightest));
+}
+
 double Marginal::getModeLProb() const
 {
     return logProb(mode_conf, atom_lProbs, isotopeNo);
 }
 
+bool Marginal::same_element(const Marginal& other) const
+{
+    return isotopeNo == other.isotopeNo and
+           memcmp(atom_masses, other.atom_masses, isotopeNo*sizeof(double)) == 0 and
+           memcmp(atom_lProbs, other.atom_lProbs, isotopeNo*sizeof(double)) == 0;
+}
+
 MarginalTrek::MarginalTrek(
     const double* masses,   // masses size = logProbs size = isotopeNo
     const double* probs,
@@ -213,13 +252,18 @@ MarginalTrek::MarginalTrek(
     int atomCnt,
     int tabSize,
     int hashSize
-) : 
-Marginal(masses, probs, isotopeNo, atomCnt),
+) : MarginalTrek(Marginal(masses, probs, isotopeNo, atomCnt), tabSize, hashSize)
+{}
+
+MarginalTrek::MarginalTrek(
+    Marginal&& m,
+    int tabSize,
+    int hashSize
+) :
+Marginal(std::move(m)),
 current_count(0),
-keyHasher(isotopeNo),
-equalizer(isotopeNo),
 orderMarginal(atom_lProbs, isotopeNo),
-visited(hashSize,keyHasher,equalizer),
+visited(isotopeNo, atomCnt, hashSize),
 pq(orderMarginal),
 totalProb(),
 candidate(new int[isotopeNo]),
@@ -228,7 +272,7 @@ allocator(isotopeNo, tabSize)
     int* initialConf = allocator.makeCopy(mode_conf);
 
     pq.push(initialConf);
-    visited[initialConf] = 0;
+    visited.insert(initialConf);
 
     totalProb = Summator();
 
@@ -245,7 +289,6 @@ bool MarginalTrek::add_next_conf()
     Conf topConf = pq.top();
     pq.pop();
     ++current_count;
-    visited[topConf] = current_count;
 
     _confs.push_back(topConf);
     _conf_masses.push_back(mass(topConf, atom_masses, isotopeNo));
@@ -268,12 +311,12 @@ bool MarginalTrek::add_next_conf()
                 --candidate[j];
 
                 // candidate should not have been already visited.
-                if( visited.count( candidate ) == 0 )
+                if( not visited.contains( candidate ) )
                 {
                     Conf acceptedCandidate = allocator.makeCopy(candidate);
                     pq.push(acceptedCandidate);
 
-                    visited[acceptedCandidate] = 0;
+                    visited.insert(acceptedCandidate);
                 }
             }
         }
@@ -312,24 +355,306 @@ MarginalTrek::~MarginalTrek()
 
 
 PrecalculatedMarginal::PrecalculatedMarginal(Marginal&& m, 
+	double lCutOff,
+	bool sort,
+        int tabSize,
+        int hashSize,
+        bool _lazy
+) : Marginal(std::move(m)),
+allocator(isotopeNo, tabSize),
+lazy(nullptr),
+owns_tables(true),
+table_lCutOff(lCutOff),
+derived(false)
+{
+    if(_lazy)
+    {
+        // Comes out sorted anyway
+        lazy = new LazyMarginalState(lCutOff, isotopeNo, atomCnt, hashSize);
+        confs = nullptr;
+        no_confs = 0;
+        masses = nullptr;
+        lProbs = nullptr;
+        eProbs = nullptr;
+        cumEProbs = new double[1];
+        cumEProbs[0] = 0.0;
+
+        const double lp = logProb(mode_conf, atom_lProbs, isotopeNo);
+        if(lp >= lCutOff)
+        {
+            Conf initialConf = allocator.makeCopy(mode_conf);
+            lazy->visited.insert(initialConf);
+            lazy->frontier.push(std::make_pair(lp, initialConf));
+            extend();
+        }
+        return;
+    }
+
+    build(lCutOff, sort, hashSize, nullptr);
+}
+
+PrecalculatedMarginal::PrecalculatedMarginal(Marginal&& m,
+        const PrecalculatedMarginal& base,
 	double lCutOff,
 	bool sort,
         int tabSize,
         int hashSize
 ) : Marginal(std::move(m)),
-allocator(isotopeNo, tabSize)
+allocator(isotopeNo, tabSize),
+lazy(nullptr),
+owns_tables(true),
+table_lCutOff(lCutOff),
+derived(false)
+{
+    build(lCutOff, sort, hashSize, &base);
+}
+
+void PrecalculatedMarginal::build(double lCutOff, bool sort, int hashSize, const PrecalculatedMarginal* base)
+{
+    MarginalCache& cache = MarginalCache::current();
+    std::string cache_key;
+    if(cache.enabled())
+    {
+        cache_key = MarginalCache::make_key(isotopeNo, atomCnt, atom_masses, atom_lProbs);
+        std::shared_ptr<const MarginalTable> table;
+        unsigned int table_len = 0;
+        MappedMarginalTable mapped;
+        if(cache.find(cache_key, lCutOff, table, table_len, mapped))
+        {
+            if(mapped.lProbs != nullptr)
+                borrow_table(mapped);
+            else
+                load_table(*table, table_len);
+            return;
+        }
+    }
+
+    // The specialised walks (and derive) compute the log-probabilities along the way
+    std::vector<double> confLProbs;
+
+    if(base != nullptr and derive(*base, lCutOff, hashSize, confLProbs))
+    {
+        derived = true;
+        if(sort)
+            sort_by_lProbs(confLProbs);
+    }
+    else if(isotopeNo == 2)
+        walk_two_isotopes(lCutOff, confLProbs);
+    else if(isotopeNo == 3)
+    {
+        walk_three_isotopes(lCutOff, confLProbs);
+        if(sort)
+            sort_by_lProbs(confLProbs);
+    }
+    else
+        explore(lCutOff, sort, hashSize);
+
+    confs  = &configurations[0];
+    no_confs = configurations.size();
+    lProbs = new double[no_confs];
+    eProbs = new double[no_confs];
+    masses = new double[no_confs];
+
+
+    for(unsigned int ii=0; ii < no_confs; ii++)
+    {
+        lProbs[ii] = confLProbs.empty() ? logProb(confs[ii], atom_lProbs, isotopeNo) : confLProbs[ii];
+        eProbs[ii] = exp(lProbs[ii]);
+	masses[ii] = mass(confs[ii], atom_masses, isotopeNo);
+    }
+
+    setup_cumEProbs();
+
+    if(not cache_key.empty())
+    {
+        // The cache holds sorted tables, so that they can serve higher cutoffs with a prefix
+        std::vector<unsigned int> order(no_confs);
+        for(unsigned int ii=0; ii < no_confs; ii++)
+            order[ii] = ii;
+        if(not sort)
+            std::sort(order.begin(), order.end(), [this](unsigned int a, unsigned int b) { return lProbs[a] > lProbs[b]; });
+
+        MarginalTable table;
+        table.lCutOff = lCutOff;
+        table.confs.resize(no_confs*isotopeNo);
+        table.lProbs.resize(no_confs);
+        table.masses.resize(no_confs);
+        table.eProbs.resize(no_confs);
+        for(unsigned int ii=0; ii < no_confs; ii++)
+        {
+            copyConf(confs[order[ii]], &table.confs[ii*isotopeNo], isotopeNo);
+            table.lProbs[ii] = lProbs[order[ii]];
+            table.masses[ii] = masses[order[ii]];
+            table.eProbs[ii] = eProbs[order[ii]];
+        }
+        cache.insert(cache_key, std::move(table));
+    }
+}
+
+void PrecalculatedMarginal::load_table(const MarginalTable& table, unsigned int len)
+{
+    no_confs = len;
+    configurations.reserve(no_confs);
+    for(unsigned int ii=0; ii < no_confs; ii++)
+        configurations.push_back(allocator.makeCopy(&table.confs[ii*isotopeNo]));
+    confs = &configurations[0];
+    lProbs = array_copy<double>(table.lProbs.data(), no_confs);
+    masses = array_copy<double>(table.masses.data(), no_confs);
+    eProbs = array_copy<double>(table.eProbs.data(), no_confs);
+    setup_cumEProbs();
+}
+
+void PrecalculatedMarginal::borrow_table(const MappedMarginalTable& table)
+{
+    // The mapping is read-only, but nothing writes into the tables of a non-lazy marginal
+    owns_tables = false;
+    no_confs = table.no_confs;
+    configurations.reserve(no_confs);
+    for(unsigned int ii=0; ii < no_confs; ii++)
+        configurations.push_back(const_cast<int*>(table.confs + ii*isotopeNo));
+    confs = &configurations[0];
+    lProbs = const_cast<double*>(table.lProbs);
+    masses = const_cast<double*>(table.masses);
+    eProbs = const_cast<double*>(table.eProbs);
+    cumEProbs = const_cast<double*>(table.cumEProbs);
+}
+
+void PrecalculatedMarginal::setup_cumEProbs()
+{
+    cumEProbs = new double[no_confs+1];
+    Summator s;
+    cumEProbs[0] = 0.0;
+    for(unsigned int ii=0; ii < no_confs; ii++)
+    {
+        s.add(eProbs[ii]);
+        cumEProbs[ii+1] = s.get();
+    }
+}
+
+// Appends all configurations of k atoms over the isotopes pos, pos+1, ... to out
+static void weak_compositions(int k, int pos, int isotopeNo, int* current, std::vector<int>& out)
+{
+    if(pos == isotopeNo-1)
+    {
+        current[pos] = k;
+        out.insert(out.end(), current, current+isotopeNo);
+        return;
+    }
+    for(int ii = 0; ii <= k; ii++)
+    {
+        current[pos] = ii;
+        weak_compositions(k-ii, pos+1, isotopeNo, current, out);
+    }
+}
+
+/*
+ * The multinomial of N+k atoms is the convolution of those of N and of k atoms, so the
+ * probability of a configuration c is an average of the ones of c - d over the configurations
+ * d of k atoms, weighted with their probabilities. One of them is at least as probable as c:
+ * all configurations above lCutOff are c1 + d with c1 in base above lCutOff.
+ * Going down, from N to N-1 atoms, the probability of c + e_i is that of c times N*p_i/(c_i+1),
+ * which is at least N/(N+isotopeNo-1) for the best i. So the configurations of N-k atoms are
+ * c1 - d with c1 in base above lCutOff minus these losses.
+ */
+bool PrecalculatedMarginal::derive(const PrecalculatedMarginal& base, double lCutOff, int hashSize, std::vector<double>& confLProbs)
+{
+    if(base.lazy != nullptr or not same_element(base))
+        return false;
+
+    const int N = base.atomCnt;
+    const int k = abs(static_cast<int>(atomCnt) - N);
+
+    if(k == 0)
+    {
+        // Just the part of base above our cutoff
+        if(lCutOff < base.table_lCutOff)
+            return false;
+        for(unsigned int ii = 0; ii < base.no_confs; ii++)
+            if(base.lProbs[ii] >= lCutOff)
+            {
+                configurations.push_back(allocator.makeCopy(base.confs[ii]));
+                confLProbs.push_back(base.lProbs[ii]);
+            }
+        return true;
+    }
+
+    // The walks are cheaper than this for up to three isotopes
+    if(isotopeNo <= 3)
+        return false;
+
+    double baseLCutOff = lCutOff;
+    if(static_cast<int>(atomCnt) < N)
+        for(int m = N-k+1; m <= N; m++)
+            baseLCutOff -= log(static_cast<double>(m+isotopeNo-1)/m);
+    if(baseLCutOff < base.table_lCutOff)
+        return false;
+
+    // C(k+isotopeNo-1, isotopeNo-1) configurations of the difference, don't go overboard
+    size_t no_diffs = 1;
+    for(unsigned int jj = 1; jj < isotopeNo and no_diffs <= 4096; jj++)
+        no_diffs = no_diffs * (k + jj) / jj;
+    if(no_diffs > 4096)
+        return false;
+
+    std::vector<int> diffs;
+    Conf candidate = allocator.newConf();
+    weak_compositions(k, 0, isotopeNo, candidate, diffs);
+
+    const int sign = static_cast<int>(atomCnt) > N ? 1 : -1;
+    ConfSet visited(isotopeNo, atomCnt, hashSize);
+
+    for(unsigned int ii = 0; ii < base.no_confs; ii++)
+    {
+        if(base.lProbs[ii] < baseLCutOff)
+            continue;
+        const int* c1 = base.confs[ii];
+        for(const int* d = diffs.data(); d < diffs.data() + diffs.size(); d += isotopeNo)
+        {
+            bool valid = true;
+            for(unsigned int jj = 0; jj < isotopeNo; jj++)
+            {
+                candidate[jj] = c1[jj] + sign * d[jj];
+                valid = valid and candidate[jj] >= 0;
+            }
+            if(not valid or visited.contains(candidate))
+                continue;
+
+            const double lp = logProb(candidate, atom_lProbs, isotopeNo);
+            if(lp >= lCutOff)
+            {
+                configurations.push_back(allocator.makeCopy(candidate));
+                visited.insert(configurations.back());
+                confLProbs.push_back(lp);
+            }
+        }
+    }
+    return true;
+}
+
+void PrecalculatedMarginal::sort_by_lProbs(std::vector<double>& confLProbs)
+{
+    std::vector<std::pair<double, Conf> > sorted(configurations.size());
+    for(unsigned int ii=0; ii < configurations.size(); ii++)
+        sorted[ii] = std::make_pair(confLProbs[ii], configurations[ii]);
+    std::sort(sorted.begin(), sorted.end(), [](const std::pair<double, Conf>& a, const std::pair<double, Conf>& b) { return a.first > b.first; });
+    for(unsigned int ii=0; ii < configurations.size(); ii++)
+    {
+        confLProbs[ii] = sorted[ii].first;
+        configurations[ii] = sorted[ii].second;
+    }
+}
+
+void PrecalculatedMarginal::explore(double lCutOff, bool sort, int hashSize)
 {
-    const ConfEqual equalizer(isotopeNo);
-    const KeyHasher keyHasher(isotopeNo);
     const ConfOrderMarginalDescending orderMarginal(atom_lProbs, isotopeNo);
 
-    std::unordered_set<Conf,KeyHasher,ConfEqual> visited(hashSize,keyHasher,equalizer);
+    ConfSet visited(isotopeNo, atomCnt, hashSize);
 
     Conf currentConf = allocator.makeCopy(mode_conf);
     if(logProb(currentConf, atom_lProbs, isotopeNo) >= lCutOff)
     {
         configurations.push_back(allocator.makeCopy(currentConf));
-        visited.insert(currentConf);
+        visited.insert(configurations.back());
     }
 
     unsigned int idx = 0;
@@ -345,10 +670,11 @@ allocator(isotopeNo, tabSize)
 		    currentConf[ii]++;
 		    currentConf[jj]--;
 
-		    if (visited.count(currentConf) == 0 and logProb(currentConf, atom_lProbs, isotopeNo) >= lCutOff)
+		    if (not visited.contains(currentConf) and logProb(currentConf, atom_lProbs, isotopeNo) >= lCutOff)
 		    {
-		    	 visited.insert(currentConf);
+                         // The set has to hold a copy: currentConf is overwritten all the time
                          configurations.push_back(allocator.makeCopy(currentConf));
+		    	 visited.insert(configurations.back());
 	            }
 
 		    currentConf[ii]--;
@@ -359,32 +685,196 @@ allocator(isotopeNo, tabSize)
 
     if(sort)
         std::sort(configurations.begin(), configurations.end(), orderMarginal);
+}
 
+void PrecalculatedMarginal::add_conf(int c0, int c1, int c2, double lp, std::vector<double>& confLProbs)
+{
+    Conf conf = allocator.newConf();
+    conf[0] = c0;
+    conf[1] = c1;
+    if(isotopeNo == 3)
+        conf[2] = c2;
+    configurations.push_back(conf);
+    confLProbs.push_back(lp);
+}
 
-    confs  = &configurations[0];
-    no_confs = configurations.size();
-    lProbs = new double[no_confs];
-    eProbs = new double[no_confs];
-    masses = new double[no_confs];
+/*
+ * With two isotopes the configurations are (n-k, k) and the log-probability changes by
+ * log((n-k)/(k+1)) + lp1 - lp0 going from k to k+1, so no lgamma and no hashing is needed.
+ * The binomial is unimodal: both sides of the mode are descending, and merging them gives
+ * the sorted order straight away.
+ */
+void PrecalculatedMarginal::walk_two_isotopes(double lCutOff, std::vector<double>& confLProbs)
+{
+    const int n = atomCnt;
+    const double dl = atom_lProbs[1] - atom_lProbs[0];
+    const int k = mode_conf[1];
+    const double lp = logProb(mode_conf, atom_lProbs, isotopeNo);
+    if(lp < lCutOff)
+        return;
+    add_conf(n-k, k, 0, lp, confLProbs);
 
+    const double minf = -std::numeric_limits<double>::infinity();
+    int up = k+1;
+    int down = k-1;
+    double up_lp = up <= n ? lp + log(double(n-k)/up) + dl : minf;
+    double down_lp = down >= 0 ? lp + log(double(k)/(n-down)) - dl : minf;
 
-    for(unsigned int ii=0; ii < no_confs; ii++)
+    while(up <= n or down >= 0)
     {
-        lProbs[ii] = logProb(confs[ii], atom_lProbs, isotopeNo);
-        eProbs[ii] = exp(lProbs[ii]);
-	masses[ii] = mass(confs[ii], atom_masses, isotopeNo);
+        if(up <= n and (down < 0 or up_lp >= down_lp))
+        {
+            if(up_lp < lCutOff)
+                break;
+            add_conf(n-up, up, 0, up_lp, confLProbs);
+            up_lp += log(double(n-up)/(up+1)) + dl;
+            up++;
+        }
+        else
+        {
+            if(down_lp < lCutOff)
+                break;
+            add_conf(n-down, down, 0, down_lp, confLProbs);
+            down_lp += log(double(down)/(n-down+1)) - dl;
+            down--;
+        }
     }
 }
 
+/*
+ * With three isotopes, each row of a fixed conf[2] is a binomial in conf[0], conf[1], walked
+ * from its own mode as above. The row maxima fall off on both sides of the mode's row (the
+ * multinomial is log-concave), so rows are taken outwards until one is empty.
+ */
+void PrecalculatedMarginal::walk_three_isotopes(double lCutOff, std::vector<double>& confLProbs)
+{
+    const int n = atomCnt;
+    const double dl = atom_lProbs[1] - atom_lProbs[0];
+    // Probability of the second isotope, given that it is one of the first two
+    const double p1 = 1.0 / (1.0 + exp(-dl));
+    int row[3];
+
+    for(int c = mode_conf[2]; c <= n; c++)
+        if(not walk_binomial_row(n, c, dl, p1, row, lCutOff, confLProbs))
+            break;
+    for(int c = mode_conf[2]-1; c >= 0; c--)
+        if(not walk_binomial_row(n, c, dl, p1, row, lCutOff, confLProbs))
+            break;
+}
+
+bool PrecalculatedMarginal::walk_binomial_row(int n, int c, double dl, double p1, int* row, double lCutOff, std::vector<double>& confLProbs)
+{
+    const int m = n - c;
+    int k = std::min(m, static_cast<int>((m+1) * p1));
+    while(k < m and log(double(m-k)/(k+1)) + dl > 0.0)
+        k++;
+    while(k > 0 and log(double(k)/(m-k+1)) - dl > 0.0)
+        k--;
+
+    row[0] = m-k;
+    row[1] = k;
+    row[2] = c;
+    const double lp = logProb(row, atom_lProbs, isotopeNo);
+    if(lp < lCutOff)
+        return false;
+    add_conf(m-k, k, c, lp, confLProbs);
+
+    double step_lp = lp;
+    for(int ii = k+1; ii <= m; ii++)
+    {
+        step_lp += log(double(m-ii+1)/ii) + dl;
+        if(step_lp < lCutOff)
+            break;
+        add_conf(m-ii, ii, c, step_lp, confLProbs);
+    }
+    step_lp = lp;
+    for(int ii = k-1; ii >= 0; ii--)
+    {
+        step_lp += log(double(ii+1)/(m-ii)) - dl;
+        if(step_lp < lCutOff)
+            break;
+        add_conf(m-ii, ii, c, step_lp, confLProbs);
+    }
+    return true;
+}
+
+
+template<typename T> static T* grow_array(T* array, unsigned int used, unsigned int new_size)
+{
+    T* ret = new T[new_size];
+    if(array != nullptr)
+    {
+        memcpy(ret, array, used*sizeof(T));
+        delete[] array;
+    }
+    return ret;
+}
+
+bool PrecalculatedMarginal::extend()
+{
+    if(lazy->frontier.empty())
+        return false;
+
+    const std::pair<double, Conf> top = lazy->frontier.top();
+    lazy->frontier.pop();
+
+    if(no_confs == lazy->capacity)
+    {
+        const unsigned int new_capacity = lazy->capacity > 0 ? 2*lazy->capacity : 64;
+        lProbs = grow_array(lProbs, no_confs, new_capacity);
+        eProbs = grow_array(eProbs, no_confs, new_capacity);
+        masses = grow_array(masses, no_confs, new_capacity);
+        cumEProbs = grow_array(cumEProbs, no_confs+1, new_capacity+1);
+        lazy->capacity = new_capacity;
+    }
+
+    configurations.push_back(top.second);
+    confs = &configurations[0];
+    lProbs[no_confs] = top.first;
+    eProbs[no_confs] = exp(top.first);
+    masses[no_confs] = mass(top.second, atom_masses, isotopeNo);
+    lazy->cumProb.add(eProbs[no_confs]);
+    cumEProbs[no_confs+1] = lazy->cumProb.get();
+    no_confs++;
+
+    Conf candidate = lazy->candidate;
+    for(unsigned int ii = 0; ii < isotopeNo; ii++ )
+        for(unsigned int jj = 0; jj < isotopeNo; jj++ )
+            if( ii != jj and top.second[jj] > 0)
+            {
+                copyConf(top.second, candidate, isotopeNo);
+                candidate[ii]++;
+                candidate[jj]--;
+
+                if(not lazy->visited.contains(candidate))
+                {
+                    const double lp = logProb(candidate, atom_lProbs, isotopeNo);
+                    if(lp >= lazy->lCutOff)
+                    {
+                        Conf accepted = allocator.makeCopy(candidate);
+                        lazy->visited.insert(accepted);
+                        lazy->frontier.push(std::make_pair(lp, accepted));
+                    }
+                }
+            }
+
+    return true;
+}
+
 
 PrecalculatedMarginal::~PrecalculatedMarginal()
 {
+    delete lazy;
+    if(not owns_tables)
+        return;
     if(lProbs != nullptr)
     	delete[] lProbs;
     if(masses != nullptr)
     	delete[] masses;
     if(eProbs != nullptr)
         delete[] eProbs;
+    if(cumEProbs != nullptr)
+        delete[] cumEProbs;
 }
 
 
@@ -403,7 +893,23 @@ RGTMarginal::RGTMarginal(
 	mass_table_size(mass_table_row_size * mass_table_rows_no),
 	subintervals(alloc_and_setup_subintervals()),
         mass_table(alloc_and_setup_mass_table())
-{terminate_search();}
+{
+    setup_mass_prefixes();
+    terminate_search();
+}
+
+void RGTMarginal::setup_mass_prefixes()
+{
+    min_mass_prefix = new double[no_confs+1];
+    max_mass_prefix = new double[no_confs+1];
+    min_mass_prefix[0] = std::numeric_limits<double>::infinity();
+    max_mass_prefix[0] = -std::numeric_limits<double>::infinity();
+    for(unsigned int ii = 0; ii < no_confs; ii++)
+    {
+        min_mass_prefix[ii+1] = std::min(min_mass_prefix[ii], masses[ii]);
+        max_mass_prefix[ii+1] = std::max(max_mass_prefix[ii], masses[ii]);
+    }
+}
 
 
 
@@ -636,41 +1142,6 @@ bool RGTMarginal::hard_next()
 
 }
 
-#define INF std::numeric_limits<double>::infinity()
-#define MIN(a, b) std::min<double>(a, b)
-
-double RGTMarginal::min_mass_above_lProb(double prob)
-{
-    // TODO: precalculate 'em bastards!
-    setup_search(prob, INF, -INF, INF);
-    double acc = INF;
-    for(;arridx < arrend; arridx++)
-        acc = MIN(acc, mass_table[arridx]);
-    while(next())
-    {
-        acc = MIN(acc, mass_table[arridx]);
-        arridx = arrend;
-    }
-    return acc;
-}
-
-#define MAX(a, b) std::max<double>(a, b)
-double RGTMarginal::max_mass_above_lProb(double prob)
-{
-    // TODO: same as above.
-    setup_search(prob, INF, -INF, INF);
-    double acc = -INF;
-    for(;arridx < arrend; arridx++)
-        acc = MAX(acc, mass_table[arridx]);
-    while(next())
-    {
-        acc = MAX(acc, mass_table[arrend-1]);
-        arridx = arrend;
-    }
-    return acc;
-}
-
-
 void RGTMarginal::terminate_search()
 {
 arridx = arrend = lower = upper = 0;
@@ -681,5 +1152,7 @@ RGTMarginal::~RGTMarginal()
 {
     delete[] mass_table;
     delete[] subintervals;
+    delete[] min_mass_prefix;
+    delete[] max_mass_prefix;
 }
 
@@ -18,13 +18,17 @@
 #ifndef MARGINALTREK_HPP
 #define MARGINALTREK_HPP
 #include <tuple>
+#include <algorithm>
 #include <unordered_map>
 #include <queue>
+#include <utility>
 #include <atomic>
 #include "conf.h"
 #include "allocator.h"
 #include "operators.h"
 #include "summator.h"
+#include "confSet.h"
+#include "marginalCache.h"
 
 
 Conf initialConfigure(const int atomCnt, const int isotopeNo, const double* probs);
@@ -51,25 +55,28 @@ public:
         int _isotopeNo,                  // No of isotope configurations.
         int _atomCnt
     );
-    Marginal(Marginal& other) = delete;
+    Marginal(const Marginal& other);
     Marginal& operator= (const Marginal& other) = delete;
     Marginal(Marginal&& other);
     virtual ~Marginal();
     
     inline int get_isotopeNo() const { return isotopeNo; };
+    inline int get_atomCnt() const { return atomCnt; };
+    // Same isotopes, masses and probabilities, the atom counts may differ
+    bool same_element(const Marginal& other) const;
     double getLightestConfMass() const;
     double getHeaviestConfMass() const;
     double getModeLProb() const;
+    // Per isotope, the nominal mass over the lightest isotope: isotopeNo ints
+    void get_extra_neutrons(int* target) const;
 };
 
 class MarginalTrek : public Marginal
 {
     int current_count;
 private:
-    const KeyHasher keyHasher;
-    const ConfEqual equalizer;
     const ConfOrderMarginal orderMarginal;
-    std::unordered_map<Conf,int,KeyHasher,ConfEqual> visited;
+    ConfSet visited;
     std::priority_queue<Conf,std::vector<Conf>,ConfOrderMarginal> pq;
     Summator totalProb;
     Conf candidate;
@@ -90,6 +97,11 @@ public:
         int tabSize = 1000,
         int hashSize = 1000
     );
+    MarginalTrek(
+        Marginal&& m,
+        int tabSize = 1000,
+        int hashSize = 1000
+    );
 
     inline bool probeConfigurationIdx(int idx)
     {
@@ -111,6 +123,24 @@ public:
 
 
 
+/*
+ * State of a lazily built PrecalculatedMarginal: the frontier of the exploration, which
+ * hands out configurations in order of descending probability, as in MarginalTrek.
+ */
+struct LazyMarginalState
+{
+    double lCutOff;
+    std::priority_queue<std::pair<double, Conf> > frontier;
+    ConfSet visited;
+    Conf candidate;
+    unsigned int capacity;
+    Summator cumProb;
+
+    LazyMarginalState(double _lCutOff, int isotopeNo, int atomCnt, int hashSize) :
+    lCutOff(_lCutOff), visited(isotopeNo, atomCnt, hashSize), candidate(new int[isotopeNo]), capacity(0) {};
+    ~LazyMarginalState() { delete[] candidate; };
+};
+
 class PrecalculatedMarginal : public Marginal
 {
 protected:
@@ -120,24 +150,73 @@ protected:
     double* masses;
     double* lProbs;
     double* eProbs;
+    double* cumEProbs;      // cumEProbs[ii] = eProbs[0] + ... + eProbs[ii-1], no_confs+1 entries
     Allocator<int> allocator;
+    LazyMarginalState* lazy;
+    bool owns_tables;       // false if they are in a mapped cache file
+    double table_lCutOff;   // All configurations at or above it are in the tables (if not lazy)
+    bool derived;           // Built from another marginal, see below
 public: 
+    // Unless lazy, the tables come from (and go to) MarginalCache::current() if it is enabled.
+    // A lazy marginal starts out with just the mode and is extended, in sorted order, as it
+    // is indexed: one past the end with inRange(), or in bulk with extend_run(). The arrays
+    // may then be reallocated, so pointers from get_*_ptr() only last until the next extension.
     PrecalculatedMarginal(
         Marginal&& m,
 	double lCutOff,
 	bool sort = true,
 	int tabSize = 1000,
+	int hashSize = 1000,
+        bool _lazy = false
+    );
+    // The same, but derived from base, a marginal of the same element with a few atoms more or
+    // less, instead of explored from scratch: the configurations of m are those of base plus
+    // (or minus) the configurations of the difference. Falls back to the usual construction
+    // if base does not fit (another element, lazy, or not reaching low enough), and for
+    // elements with up to three isotopes, whose walks are cheaper than that anyway.
+    PrecalculatedMarginal(
+        Marginal&& m,
+        const PrecalculatedMarginal& base,
+	double lCutOff,
+	bool sort = true,
+	int tabSize = 1000,
 	int hashSize = 1000
     );
     virtual ~PrecalculatedMarginal();
-    inline bool inRange(unsigned int idx) const { return idx < no_confs; };
+    inline bool inRange(unsigned int idx) { return idx < no_confs or (idx == no_confs and lazy != nullptr and extend()); };
+    // Makes sure that the run of configurations with lprefix + lProb >= Lcutoff is complete
+    inline void extend_run(double lprefix, double Lcutoff)
+    {
+        if(lazy != nullptr)
+            while((no_confs == 0 or lprefix + lProbs[no_confs-1] >= Lcutoff) and extend()) {};
+    }
     inline const double& get_lProb(unsigned int idx) const { return lProbs[idx]; };
     inline const double& get_eProb(unsigned int idx) const { return eProbs[idx]; };
     inline const double& get_mass(unsigned int idx) const { return masses[idx]; };
     inline const double* get_lProbs_ptr() const { return lProbs; };
     inline const double* get_masses_ptr() const { return masses; };
+    inline const double* get_eProbs_ptr() const { return eProbs; };
+    inline const double* get_cumEProbs_ptr() const { return cumEProbs; };
     inline const Conf& get_conf(unsigned int idx) const { return confs[idx]; };
     inline unsigned int get_no_confs() const { return no_confs; };
+    inline bool is_lazy() const { return lazy != nullptr; };
+    // Whether the tables were derived from a base marginal rather than computed anew
+    inline bool is_derived() const { return derived; };
+
+private:
+    bool extend();
+    void build(double lCutOff, bool sort, int hashSize, const PrecalculatedMarginal* base);
+    bool derive(const PrecalculatedMarginal& base, double lCutOff, int hashSize, std::vector<double>& confLProbs);
+    void sort_by_lProbs(std::vector<double>& confLProbs);
+    void explore(double lCutOff, bool sort, int hashSize);
+    // Copies the first len configurations of table
+    void load_table(const MarginalTable& table, unsigned int len);
+    void borrow_table(const MappedMarginalTable& table);
+    void setup_cumEProbs();
+    void add_conf(int c0, int c1, int c2, double lp, std::vector<double>& confLProbs);
+    void walk_two_isotopes(double lCutOff, std::vector<double>& confLProbs);
+    void walk_three_isotopes(double lCutOff, std::vector<double>& confLProbs);
+    bool walk_binomial_row(int n, int c, double dl, double p1, int* row, double lCutOff, std::vector<double>& confLProbs);
 };
 
 class SyncMarginal : public PrecalculatedMarginal
@@ -180,6 +259,9 @@ private:
     const unsigned int mass_table_rows_no, mass_table_row_size, mass_table_size;
     unsigned int* subintervals;
     double* mass_table;
+    // Lightest and heaviest of the first k configurations (in order of probability), k = 0..no_confs
+    double* min_mass_prefix;
+    double* max_mass_prefix;
     double pmin, pmax, mmin, mmax;
     unsigned int lower, upper, arridx, arrend, mask, current_level, cidx, gap;
     bool goingleft, going_up;
@@ -199,10 +281,14 @@ public:
     inline const double& current_mass() const { return masses[cidx]; };
     inline const double& current_eProb() const { return eProbs[cidx]; };
     inline const Conf& current_conf() const { return confs[cidx]; };
-    double min_mass_above_lProb(double prob);
-    double max_mass_above_lProb(double prob);
+    // Mass range of the configurations with lProb >= prob: +inf and -inf if there are none.
+    // Binary searches, the search set up with setup_search() is not affected.
+    inline double min_mass_above_lProb(double prob) const { return min_mass_prefix[no_confs_above(prob)]; };
+    inline double max_mass_above_lProb(double prob) const { return max_mass_prefix[no_confs_above(prob)]; };
+    inline unsigned int no_confs_above(double prob) const { return std::upper_bound(lProbs, lProbs+no_confs, prob, rev_ord) - lProbs; };
 
 private:
+    void setup_mass_prefixes();
     unsigned int* alloc_and_setup_subintervals();
     unsigned int setup_subintervals(unsigned int* T, unsigned int idx, bool left);
     double* alloc_and_setup_mass_table();
@@ -0,0 +1,154 @@
+/*
+ *   Copyright (C) 2015-2016 Mateusz Łącki and Michał Startek.
+ *
+ *   This file is part of IsoSpec.
+ *
+ *   IsoSpec is free software: you can redistribute it and/or modify
+ *   it under the terms of the Simplified ("2-clause") BSD licence.
+ *
+ *   IsoSpec is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ *   You should have received a copy of the Simplified BSD Licence
+ *   along with IsoSpec.  If not, see <https://opensource.org/licenses/BSD-2-Clause>.
+ */
+
+
+#include "runKernels.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ISOSPEC_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+
+static void emit_run_scalar(const double* masses, const double* eProbs, unsigned int len, double prefix_mass, double prefix_eprob, double* out_masses, double* out_probs)
+{
+    for(unsigned int ii=0; ii<len; ii++)
+    {
+        out_masses[ii] = prefix_mass + masses[ii];
+        out_probs[ii] = prefix_eprob * eProbs[ii];
+    }
+}
+
+#ifdef ISOSPEC_X86_KERNELS
+
+__attribute__((target("avx2")))
+static void emit_run_avx2(const double* masses, const double* eProbs, unsigned int len, double prefix_mass, double prefix_eprob, double* out_masses, double* out_probs)
+{
+    const __m256d pm = _mm256_set1_pd(prefix_mass);
+    const __m256d pe = _mm256_set1_pd(prefix_eprob);
+    unsigned int ii = 0;
+    for(; ii+4 <= len; ii += 4)
+    {
+        _mm256_storeu_pd(out_masses+ii, _mm256_add_pd(pm, _mm256_loadu_pd(masses+ii)));
+        _mm256_storeu_pd(out_probs+ii, _mm256_mul_pd(pe, _mm256_loadu_pd(eProbs+ii)));
+    }
+    for(; ii<len; ii++)
+    {
+        out_masses[ii] = prefix_mass + masses[ii];
+        out_probs[ii] = prefix_eprob * eProbs[ii];
+    }
+}
+
+__attribute__((target("avx512f")))
+static void emit_run_avx512(const double* masses, const double* eProbs, unsigned int len, double prefix_mass, double prefix_eprob, double* out_masses, double* out_probs)
+{
+    const __m512d pm = _mm512_set1_pd(prefix_mass);
+    const __m512d pe = _mm512_set1_pd(prefix_eprob);
+    unsigned int ii = 0;
+    for(; ii+8 <= len; ii += 8)
+    {
+        _mm512_storeu_pd(out_masses+ii, _mm512_add_pd(pm, _mm512_loadu_pd(masses+ii)));
+        _mm512_storeu_pd(out_probs+ii, _mm512_mul_pd(pe, _mm512_loadu_pd(eProbs+ii)));
+    }
+    if(ii < len)
+    {
+        // Masked tail: never touches memory past the run
+        const __mmask8 m = static_cast<__mmask8>((1u << (len - ii)) - 1);
+        _mm512_mask_storeu_pd(out_masses+ii, m, _mm512_add_pd(pm, _mm512_maskz_loadu_pd(m, masses+ii)));
+        _mm512_mask_storeu_pd(out_probs+ii, m, _mm512_mul_pd(pe, _mm512_maskz_loadu_pd(m, eProbs+ii)));
+    }
+}
+
+#endif
+
+
+static bool run_kernel_supported(RunKernel kernel)
+{
+    switch(kernel)
+    {
+        case RUN_KERNEL_SCALAR:
+            return true;
+#ifdef ISOSPEC_X86_KERNELS
+        case RUN_KERNEL_AVX2:
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("avx2");
+        case RUN_KERNEL_AVX512:
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("avx512f");
+#endif
+        default:
+            return false;
+    }
+}
+
+static emit_run_fn run_kernel_fn(RunKernel kernel)
+{
+    switch(kernel)
+    {
+#ifdef ISOSPEC_X86_KERNELS
+        case RUN_KERNEL_AVX2:
+            return emit_run_avx2;
+        case RUN_KERNEL_AVX512:
+            return emit_run_avx512;
+#endif
+        default:
+            return emit_run_scalar;
+    }
+}
+
+RunKernel best_run_kernel()
+{
+    if(run_kernel_supported(RUN_KERNEL_AVX512))
+        return RUN_KERNEL_AVX512;
+    if(run_kernel_supported(RUN_KERNEL_AVX2))
+        return RUN_KERNEL_AVX2;
+    return RUN_KERNEL_SCALAR;
+}
+
+/*
+ * The dispatch pointer starts out at a resolver, so that it is usable regardless of static
+ * initialization order: the first call picks the best kernel and replaces itself.
+ */
+static void emit_run_resolve(const double* masses, const double* eProbs, unsigned int len, double prefix_mass, double prefix_eprob, double* out_masses, double* out_probs)
+{
+    emit_run_fn best = run_kernel_fn(best_run_kernel());
+    emit_run_impl.store(best, std::memory_order_relaxed);
+    best(masses, eProbs, len, prefix_mass, prefix_eprob, out_masses, out_probs);
+}
+
+std::atomic<emit_run_fn> emit_run_impl(emit_run_resolve);
+
+RunKernel get_run_kernel()
+{
+    emit_run_fn current = emit_run_impl.load(std::memory_order_relaxed);
+#ifdef ISOSPEC_X86_KERNELS
+    if(current == emit_run_avx2)
+        return RUN_KERNEL_AVX2;
+    if(current == emit_run_avx512)
+        return RUN_KERNEL_AVX512;
+#endif
+    if(current == emit_run_resolve)
+        return best_run_kernel();
+    return RUN_KERNEL_SCALAR;
+}
+
+bool set_run_kernel(RunKernel kernel)
+{
+    if(not run_kernel_supported(kernel))
+        return false;
+    emit_run_impl.store(run_kernel_fn(kernel), std::memory_order_relaxed);
+    return true;
+}
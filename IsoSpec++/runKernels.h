@@ -0,0 +1,105 @@
+/*
+ *   Copyright (C) 2015-2016 Mateusz Łącki and Michał Startek.
+ *
+ *   This file is part of IsoSpec.
+ *
+ *   IsoSpec is free software: you can redistribute it and/or modify
+ *   it under the terms of the Simplified ("2-clause") BSD licence.
+ *
+ *   IsoSpec is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ *   You should have received a copy of the Simplified BSD Licence
+ *   along with IsoSpec.  If not, see <https://opensource.org/licenses/BSD-2-Clause>.
+ */
+
+
+/*
+ * Kernels for the innermost dimension of the threshold enumeration. The innermost marginal
+ * is sorted by descending log-probability, so for a fixed prefix its valid configurations
+ * form one contiguous run: its end is found by a search on lProbs and its body is the
+ * prefix added to (masses) or multiplied with (eProbs) contiguous arrays.
+ */
+
+#ifndef RUNKERNELS_HPP
+#define RUNKERNELS_HPP
+
+#include <cstddef>
+#include <atomic>
+
+
+enum RunKernel
+{
+    RUN_KERNEL_SCALAR = 0,
+    RUN_KERNEL_AVX2 = 1,
+    RUN_KERNEL_AVX512 = 2
+};
+
+typedef void (*emit_run_fn)(const double* masses, const double* eProbs, unsigned int len, double prefix_mass, double prefix_eprob, double* out_masses, double* out_probs);
+
+extern std::atomic<emit_run_fn> emit_run_impl;
+
+// Best kernel supported by both the build and the CPU we are running on
+RunKernel best_run_kernel();
+RunKernel get_run_kernel();
+// Returns false (and changes nothing) if the kernel is not supported. Not to be called
+// while generators are running in other threads.
+bool set_run_kernel(RunKernel kernel);
+
+
+/*
+ * Returns the end of the run of lProbs[start..limit) for which lprefix + lProbs[ii] stays at
+ * or above Lcutoff, but not further than start+max_len. The test is written exactly as the
+ * generators do it, so that the rounding agrees. Runs are mostly short, so we gallop from
+ * start and binary search only the last step.
+ */
+inline unsigned int threshold_run_end(const double* lProbs, unsigned int start, unsigned int limit, double lprefix, double Lcutoff, size_t max_len)
+{
+    if(start >= limit)
+        return start;
+    if(limit - start > max_len)
+        limit = start + static_cast<unsigned int>(max_len);
+
+    // [start, lo) is known to be above the cutoff, lProbs[hi-1] is the next probe
+    unsigned int lo = start;
+    unsigned int hi = start + 1;
+    unsigned int step = 1;
+    while(lprefix + lProbs[hi-1] >= Lcutoff)
+    {
+        lo = hi;
+        if(hi == limit)
+            return limit;
+        step <<= 1;
+        hi = (limit - hi > step) ? hi + step : limit;
+    }
+
+    // The end lies in [lo, hi-1]
+    hi--;
+    while(lo < hi)
+    {
+        unsigned int mid = lo + (hi - lo) / 2;
+        if(lprefix + lProbs[mid] >= Lcutoff)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+inline void emit_run(const double* masses, const double* eProbs, unsigned int len, double prefix_mass, double prefix_eprob, double* out_masses, double* out_probs)
+{
+    if(len < 4)
+    {
+        // Not worth an indirect call
+        for(unsigned int ii=0; ii<len; ii++)
+        {
+            out_masses[ii] = prefix_mass + masses[ii];
+            out_probs[ii] = prefix_eprob * eProbs[ii];
+        }
+        return;
+    }
+    emit_run_impl.load(std::memory_order_relaxed)(masses, eProbs, len, prefix_mass, prefix_eprob, out_masses, out_probs);
+}
+
+#endif
@@ -1,36 +1,34 @@
 #include <cmath>
+#include <string.h>
 #include "spectrum2.h"
 #include <assert.h>
-#include <sys/mman.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <sys/sysinfo.h>
 
 
+#define SPECTRUM_BATCH 1024
 
-inline static unsigned long get_mmap_len(unsigned long n_buckets)
-{
-    unsigned long pagesize = sysconf(_SC_PAGESIZE);
-    unsigned long ret = n_buckets * sizeof(double);
-    ret += pagesize - ret%pagesize;
-    return ret;
-}
 
-Spectrum::Spectrum(Iso&& I, double _bucket_width, double _cutoff, bool _absolute) : 
+Spectrum::Spectrum(Iso&& I, double _bucket_width, double _cutoff, bool _absolute) :
 iso(std::move(I)),
-lowest_mass(I.getLightestPeakMass()),
 bucket_width(_bucket_width),
-n_buckets(static_cast<unsigned int>(ceil(I.getHeaviestPeakMass()-lowest_mass)/bucket_width)),
+first_bucket(0),
+n_buckets(0),
+storage(nullptr),
+threads(nullptr),
 cutoff(_cutoff),
+pool(nullptr),
+n_threads(0),
 absolute(_absolute),
 thread_idxes(0),
-ptr_diff(static_cast<unsigned int>(floor(lowest_mass/bucket_width))),
-mmap_len(get_mmap_len(n_buckets))
-{
-        PMs = I.get_MT_marginal_set(log(cutoff), absolute, 1024, 1024);
-	storage = reinterpret_cast<double*>(mmap(NULL, mmap_len, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0));
-	ofset_store = storage - ptr_diff;
-}
+n_tiles(0),
+thread_tiles(nullptr),
+thread_partials(nullptr),
+thread_numbers(nullptr),
+total_confs(0),
+total_prob(0.0)
+{}
 
 void* wrapper_func_thr(void* spc)
 {
@@ -38,17 +36,49 @@ void* wrapper_func_thr(void* spc)
     return NULL;
 }
 
+void Spectrum::setup_range()
+{
+    // Each configuration above the threshold is made of configurations of the marginals
+    // above their shares of it, so it lies between the sums of their extreme masses.
+    // For a large molecule that is a few Daltons, instead of the lightest-to-heaviest range.
+    PrecalculatedMarginal* const * PMs = pool->get_marginals();
+    double lightest = 0.0, heaviest = 0.0;
+    n_buckets = 0;
+    n_tiles = 0;
+    for(int ii = 0; ii < iso.getDimNumber(); ii++)
+    {
+        const unsigned int no_confs = PMs[ii]->get_no_confs();
+        if(no_confs == 0)
+            return;
+        double lo = PMs[ii]->get_mass(0), hi = lo;
+        for(unsigned int jj = 1; jj < no_confs; jj++)
+        {
+            lo = std::min(lo, PMs[ii]->get_mass(jj));
+            hi = std::max(hi, PMs[ii]->get_mass(jj));
+        }
+        lightest += lo;
+        heaviest += hi;
+    }
+    first_bucket = static_cast<long>(floor(lightest/bucket_width));
+    n_buckets = static_cast<unsigned long>(static_cast<long>(floor(heaviest/bucket_width)) - first_bucket + 1);
+    n_tiles = (n_buckets + SPECTRUM_TILE_SIZE - 1) >> SPECTRUM_TILE_BITS;
+}
+
 void Spectrum::run(unsigned int nthreads, bool sync)
 {
     if(nthreads == 0)
         nthreads = get_nprocs();
     n_threads = nthreads;
+    thread_idxes = 0;
 
     threads = new pthread_t[n_threads];
-    thread_storages = new double*[n_threads];
+    thread_tiles = new double**[n_threads];
     thread_partials = new double[n_threads];
     thread_numbers = new unsigned int[n_threads];
 
+    pool = new ThresholdWorkPool(iso, cutoff, absolute, n_threads, 16, 1024, 1024);
+    setup_range();
+
     for(unsigned int ii = 0; ii < n_threads; ii++)
         pthread_create(&threads[ii], NULL, wrapper_func_thr, this);
 
@@ -62,7 +92,9 @@ void Spectrum::wait()
         pthread_join(threads[ii], NULL);
 
     delete[] threads;
-    dealloc_table<PrecalculatedMarginal*>(PMs, iso.getDimNumber());
+    threads = nullptr;
+    delete pool;
+    pool = nullptr;
 
     calc_sum();
 }
@@ -76,54 +108,112 @@ void Spectrum::calc_sum()
     {
         total_confs += thread_numbers[ii];
         total_prob += thread_partials[ii];
-        munmap(thread_storages[ii]+ptr_diff, mmap_len);
     };
 
+    // Tile by tile, so that the target stays in cache while all the threads' copies are added to it
+    delete[] storage;
+    storage = new double[n_buckets];
+    memset(storage, 0, n_buckets*sizeof(double));
+    for(unsigned long tile = 0; tile < n_tiles; tile++)
+    {
+        double* target = storage + (tile << SPECTRUM_TILE_BITS);
+        const unsigned long len = tile_len(tile);
+        for(unsigned int ii = 0; ii < n_threads; ii++)
+        {
+            const double* source = thread_tiles[ii][tile];
+            if(source == nullptr)
+                continue;
+            for(unsigned long jj = 0; jj < len; jj++)
+                target[jj] += source[jj];
+            delete[] source;
+        }
+    }
+
+    for(unsigned int ii = 0; ii < n_threads; ii++)
+        delete[] thread_tiles[ii];
+
     delete[] thread_numbers;
     delete[] thread_partials;
-    delete[] thread_storages;
+    delete[] thread_tiles;
+    thread_numbers = nullptr;
+    thread_partials = nullptr;
+    thread_tiles = nullptr;
 }
 
 
 void Spectrum::worker_thread()
 {
     unsigned int thread_id = thread_idxes.fetch_add(1);
-    IsoThresholdGeneratorMT* isoMT = new IsoThresholdGeneratorMT(std::move(iso), cutoff, PMs, absolute);
-    double* local_storage = reinterpret_cast<double*>(mmap(NULL, n_buckets*sizeof(double), PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0));
-    double* local_ofset_store = local_storage - ptr_diff;
-    double prob;
+    // A shallow copy: the marginals stay with iso, and the other threads use them too
+    IsoThresholdGeneratorWS* isoWS = new IsoThresholdGeneratorWS(Iso(iso, false), *pool, thread_id);
+    double** tiles = new double*[n_tiles];
+    for(unsigned long ii = 0; ii < n_tiles; ii++)
+        tiles[ii] = nullptr;
+
+    double masses[SPECTRUM_BATCH], probs[SPECTRUM_BATCH];
+    size_t got;
     Summator sum;
     unsigned int cnt = 0;
-    while(isoMT->advanceToNextConfiguration())
+    while((got = isoWS->fill(masses, probs, SPECTRUM_BATCH)) > 0)
     {
-        prob = isoMT->eprob();
-        local_ofset_store[static_cast<unsigned int>(floor(isoMT->mass()/bucket_width))] += prob;
-        sum.add(prob);
-        cnt++;
+        for(size_t ii = 0; ii < got; ii++)
+        {
+            long idx = static_cast<long>(floor(masses[ii]/bucket_width)) - first_bucket;
+            // The masses are summed up in a different order than in setup_range()
+            if(idx < 0)
+                idx = 0;
+            else if(static_cast<unsigned long>(idx) >= n_buckets)
+                idx = n_buckets - 1;
+            const unsigned long tile = static_cast<unsigned long>(idx) >> SPECTRUM_TILE_BITS;
+            if(tiles[tile] == nullptr)
+            {
+                tiles[tile] = new double[tile_len(tile)];
+                memset(tiles[tile], 0, tile_len(tile)*sizeof(double));
+            }
+            tiles[tile][idx & (SPECTRUM_TILE_SIZE-1)] += probs[ii];
+            sum.add(probs[ii]);
+        }
+        cnt += got;
     }
-    thread_storages[thread_id] = local_storage;
+    thread_tiles[thread_id] = tiles;
     thread_partials[thread_id] = sum.get();
     thread_numbers[thread_id] = cnt;
-    delete isoMT;
+    delete isoWS;
 }
 
 Spectrum::~Spectrum()
 {
-	munmap(storage, n_buckets*sizeof(double));
+	delete[] storage;
 }
 
 void Spectrum::add_other(Spectrum& other)
 {
-	assert(n_buckets == other.n_buckets);
 	assert(bucket_width == other.bucket_width);
-	assert(lowest_mass == other.lowest_mass);
-	for(unsigned long ii=0; ii<n_buckets; ii++)
-	    if(other.storage[ii] > 0.0) // This seemingly unnecesary if is here to avoid needless writes into mmaped memory
-	        storage[ii] += other.storage[ii];
+	if(other.n_buckets == 0)
+	    return;
+	if(n_buckets == 0 or other.first_bucket < first_bucket or other.first_bucket + static_cast<long>(other.n_buckets) > first_bucket + static_cast<long>(n_buckets))
+	{
+	    // Widen to cover both
+	    const long lo = n_buckets == 0 ? other.first_bucket : std::min(first_bucket, other.first_bucket);
+	    const long hi = n_buckets == 0 ? other.first_bucket + static_cast<long>(other.n_buckets) : std::max(first_bucket + static_cast<long>(n_buckets), other.first_bucket + static_cast<long>(other.n_buckets));
+	    double* widened = new double[hi - lo];
+	    memset(widened, 0, (hi - lo)*sizeof(double));
+	    if(n_buckets > 0)
+	        memcpy(widened + (first_bucket - lo), storage, n_buckets*sizeof(double));
+	    delete[] storage;
+	    storage = widened;
+	    first_bucket = lo;
+	    n_buckets = static_cast<unsigned long>(hi - lo);
+	}
+	double* target = storage + (other.first_bucket - first_bucket);
+	for(unsigned long ii=0; ii<other.n_buckets; ii++)
+	    target[ii] += other.storage[ii];
+	total_confs += other.total_confs;
+	total_prob += other.total_prob;
 }
 
 void Spectrum::print(std::ostream& o)
 {
 	for(unsigned long ii=0; ii<n_buckets; ii++)
-	    o << lowest_mass + static_cast<double>(ii)*bucket_width << "\t" << storage[ii] << std::endl;
+	    o << get_bucket_mass(ii) << "\t" << storage[ii] << std::endl;
 }
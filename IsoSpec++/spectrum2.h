@@ -1,32 +1,47 @@
+#ifndef SPECTRUM2_HPP
+#define SPECTRUM2_HPP
+
+#include <algorithm>
 #include "isoSpec++.h"
 
+// The threads accumulate into tiles of 2^SPECTRUM_TILE_BITS buckets (256KiB, about the size of L2),
+// allocated only once something lands in them
+#define SPECTRUM_TILE_BITS 15
+#define SPECTRUM_TILE_SIZE (1UL << SPECTRUM_TILE_BITS)
 
 
+/*
+ * Bucket ii holds the masses in [(first_bucket+ii)*bucket_width, (first_bucket+ii+1)*bucket_width),
+ * and the buckets span only the masses reachable above the threshold, known once run() has set up the pool.
+ */
 class Spectrum
 {
 private:
-        Iso&& iso;
-	double lowest_mass;
+        Iso iso;
 	const double bucket_width;
+	long first_bucket;
 	unsigned long n_buckets;
 	double* storage;
-        double* ofset_store;
         pthread_t* threads;
         const double cutoff;
-        PrecalculatedMarginal** PMs;
+        ThresholdWorkPool* pool;
         unsigned int n_threads;
         bool absolute;
         std::atomic<unsigned int> thread_idxes;
-        double** thread_storages;
+        unsigned long n_tiles;
+        double*** thread_tiles;
         double* thread_partials;
         unsigned int* thread_numbers;
         unsigned int total_confs;
         double total_prob;
-        const unsigned long ptr_diff;
-        const unsigned long mmap_len;
+
+        void setup_range();
+        inline unsigned long tile_len(unsigned long tile) const { return std::min(SPECTRUM_TILE_SIZE, n_buckets - (tile << SPECTRUM_TILE_BITS)); };
 
 public:
 	Spectrum(Iso&& I, double bucket_width, double cutoff, bool _absolute);
+	Spectrum(const Spectrum& other) = delete;
+	Spectrum& operator=(const Spectrum& other) = delete;
 	~Spectrum();
 	void add_other(Spectrum& other);
         void run(unsigned int threads = 0, bool sync = true);
@@ -35,6 +50,12 @@ public:
         void calc_sum();
 	inline unsigned int get_total_confs() const { return total_confs; };
         inline double get_total_prob() const { return total_prob; };
+        inline unsigned long get_n_buckets() const { return n_buckets; };
+        inline const double* get_probs() const { return storage; };
+        // Lower end of bucket ii
+        inline double get_bucket_mass(unsigned long ii) const { return static_cast<double>(first_bucket + static_cast<long>(ii)) * bucket_width; };
 	void print(std::ostream& o = std::cout);
 
 };
+
+#endif
@@ -6,5 +6,11 @@
 #include "operators.cpp"
 #include "element_tables.cpp"
 #include "misc.cpp"
+#include "runKernels.cpp"
+#include "confSet.cpp"
+#include "marginalCache.cpp"
+#include "batch.cpp"
+#include "formula.cpp"
+#include "binnedSpectrum.cpp"
 #include "spectrum2.cpp"
 #include "cwrapper.cpp"
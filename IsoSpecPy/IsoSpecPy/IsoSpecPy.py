@@ -85,6 +85,112 @@ class IsoFFI:
 
                         void destroyIso(void* iso);
 
+                        void* setupIsoThreshold( int             _dimNumber,
+                                                 const int*      _isotopeNumbers,
+                                                 const int*      _atomCounts,
+                                                 const double*   _isotopeMasses,
+                                                 const double*   _isotopeProbabilities,
+                                                 const double    _threshold,
+                                                 int             _absolute,
+                                                 int             tabSize,
+                                                 int             hashSize
+                        );
+
+                        size_t getIsoThresholdConfNo(void* iso);
+
+                        size_t getIsoThresholdConfs( void*   iso,
+                                                     size_t  capacity,
+                                                     double* res_mass,
+                                                     double* res_prob,
+                                                     int*    res_isoCounts
+                        );
+
+                        void destroyIsoThreshold(void* iso);
+
+                        int getIsoThresholdMaxExtraNeutrons(void* iso);
+
+                        void getIsoThresholdNeutronAggregates(void* iso, double* res_prob, double* res_mass);
+
+                        void* setupIsoThresholdBoundMass( int             _dimNumber,
+                                                          const int*      _isotopeNumbers,
+                                                          const int*      _atomCounts,
+                                                          const double*   _isotopeMasses,
+                                                          const double*   _isotopeProbabilities,
+                                                          const double    _threshold,
+                                                          int             _absolute,
+                                                          double          min_mass,
+                                                          double          max_mass,
+                                                          int             tabSize,
+                                                          int             hashSize
+                        );
+
+                        size_t getIsoThresholdBoundMassConfs( void*   iso,
+                                                              size_t  capacity,
+                                                              double* res_mass,
+                                                              double* res_prob
+                        );
+
+                        void destroyIsoThresholdBoundMass(void* iso);
+
+                        void* setupIsoThresholdMultiWindow( int             _dimNumber,
+                                                            const int*      _isotopeNumbers,
+                                                            const int*      _atomCounts,
+                                                            const double*   _isotopeMasses,
+                                                            const double*   _isotopeProbabilities,
+                                                            const double    _threshold,
+                                                            int             _absolute,
+                                                            const double*   window_mins,
+                                                            const double*   window_maxs,
+                                                            unsigned int    no_windows,
+                                                            int             tabSize,
+                                                            int             hashSize
+                        );
+
+                        size_t getIsoThresholdMultiWindowConfs( void*         iso,
+                                                                size_t        capacity,
+                                                                double*       res_mass,
+                                                                double*       res_prob,
+                                                                unsigned int* res_window
+                        );
+
+                        void setMarginalCacheCapacity(size_t capacity);
+
+                        void clearMarginalCache();
+
+                        void getMarginalCacheStats(size_t* hits, size_t* misses, size_t* entries, size_t* confs);
+
+                        int saveMarginalCache(const char* path);
+
+                        int mapMarginalCacheFile(const char* path);
+
+                        void* isoThresholdBatchFormulas(const char**  formulas,
+                                                        size_t        no_molecules,
+                                                        double        threshold,
+                                                        int           absolute,
+                                                        unsigned int  n_threads
+                        );
+
+                        size_t getBatchConfNo(void* batch);
+
+                        const size_t* getBatchOffsets(void* batch);
+
+                        const double* getBatchMasses(void* batch);
+
+                        const double* getBatchProbs(void* batch);
+
+                        void destroyBatch(void* batch);
+
+                        int getTopKConfs( int             _dimNumber,
+                                          const int*      _isotopeNumbers,
+                                          const int*      _atomCounts,
+                                          const double*   _isotopeMasses,
+                                          const double*   _isotopeProbabilities,
+                                          int             K,
+                                          double*         res_mass,
+                                          double*         res_logProb,
+                                          int*            res_isoCounts
+                        );
+
 
                         #define NUMBER_OF_ISOTOPIC_ENTRIES 288
 
@@ -368,6 +474,185 @@ class IsoSpec:
 
 
 
+class IsoThreshold:
+    """Configurations above a probability threshold. The exact number is known up front
+    (len()), so the results are written in one pass into arrays allocated once, at their
+    final size. The configurations can be retrieved only once."""
+    def __init__(
+                    self,
+                    _atomCounts,
+                    _isotopeMasses,
+                    _isotopeProbabilities,
+                    threshold,
+                    absolute = False,
+                    tabSize = 1000,
+                    hashSize = 1000
+                ):
+        self.clib = isoFFI.clib #can't use global vars in destructor, again...
+        self.dimNumber                 = len(_atomCounts)
+        self._isotopeNumbers           = [len(x) for x in _isotopeMasses]
+        self.allIsotopeNumber          = sum(self._isotopeNumbers)
+        self._atomCounts               = _atomCounts
+
+        self.iso = isoFFI.clib.setupIsoThreshold(
+                                self.dimNumber,
+                                self._isotopeNumbers,
+                                _atomCounts,
+                                list(itertools.chain.from_iterable(_isotopeMasses)),
+                                list(itertools.chain.from_iterable(_isotopeProbabilities)),
+                                threshold,
+                                1 if absolute else 0,
+                                tabSize,
+                                hashSize
+                            )
+        if self.iso == isoFFI.ffi.NULL:
+            self.iso = None
+            raise MemoryError()
+
+        self.size = isoFFI.clib.getIsoThresholdConfNo(self.iso)
+
+    def __del__(self):
+        self.cleanup()
+
+    def cleanup(self):
+        if self.iso is not None:
+            self.clib.destroyIsoThreshold(self.iso)
+            self.iso = None
+
+    def __len__(self):
+        return self.size
+
+    def getConfsRaw(self, get_confs = True):
+        """Returns (masses, probabilities, isotope counts) as cffi arrays, the last one
+        is None if get_confs is False (which is faster)."""
+        masses = isoFFI.ffi.new("double[{0}]".format(len(self)))
+        probs = isoFFI.ffi.new("double[{0}]".format(len(self)))
+        isoCounts = isoFFI.ffi.new("int[{0}]".format(len(self)*self.allIsotopeNumber)) if get_confs else isoFFI.ffi.NULL
+        isoFFI.clib.getIsoThresholdConfs(self.iso, len(self), masses, probs, isoCounts)
+        return (masses, probs, isoCounts if get_confs else None)
+
+    def getConfsNumpy(self, get_confs = True):
+        """Like getConfsRaw, but the results are written directly into NumPy arrays."""
+        import numpy
+        masses = numpy.empty(len(self), dtype=numpy.float64)
+        probs = numpy.empty(len(self), dtype=numpy.float64)
+        isoCounts = numpy.empty((len(self), self.allIsotopeNumber), dtype=numpy.intc) if get_confs else None
+        isoFFI.clib.getIsoThresholdConfs(self.iso, len(self),
+                                         isoFFI.ffi.cast("double*", masses.ctypes.data),
+                                         isoFFI.ffi.cast("double*", probs.ctypes.data),
+                                         isoFFI.ffi.cast("int*", isoCounts.ctypes.data) if get_confs else isoFFI.ffi.NULL)
+        return (masses, probs, isoCounts)
+
+    def getNeutronAggregates(self):
+        """Returns (probabilities, masses) as lists indexed by the number of extra neutrons:
+        the total probability of the configurations with that many, and their mean mass
+        weighted by probability. Does not use up the configurations."""
+        size = isoFFI.clib.getIsoThresholdMaxExtraNeutrons(self.iso) + 1
+        probs = isoFFI.ffi.new("double[{0}]".format(size))
+        masses = isoFFI.ffi.new("double[{0}]".format(size))
+        isoFFI.clib.getIsoThresholdNeutronAggregates(self.iso, probs, masses)
+        return (list(probs), list(masses))
+
+
+class IsoThresholdMassWindow:
+    """Configurations above a probability threshold with masses in [min_mass, max_mass],
+    in no particular order. Only the configurations which can end up in the window are
+    visited, so narrow windows are cheap. Masses and probabilities (not logarithms) are
+    computed in getConfsRaw() (or getConfsWindows()), which can be called only once."""
+    def __init__(
+                    self,
+                    _atomCounts,
+                    _isotopeMasses,
+                    _isotopeProbabilities,
+                    threshold,
+                    min_mass,
+                    max_mass,
+                    absolute = False,
+                    tabSize = 1000,
+                    hashSize = 1000
+                ):
+        """min_mass and max_mass can also be lists, of the bounds of several windows, sorted
+        and disjoint: these are all handled in one pass, see getConfsWindows()."""
+        self.clib = isoFFI.clib
+        self.dimNumber                 = len(_atomCounts)
+        self._isotopeNumbers           = [len(x) for x in _isotopeMasses]
+        self.multi                     = isinstance(min_mass, (list, tuple))
+
+        if self.multi:
+            self.iso = isoFFI.clib.setupIsoThresholdMultiWindow(
+                                self.dimNumber,
+                                self._isotopeNumbers,
+                                _atomCounts,
+                                list(itertools.chain.from_iterable(_isotopeMasses)),
+                                list(itertools.chain.from_iterable(_isotopeProbabilities)),
+                                threshold,
+                                1 if absolute else 0,
+                                list(min_mass),
+                                list(max_mass),
+                                len(min_mass),
+                                tabSize,
+                                hashSize
+                            )
+            if self.iso == isoFFI.ffi.NULL:
+                self.iso = None
+                raise ValueError("Mass windows must be sorted and disjoint")
+        else:
+            self.iso = isoFFI.clib.setupIsoThresholdBoundMass(
+                                self.dimNumber,
+                                self._isotopeNumbers,
+                                _atomCounts,
+                                list(itertools.chain.from_iterable(_isotopeMasses)),
+                                list(itertools.chain.from_iterable(_isotopeProbabilities)),
+                                threshold,
+                                1 if absolute else 0,
+                                min_mass,
+                                max_mass,
+                                tabSize,
+                                hashSize
+                            )
+            if self.iso == isoFFI.ffi.NULL:
+                self.iso = None
+                raise MemoryError()
+
+    def __del__(self):
+        self.cleanup()
+
+    def cleanup(self):
+        if self.iso is not None:
+            self.clib.destroyIsoThresholdBoundMass(self.iso)
+            self.iso = None
+
+    def getConfsRaw(self, chunk = 4096):
+        """Returns (masses, probabilities) as lists."""
+        masses = []
+        probs = []
+        cmasses = isoFFI.ffi.new("double[{0}]".format(chunk))
+        cprobs = isoFFI.ffi.new("double[{0}]".format(chunk))
+        while True:
+            got = isoFFI.clib.getIsoThresholdBoundMassConfs(self.iso, chunk, cmasses, cprobs)
+            masses.extend(cmasses[0:got])
+            probs.extend(cprobs[0:got])
+            if got < chunk:
+                return (masses, probs)
+
+    def getConfsWindows(self, chunk = 4096):
+        """Returns (masses, probabilities, window indices) as lists."""
+        masses = []
+        probs = []
+        windows = []
+        cmasses = isoFFI.ffi.new("double[{0}]".format(chunk))
+        cprobs = isoFFI.ffi.new("double[{0}]".format(chunk))
+        cwindows = isoFFI.ffi.new("unsigned int[{0}]".format(chunk))
+        while True:
+            got = isoFFI.clib.getIsoThresholdMultiWindowConfs(self.iso, chunk, cmasses, cprobs, cwindows)
+            masses.extend(cmasses[0:got])
+            probs.extend(cprobs[0:got])
+            windows.extend(cwindows[0:got])
+            if got < chunk:
+                return (masses, probs, windows)
+
+
+
 class IsoPlot(dict):
     def __init__(self, iso, bin_w):
         self.iso = iso
@@ -0,0 +1,89 @@
+#include <iostream>
+#include <vector>
+#include <stdexcept>
+#include "isoSpec++.h"
+#include "batch.h"
+#include "marginalCache.h"
+
+
+bool same_as_generator(Iso&& iso, double threshold, const IsoBatchResult& res, size_t idx)
+{
+    IsoThresholdGenerator gen(std::move(iso), threshold, false);
+    size_t pos = res.offsets[idx];
+    while(gen.advanceToNextConfiguration())
+    {
+        if(pos >= res.offsets[idx+1] or gen.mass() != res.masses[pos] or gen.eprob() != res.probs[pos])
+            return false;
+        pos++;
+    }
+    return pos == res.offsets[idx+1];
+}
+
+int main()
+{
+    bool ok = true;
+    const double threshold = 1e-6;
+
+    std::vector<const char*> formulas;
+    const char* some[] = {"C100H202", "C520H817N139O147S8", "C50H80O12S2", "S1", "H2O1", "Se20Sn3", "C520H817N139O147S8"};
+    for(unsigned int rep = 0; rep < 30; rep++)
+        for(unsigned int ii = 0; ii < 7; ii++)
+            formulas.push_back(some[ii]);
+
+    for(unsigned int n_threads = 1; n_threads <= 4; n_threads++)
+    {
+        IsoBatchOptions options(threshold);
+        options.n_threads = n_threads;
+        IsoBatchResult res;
+        isoThresholdBatch(formulas.data(), formulas.size(), options, res);
+        ok = ok and res.no_molecules == formulas.size();
+        for(size_t ii = 0; ii < formulas.size(); ii++)
+            ok = same_as_generator(Iso(formulas[ii]), threshold, res, ii) and ok;
+    }
+
+    // Counts of elements, with an empty molecule in between
+    const char* symbols[] = {"C", "H", "N", "O", "S"};
+    const int counts[] = {100, 202, 0, 0, 0,
+                          0, 0, 0, 0, 0,
+                          50, 80, 0, 12, 2};
+    const char* equivalent[] = {"C100H202", nullptr, "C50H80O12S2"};
+    IsoBatchResult res;
+    isoThresholdBatch(symbols, 5, counts, 3, IsoBatchOptions(threshold), res);
+    ok = ok and res.offsets[1] == res.offsets[2];
+    ok = ok and same_as_generator(Iso(equivalent[0]), threshold, res, 0);
+    ok = ok and same_as_generator(Iso(equivalent[2]), threshold, res, 2);
+
+    // An invalid formula leaves the result empty
+    const char* invalid[] = {"C100H202", "Xy12", "H2O1"};
+    bool thrown = false;
+    try {
+        isoThresholdBatch(invalid, 3, IsoBatchOptions(threshold), res);
+    }
+    catch(std::invalid_argument&) {
+        thrown = true;
+    }
+    ok = ok and thrown and res.no_molecules == 0 and res.get_no_confs() == 0;
+
+    const char* bad_symbols[] = {"C", "Xy"};
+    thrown = false;
+    try {
+        isoThresholdBatch(bad_symbols, 2, counts, 1, IsoBatchOptions(threshold), res);
+    }
+    catch(std::invalid_argument&) {
+        thrown = true;
+    }
+    ok = ok and thrown;
+
+    // A small batch runs on the calling thread, which keeps the cache it has set
+    MarginalCache mine;
+    mine.set_capacity(1 << 20);
+    MarginalCache::set_thread_cache(&mine);
+    IsoBatchOptions four(threshold);
+    four.n_threads = 4;
+    isoThresholdBatch(some, 2, four, res);
+    ok = ok and &MarginalCache::current() == &mine;
+    MarginalCache::set_thread_cache(nullptr);
+
+    std::cout << (ok ? "OK" : "MISMATCH") << std::endl;
+    return ok ? 0 : 1;
+}
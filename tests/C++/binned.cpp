@@ -0,0 +1,87 @@
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include "isoSpec++.h"
+#include "binnedSpectrum.h"
+
+
+// Probability of the enumerated configurations lighter than x
+double cdf(const std::vector<std::pair<double, double> >& confs, const std::vector<double>& cum, double x)
+{
+    return cum[std::lower_bound(confs.begin(), confs.end(), std::make_pair(x, -1.0)) - confs.begin()];
+}
+
+bool check(const char* formula, double threshold, double width, unsigned int sub_buckets)
+{
+    std::vector<std::pair<double, double> > confs;
+    IsoThresholdGenerator gen(Iso(formula), threshold, true);
+    while(gen.advanceToNextConfiguration())
+        confs.push_back(std::make_pair(gen.mass(), gen.eprob()));
+    std::sort(confs.begin(), confs.end());
+    std::vector<double> cum(confs.size()+1, 0.0);
+    for(size_t ii = 0; ii < confs.size(); ii++)
+        cum[ii+1] = cum[ii] + confs[ii].second;
+
+    BinnedSpectrum spec(Iso(formula), width, threshold, true, sub_buckets);
+
+    // All there is, less what is lost at the threshold, plus what the marginals have below it
+    bool ok = fabs(spec.get_total_prob() - cum.back() - spec.get_extra_prob()) < 1e-9;
+
+    // Up to every bucket edge, as much as was enumerated up to it (give or take the shift),
+    // plus at most the extra
+    const double shift = spec.get_max_mass_shift() + 1e-9;
+    double acc = 0.0;
+    for(unsigned long ii = 0; ii <= spec.get_n_buckets(); ii++)
+    {
+        const double edge = spec.get_bucket_mass(ii);
+        const double err = ii * spec.get_prob_error() + 1e-12;
+        if(acc < cdf(confs, cum, edge - shift) - err or acc > cdf(confs, cum, edge + shift) + spec.get_extra_prob() + err)
+            ok = false;
+        if(ii < spec.get_n_buckets())
+            acc += spec.get_probs()[ii];
+    }
+
+    std::cout << formula << " width: " << width << " buckets: " << spec.get_n_buckets() << " prob: " << spec.get_total_prob() << " / " << cum.back()
+              << " extra: " << spec.get_extra_prob() << " shift: " << spec.get_max_mass_shift() << " error: " << spec.get_prob_error() << (ok ? " OK" : " MISMATCH") << std::endl;
+    return ok;
+}
+
+// The FFT convolution against the direct one, bucket by bucket, within the error it reports
+bool check_fft(const char* formula, double threshold, double width, unsigned int sub_buckets, bool auto_fft)
+{
+    BinnedSpectrum direct(Iso(formula), width, threshold, true, sub_buckets, 1000, 1000, BINNED_CONVOLUTION_DIRECT);
+    BinnedSpectrum fft(Iso(formula), width, threshold, true, sub_buckets, 1000, 1000, BINNED_CONVOLUTION_FFT);
+    BinnedSpectrum chosen(Iso(formula), width, threshold, true, sub_buckets);
+
+    bool ok = direct.get_prob_error() == 0.0 and fft.get_prob_error() > 0.0 and direct.get_n_buckets() == fft.get_n_buckets();
+    // Dense histograms are to be convolved by FFT without asking for it
+    if(auto_fft)
+        ok = ok and chosen.get_prob_error() > 0.0;
+    double max_diff = 0.0;
+    for(unsigned long ii = 0; ok and ii < direct.get_n_buckets(); ii++)
+        max_diff = std::max(max_diff, fabs(direct.get_probs()[ii] - fft.get_probs()[ii]));
+    ok = ok and max_diff <= fft.get_prob_error();
+
+    std::cout << formula << " width: " << width << " FFT vs direct: " << max_diff << " error: " << fft.get_prob_error()
+              << (chosen.get_prob_error() > 0.0 ? " (FFT chosen)" : "") << (ok ? " OK" : " MISMATCH") << std::endl;
+    return ok;
+}
+
+int main()
+{
+    bool ok = true;
+    ok = check("H2O", 1e-12, 1.0, 16) and ok;
+    ok = check("C100H160N30O30S6", 1e-9, 1.0, 16) and ok;
+    ok = check("C100H160N30O30S6", 1e-9, 0.01, 4) and ok;
+    ok = check("C520H817N139O147S8", 1e-8, 0.1, 16) and ok;
+    ok = check("C2000H3200N600O600S20", 1e-10, 0.01, 16) and ok;
+    ok = check("C10Sn4Fe3Cl5Se2", 1e-10, 0.5, 64) and ok;
+    ok = check("C2000H3200N600O600S20", 1e-12, 1.0, 1) and ok;
+
+    ok = check_fft("C100H160N30O30S6", 1e-9, 1.0, 16, false) and ok;
+    ok = check_fft("C10Sn4Fe3Cl5Se2", 1e-10, 0.5, 64, false) and ok;
+    ok = check_fft("C2000H3200N600O600S20", 1e-12, 1.0, 1, true) and ok;
+    std::cout << (ok ? "OK" : "MISMATCH") << std::endl;
+    return ok ? 0 : 1;
+}
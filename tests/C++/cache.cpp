@@ -0,0 +1,93 @@
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <pthread.h>
+#include "isoSpec++.h"
+#include "marginalCache.h"
+
+
+std::vector<double> enumerate(const char* formula, double threshold)
+{
+    std::vector<double> ret;
+    IsoThresholdGenerator gen(Iso(formula), threshold, false);
+    while(gen.advanceToNextConfiguration())
+    {
+        ret.push_back(gen.mass());
+        ret.push_back(gen.lprob());
+    }
+    return ret;
+}
+
+const char* formulas[] = {"C100H202", "C520H817N139O147S8", "C521H817N139O147S8", "C50H80O12", "C50H80O12S2", "S1", "H2O1"};
+const double thresholds[] = {1e-3, 1e-6, 1e-9, 1e-6};
+
+void* worker(void* arg)
+{
+    bool* ok = reinterpret_cast<bool*>(arg);
+    for(unsigned int ii=0; ii<7; ii++)
+        for(unsigned int jj=0; jj<4; jj++)
+            if(enumerate(formulas[ii], thresholds[jj]).empty())
+                *ok = false;
+    return NULL;
+}
+
+int main()
+{
+    bool ok = true;
+    MarginalCache& cache = MarginalCache::global();
+
+    std::vector<std::vector<double> > ref;
+    for(unsigned int ii=0; ii<7; ii++)
+        for(unsigned int jj=0; jj<4; jj++)
+            ref.push_back(enumerate(formulas[ii], thresholds[jj]));
+    ok = cache.get_stats().hits + cache.get_stats().misses == 0;
+
+    // Twice, so that the second round is (mostly) hits. The results must not change.
+    cache.set_capacity(1000000);
+    for(unsigned int round=0; round<2; round++)
+        for(unsigned int ii=0; ii<7; ii++)
+            for(unsigned int jj=0; jj<4; jj++)
+                ok = enumerate(formulas[ii], thresholds[jj]) == ref[ii*4+jj] and ok;
+    MarginalCacheStats s = cache.get_stats();
+    std::cout << "hits: " << s.hits << " misses: " << s.misses << " entries: " << s.entries << " confs: " << s.confs << std::endl;
+    ok = ok and s.hits > 2*s.misses and s.evictions == 0;
+
+    // A table with a lower cutoff serves a higher one
+    cache.clear();
+    enumerate("C200", 1e-12);
+    enumerate("C200", 1e-3);
+    s = cache.get_stats();
+    ok = ok and s.hits == 1 and s.misses == 1;
+
+    // Bounded size
+    cache.set_capacity(100);
+    s = cache.get_stats();
+    ok = ok and s.confs <= 100;
+    for(unsigned int ii=0; ii<7; ii++)
+        ok = enumerate(formulas[ii], 1e-6) == ref[ii*4+1] and ok;
+    s = cache.get_stats();
+    std::cout << "capacity 100, confs: " << s.confs << " evictions: " << s.evictions << std::endl;
+    ok = ok and s.confs <= 100 and s.evictions > 0;
+
+    // Concurrent use
+    cache.set_capacity(1000000);
+    const unsigned int n_threads = 4;
+    pthread_t threads[n_threads];
+    bool thread_ok[n_threads];
+    for(unsigned int ii=0; ii<n_threads; ii++)
+    {
+        thread_ok[ii] = true;
+        pthread_create(&threads[ii], NULL, worker, &thread_ok[ii]);
+    }
+    for(unsigned int ii=0; ii<n_threads; ii++)
+    {
+        pthread_join(threads[ii], NULL);
+        ok = ok and thread_ok[ii];
+    }
+
+    cache.set_capacity(0);
+    ok = ok and cache.get_stats().entries == 0;
+
+    std::cout << (ok ? "OK" : "MISMATCH") << std::endl;
+    return ok ? 0 : 1;
+}
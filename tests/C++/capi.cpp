@@ -0,0 +1,97 @@
+#include <iostream>
+#include <vector>
+#include "isoSpec++.h"
+#include "cwrapper.h"
+
+
+int main()
+{
+    // C10H22O1, laid out as for the C interface
+    const int isotopeNumbers[] = {2, 2, 3};
+    const int atomCounts[] = {10, 22, 1};
+    const double masses[] = {12.0, 13.0033548352, 1.00782503207, 2.0141017778, 15.99491461956, 16.99913170, 17.9991610};
+    const double probs[] = {0.9893, 0.0107, 0.999885, 0.000115, 0.99757, 0.00038, 0.00205};
+    bool ok = true;
+
+    for(int with_confs = 0; with_confs < 2; with_confs++)
+    {
+        void* iso = setupIsoThreshold(3, isotopeNumbers, atomCounts, masses, probs, 1e-12, 1, 1000, 1000);
+        size_t no = getIsoThresholdConfNo(iso);
+        std::vector<double> res_mass(no), res_prob(no);
+        std::vector<int> res_confs(with_confs ? no*7 : 0);
+        size_t got = getIsoThresholdConfs(iso, no, res_mass.data(), res_prob.data(), with_confs ? res_confs.data() : NULL);
+        ok = ok and got == no and getIsoThresholdConfs(iso, no, res_mass.data(), res_prob.data(), NULL) == 0;
+        if(with_confs)
+        {
+            // The aggregates cover the same configurations
+            std::vector<double> agg_prob(getIsoThresholdMaxExtraNeutrons(iso)+1), agg_mass(agg_prob.size());
+            getIsoThresholdNeutronAggregates(iso, agg_prob.data(), agg_mass.data());
+            double total_agg = 0.0, total_res = 0.0;
+            for(size_t ii=0; ii<agg_prob.size(); ii++)
+                total_agg += agg_prob[ii];
+            for(size_t ii=0; ii<no; ii++)
+                total_res += res_prob[ii];
+            ok = ok and std::abs(total_agg - total_res) < 1e-12 and std::abs(agg_mass[0] - 158.16706) < 1e-4;
+        }
+        destroyIsoThreshold(iso);
+
+        // Compare against the C++ generator, recomputing masses from the isotope counts
+        const double* IM[] = {masses, masses+2, masses+4};
+        const double* IP[] = {probs, probs+2, probs+4};
+        IsoThresholdGenerator ref(Iso(3, isotopeNumbers, atomCounts, IM, IP), 1e-12, true);
+        size_t cnt = 0;
+        while(ref.advanceToNextConfiguration())
+        {
+            ok = ok and cnt < got and res_mass[cnt] == ref.mass() and res_prob[cnt] == ref.eprob();
+            if(with_confs and cnt < got)
+            {
+                double m = 0.0;
+                for(int ii=0; ii<7; ii++)
+                    m += res_confs[cnt*7+ii] * masses[ii];
+                ok = ok and std::abs(m - ref.mass()) < 1e-6;
+            }
+            cnt++;
+        }
+        ok = ok and cnt == no;
+        std::cout << "confs: " << got << " / " << cnt << (with_confs ? " with isotope counts" : "") << std::endl;
+    }
+
+    const int K = 10;
+    double top_mass[K], top_lprob[K];
+    int top_confs[K*7];
+    ok = ok and getTopKConfs(3, isotopeNumbers, atomCounts, masses, probs, K, top_mass, top_lprob, top_confs) == K;
+    for(int ii=1; ii<K; ii++)
+        ok = ok and top_lprob[ii] <= top_lprob[ii-1];
+
+    // Mass windows: each nominal peak, in one pass and one at a time
+    const double window_mins[] = {157.9, 158.9, 159.9, 160.9}, window_maxs[] = {158.4, 159.4, 160.4, 161.4};
+    size_t per_window[4] = {0, 0, 0, 0}, total = 0;
+    void* multi = setupIsoThresholdMultiWindow(3, isotopeNumbers, atomCounts, masses, probs, 1e-12, 1, window_mins, window_maxs, 4, 1000, 1000);
+    double w_mass[3], w_prob[3];
+    unsigned int w_idx[3];
+    size_t w_got;
+    while((w_got = getIsoThresholdMultiWindowConfs(multi, 3, w_mass, w_prob, w_idx)) > 0)
+        for(size_t ii=0; ii<w_got; ii++)
+        {
+            ok = ok and w_idx[ii] < 4 and window_mins[w_idx[ii]] <= w_mass[ii] and w_mass[ii] <= window_maxs[w_idx[ii]];
+            per_window[w_idx[ii] % 4]++;
+        }
+    destroyIsoThresholdBoundMass(multi);
+    for(int ww=0; ww<4; ww++)
+    {
+        void* single = setupIsoThresholdBoundMass(3, isotopeNumbers, atomCounts, masses, probs, 1e-12, 1, window_mins[ww], window_maxs[ww], 1000, 1000);
+        size_t cnt = 0;
+        while((w_got = getIsoThresholdBoundMassConfs(single, 3, w_mass, w_prob)) > 0)
+            cnt += w_got;
+        destroyIsoThresholdBoundMass(single);
+        ok = ok and cnt == per_window[ww];
+        total += cnt;
+    }
+    ok = ok and total > 0;
+    const double overlapping_maxs[] = {159.0, 159.4, 160.4, 161.4};
+    ok = ok and setupIsoThresholdMultiWindow(3, isotopeNumbers, atomCounts, masses, probs, 1e-12, 1, window_mins, overlapping_maxs, 4, 1000, 1000) == NULL;
+    std::cout << "windows: " << per_window[0] << " " << per_window[1] << " " << per_window[2] << " " << per_window[3] << std::endl;
+
+    std::cout << (ok ? "OK" : "MISMATCH") << std::endl;
+    return ok ? 0 : 1;
+}
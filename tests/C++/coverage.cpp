@@ -0,0 +1,61 @@
+#include <iostream>
+#include <cmath>
+#include "isoSpec++.h"
+#include "summator.h"
+
+
+bool check(const char* formula, double coverage, bool trim)
+{
+    // Reference: the shortest prefix of the ordered enumeration reaching coverage
+    IsoOrderedGenerator ref{Iso(formula)};
+    unsigned int ref_cnt = 0;
+    Summator ref_s;
+    double ref_last = 0.0;
+    while(ref_s.get() < coverage and ref.advanceToNextConfiguration())
+    {
+        ref_cnt++;
+        ref_s.add(ref.eprob());
+        ref_last = ref.lprob();
+    }
+
+    IsoThresholdGenerator* gen = IsoThresholdGenerator::FromCoverage(Iso(formula), coverage, trim);
+    unsigned int cnt = 0;
+    Summator s;
+    double min_lprob = std::numeric_limits<double>::infinity();
+    while(gen->advanceToNextConfiguration())
+    {
+        cnt++;
+        s.add(gen->eprob());
+        min_lprob = std::min(min_lprob, gen->lprob());
+    }
+    delete gen;
+
+    // With trimming the sets agree up to ties at the cutoff. The two generators compute
+    // log-probabilities differently (recurrences vs lgamma), so they agree up to rounding.
+    bool ok = s.get() >= coverage or s.get() == ref_s.get();
+    if(trim)
+        ok = ok and cnt >= ref_cnt and std::abs(min_lprob - ref_last) < 1e-9;
+    else
+        // The bisection stops once a single configuration separates its bounds, and the
+        // upper one does not reach coverage: at most one more than the shortest prefix
+        ok = ok and cnt <= ref_cnt + 1;
+    std::cout << formula << " coverage: " << coverage << (trim ? " trimmed" : "") << " confs: " << cnt << " / " << ref_cnt
+              << " prob: " << s.get() << " / " << ref_s.get() << (ok ? " OK" : " MISMATCH") << std::endl;
+    return ok;
+}
+
+int main()
+{
+    bool ok = true;
+    const char* formulas[] = {"C100H202", "C520H817N139O147S8", "C1000H1000O1000N1000S1000", "S1"};
+    const double coverages[] = {0.1, 0.5, 0.9, 0.99, 0.999, 0.9999, 0.999999};
+    for(unsigned int ii=0; ii<4; ii++)
+        for(unsigned int jj=0; jj < (ii == 2 ? 3 : 7); jj++)
+        {
+            ok = check(formulas[ii], coverages[jj], true) and ok;
+            ok = check(formulas[ii], coverages[jj], false) and ok;
+        }
+
+    std::cout << (ok ? "OK" : "MISMATCH") << std::endl;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,107 @@
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <string.h>
+#include <cmath>
+#include "isoSpec++.h"
+#include "marginalTrek++.h"
+#include "element_tables.h"
+
+
+Marginal element(const char* symbol, int atomCnt)
+{
+    int idx = 0;
+    while(strcmp(elem_table_symbol[idx], symbol) != 0)
+        idx++;
+    int isotopeNo = 0;
+    while(idx+isotopeNo < NUMBER_OF_ISOTOPIC_ENTRIES and elem_table_atomicNo[idx+isotopeNo] == elem_table_atomicNo[idx])
+        isotopeNo++;
+    return Marginal(&elem_table_mass[idx], &elem_table_probability[idx], isotopeNo, atomCnt);
+}
+
+std::vector<std::pair<double, double> > table(const PrecalculatedMarginal& pm)
+{
+    std::vector<std::pair<double, double> > ret;
+    for(unsigned int ii = 0; ii < pm.get_no_confs(); ii++)
+        ret.push_back(std::make_pair(pm.get_lProb(ii), pm.get_mass(ii)));
+    std::sort(ret.begin(), ret.end());
+    return ret;
+}
+
+std::vector<std::pair<double, double> > enumerate(IsoThresholdGenerator& gen)
+{
+    std::vector<std::pair<double, double> > ret;
+    while(gen.advanceToNextConfiguration())
+        ret.push_back(std::make_pair(gen.mass(), gen.lprob()));
+    std::sort(ret.begin(), ret.end());
+    return ret;
+}
+
+bool same(const std::vector<std::pair<double, double> >& a, const std::vector<std::pair<double, double> >& b)
+{
+    if(a.size() != b.size())
+        return false;
+    for(size_t ii = 0; ii < a.size(); ii++)
+        if(fabs(a[ii].first - b[ii].first) > 1e-9 or fabs(a[ii].second - b[ii].second) > 1e-9)
+            return false;
+    return true;
+}
+
+int main()
+{
+    bool ok = true;
+
+    // Marginals of N+delta atoms from one of N, against the ones built from scratch
+    const char* symbols[] = {"S", "Sn", "Fe", "C", "Se"};
+    const int counts[] = {60, 6, 40, 300, 12};
+    const int deltas[] = {0, 1, 2, 3, -1, -2, -3};
+    for(unsigned int ii = 0; ii < 5; ii++)
+    {
+        const double lCutOff = Marginal(element(symbols[ii], counts[ii])).getModeLProb() + log(1e-6);
+        // Low enough for the ones with fewer atoms too
+        PrecalculatedMarginal base(element(symbols[ii], counts[ii]), lCutOff - 4.0);
+        for(unsigned int jj = 0; jj < 7; jj++)
+        {
+            PrecalculatedMarginal derived(element(symbols[ii], counts[ii] + deltas[jj]), base, lCutOff);
+            PrecalculatedMarginal fresh(element(symbols[ii], counts[ii] + deltas[jj]), lCutOff);
+            if(not same(table(derived), table(fresh)))
+            {
+                std::cout << symbols[ii] << counts[ii] << " " << deltas[jj] << ": " << derived.get_no_confs() << " vs " << fresh.get_no_confs() << std::endl;
+                ok = false;
+            }
+            // Elements with up to three isotopes (C) are walked rather than derived
+            if(deltas[jj] != 0 and strcmp(symbols[ii], "C") != 0 and not derived.is_derived())
+            {
+                std::cout << symbols[ii] << counts[ii] << " " << deltas[jj] << ": not derived" << std::endl;
+                ok = false;
+            }
+        }
+        // A base not reaching low enough, or of another element, is not used
+        PrecalculatedMarginal derived(element(symbols[ii], counts[ii] + 1), base, lCutOff - 5.0);
+        PrecalculatedMarginal fresh(element(symbols[ii], counts[ii] + 1), lCutOff - 5.0);
+        ok = same(table(derived), table(fresh)) and not derived.is_derived() and ok;
+        PrecalculatedMarginal other(element("Zn", 10), base, lCutOff);
+        PrecalculatedMarginal other_fresh(element("Zn", 10), lCutOff);
+        ok = same(table(other), table(other_fresh)) and not other.is_derived() and ok;
+    }
+
+    // A ladder of generators, each from the previous one
+    const char* ladder[] = {"C100H160N30O30S6", "C100H160N30O30S7", "C100H161N30O30S8", "C101H161N30O30S8Se1", "C101H161N30O30S9Se2", "C101H161N30O30S8Se2"};
+    IsoThresholdGenerator* prev = new IsoThresholdGenerator(Iso(ladder[0]), 1e-9, true);
+    for(unsigned int ii = 1; ii < 6; ii++)
+    {
+        IsoThresholdGenerator* gen = new IsoThresholdGenerator(Iso(ladder[ii]), *prev, 1e-9, true);
+        IsoThresholdGenerator fresh(Iso(ladder[ii]), 1e-9, true);
+        if(not same(enumerate(*gen), enumerate(fresh)))
+        {
+            std::cout << ladder[ii] << " differs" << std::endl;
+            ok = false;
+        }
+        delete prev;
+        prev = gen;
+    }
+    delete prev;
+
+    std::cout << (ok ? "OK" : "MISMATCH") << std::endl;
+    return ok ? 0 : 1;
+}
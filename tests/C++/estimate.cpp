@@ -0,0 +1,44 @@
+#include <iostream>
+#include <chrono>
+#include "isoSpec++.h"
+#include "summator.h"
+
+
+bool check(const char* formula, double threshold)
+{
+    Iso iso(formula);
+    auto t0 = std::chrono::steady_clock::now();
+    ThresholdEstimate e = iso.estimateThreshold(threshold, false);
+    auto t1 = std::chrono::steady_clock::now();
+
+    // The estimate must not consume the marginals
+    IsoThresholdGenerator gen(std::move(iso), threshold, false);
+    double cnt = 0.0;
+    Summator s;
+    while(gen.advanceToNextConfiguration())
+    {
+        cnt += 1.0;
+        s.add(gen.eprob());
+    }
+
+    const double eps = 1e-9;
+    bool ok = e.count_low <= cnt and cnt <= e.count_high and e.prob_low <= s.get() + eps and s.get() <= e.prob_high + eps;
+    std::cout << formula << " threshold: " << threshold << " confs: " << e.count << " [" << e.count_low << ", " << e.count_high << "] / " << cnt
+              << " prob: " << e.prob << " [" << e.prob_low << ", " << e.prob_high << "] / " << s.get()
+              << " in " << std::chrono::duration<double>(t1-t0).count() << "s" << (ok ? " OK" : " MISMATCH") << std::endl;
+    return ok;
+}
+
+int main()
+{
+    bool ok = true;
+    const char* formulas[] = {"C100H202", "C520H817N139O147S8", "C1000H1000O1000N1000S1000", "S1"};
+    const double thresholds[] = {0.1, 1e-3, 1e-6, 1e-9};
+    for(unsigned int ii=0; ii<4; ii++)
+        for(unsigned int jj=0; jj<4; jj++)
+            if(ii != 2 or jj < 3)
+                ok = check(formulas[ii], thresholds[jj]) and ok;
+
+    std::cout << (ok ? "OK" : "MISMATCH") << std::endl;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,67 @@
+#include <iostream>
+#include <vector>
+#include "isoSpec++.h"
+#include "runKernels.h"
+
+
+bool check(const char* formula, double threshold, size_t block)
+{
+    std::vector<double> ref_masses, ref_probs;
+    IsoThresholdGenerator ref(Iso(formula), threshold, false);
+    while(ref.advanceToNextConfiguration())
+    {
+        ref_masses.push_back(ref.mass());
+        ref_probs.push_back(ref.eprob());
+    }
+
+    // Alternate between block fills and single steps, the two have to agree
+    IsoThresholdGenerator gen(Iso(formula), threshold, false);
+    std::vector<double> masses(block), probs(block);
+    size_t pos = 0;
+    bool ok = true;
+    while(true)
+    {
+        size_t got = gen.fill(masses.data(), probs.data(), block);
+        for(size_t ii=0; ii<got; ii++, pos++)
+            if(pos >= ref_masses.size() or masses[ii] != ref_masses[pos] or probs[ii] != ref_probs[pos])
+                ok = false;
+        if(got > 0 and (gen.mass() != masses[got-1] or gen.eprob() != probs[got-1]))
+            ok = false;
+        if(got < block)
+            break;
+        if(not gen.advanceToNextConfiguration())
+            break;
+        if(pos >= ref_masses.size() or gen.mass() != ref_masses[pos] or gen.eprob() != ref_probs[pos])
+            ok = false;
+        pos++;
+    }
+    ok = ok and pos == ref_masses.size();
+    // count() does not depend on (nor disturb) the enumeration
+    ok = ok and gen.count() == ref_masses.size();
+
+    std::cout << formula << " block: " << block << " confs: " << pos << " / " << ref_masses.size() << (ok ? " OK" : " MISMATCH") << std::endl;
+    return ok;
+}
+
+int main()
+{
+    bool ok = true;
+    const char* formulas[] = {"C100H202", "C520H817N139O147S8", "C1000H1000O1000N1000S1000", "S1", "H2O1"};
+    const size_t blocks[] = {1, 7, 1024, 1000000};
+    const RunKernel kernels[] = {RUN_KERNEL_SCALAR, RUN_KERNEL_AVX2, RUN_KERNEL_AVX512};
+    for(unsigned int kk=0; kk<3; kk++)
+    {
+        if(not set_run_kernel(kernels[kk]))
+        {
+            std::cout << "kernel " << kernels[kk] << " not supported, skipping" << std::endl;
+            continue;
+        }
+        std::cout << "kernel " << kernels[kk] << std::endl;
+        for(unsigned int ii=0; ii<5; ii++)
+            for(unsigned int jj=0; jj<4; jj++)
+                ok = check(formulas[ii], ii == 2 ? 1e-3 : 1e-8, blocks[jj]) and ok;
+    }
+
+    std::cout << (ok ? "OK" : "MISMATCH") << std::endl;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,71 @@
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include "isoSpec++.h"
+
+
+// Sorted, so that the order of enumeration does not matter
+bool same(std::vector<double>& a, std::vector<double>& b)
+{
+    if(a.size() != b.size())
+        return false;
+    std::sort(a.begin(), a.end());
+    std::sort(b.begin(), b.end());
+    for(size_t ii=0; ii<a.size(); ii++)
+        if(std::abs(a[ii] - b[ii]) > 1e-9 * std::abs(a[ii]))
+            return false;
+    return true;
+}
+
+// Lazy marginals keep the formula order and may order ties differently, so the
+// enumeration order and the last bits of the sums differ from the eager generator
+bool check(const char* formula, double threshold, size_t block)
+{
+    std::vector<double> ref_masses, ref_probs, lazy_masses, lazy_probs;
+
+    IsoThresholdGenerator eager_gen(Iso(formula), threshold, false);
+    while(eager_gen.advanceToNextConfiguration())
+    {
+        ref_masses.push_back(eager_gen.mass());
+        ref_probs.push_back(eager_gen.eprob());
+    }
+
+    // Steps through the first half, then fills the rest
+    IsoThresholdGenerator gen(Iso(formula), threshold, false, 1000, 1000, true);
+    while(lazy_masses.size() < ref_masses.size() / 2 and gen.advanceToNextConfiguration())
+    {
+        lazy_masses.push_back(gen.mass());
+        lazy_probs.push_back(gen.eprob());
+    }
+    std::vector<double> masses(block), probs(block);
+    size_t got;
+    while((got = gen.fill(masses.data(), probs.data(), block)) > 0)
+        for(size_t ii=0; ii<got; ii++)
+        {
+            lazy_masses.push_back(masses[ii]);
+            lazy_probs.push_back(probs[ii]);
+        }
+
+    IsoThresholdGenerator counter(Iso(formula), threshold, false, 1000, 1000, true);
+
+    bool ok = counter.count() == ref_masses.size();
+    std::cout << formula << " block: " << block << " confs: " << lazy_masses.size() << " / " << ref_masses.size();
+    ok = same(lazy_masses, ref_masses) and same(lazy_probs, ref_probs) and ok;
+
+    std::cout << (ok ? " OK" : " MISMATCH") << std::endl;
+    return ok;
+}
+
+int main()
+{
+    bool ok = true;
+    const char* formulas[] = {"C100H202", "C520H817N139O147S8", "C1000H1000O1000N1000S1000", "S1", "H2O1"};
+    const size_t blocks[] = {1, 1024};
+    for(unsigned int ii=0; ii<5; ii++)
+        for(unsigned int jj=0; jj<2; jj++)
+            ok = check(formulas[ii], ii == 2 ? 1e-3 : 1e-8, blocks[jj]) and ok;
+
+    std::cout << (ok ? "OK" : "MISMATCH") << std::endl;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,87 @@
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <string.h>
+#include "isoSpec++.h"
+#include "element_tables.h"
+#include "misc.h"
+
+
+// Every configuration of atomCnt atoms over isotopeNo isotopes, with its log-probability
+void brute_force(int* conf, int idx, int left, int isotopeNo, const double* lprobs, double lCutOff, std::vector<double>& out)
+{
+    if(idx == isotopeNo-1)
+    {
+        conf[idx] = left;
+        double lp = logProb(conf, lprobs, isotopeNo);
+        if(lp >= lCutOff)
+            out.push_back(lp);
+        return;
+    }
+    for(int ii=0; ii<=left; ii++)
+    {
+        conf[idx] = ii;
+        brute_force(conf, idx+1, left-ii, isotopeNo, lprobs, lCutOff, out);
+    }
+}
+
+bool check(const char* symbol, int atomCnt, double cutoff, bool brute)
+{
+    int first = 0;
+    while(strcmp(elem_table_symbol[first], symbol) != 0)
+        first++;
+    int isotopeNo = 0;
+    while(first+isotopeNo < NUMBER_OF_ISOTOPIC_ENTRIES and strcmp(elem_table_symbol[first+isotopeNo], symbol) == 0)
+        isotopeNo++;
+
+    Marginal m(&elem_table_mass[first], &elem_table_probability[first], isotopeNo, atomCnt);
+    const double lCutOff = m.getModeLProb() + log(cutoff);
+    MarginalTrek trek(Marginal(m), 1000, 1000);
+    PrecalculatedMarginal pm(std::move(m), lCutOff);
+
+    // Brute force where it is feasible, otherwise MarginalTrek (which explores independently)
+    std::vector<double> ref;
+    if(brute)
+    {
+        int conf[8];
+        brute_force(conf, 0, atomCnt, isotopeNo, &elem_table_log_probability[first], lCutOff, ref);
+        std::sort(ref.begin(), ref.end(), [](double a, double b) { return a > b; });
+    }
+    else
+        for(int ii=0; trek.probeConfigurationIdx(ii) and trek.conf_probs()[ii] >= lCutOff; ii++)
+            ref.push_back(trek.conf_probs()[ii]);
+
+    // Sorted, and the same log-probabilities up to the recurrence's rounding
+    bool ok = pm.get_no_confs() == ref.size();
+    for(unsigned int ii=0; ok and ii<ref.size(); ii++)
+    {
+        ok = std::abs(pm.get_lProb(ii) - ref[ii]) < 1e-9;
+        ok = ok and (ii == 0 or pm.get_lProb(ii) <= pm.get_lProb(ii-1));
+        ok = ok and std::abs(pm.get_lProb(ii) - logProb(pm.get_conf(ii), &elem_table_log_probability[first], isotopeNo)) < 1e-9;
+    }
+
+    std::cout << symbol << atomCnt << " (" << isotopeNo << " isotopes) cutoff: " << cutoff << " confs: " << pm.get_no_confs() << " / " << ref.size() << (ok ? " OK" : " MISMATCH") << std::endl;
+    return ok;
+}
+
+int main()
+{
+    bool ok = true;
+    const char* symbols[] = {"C", "H", "N", "O", "Si", "S"};
+    const int counts[] = {1, 2, 17, 100, 2000};
+    const double cutoffs[] = {1e-3, 1e-12, 0.0};
+    for(unsigned int ii=0; ii<6; ii++)
+        for(unsigned int jj=0; jj<5; jj++)
+            for(unsigned int kk=0; kk<3; kk++)
+            {
+                // Brute force is too slow there
+                bool brute = counts[jj] < 2000 or (symbols[ii][0] != 'S' and kk < 2);
+                if(counts[jj] == 2000 and kk == 2)
+                    continue;
+                ok = check(symbols[ii], counts[jj], cutoffs[kk], brute) and ok;
+            }
+
+    std::cout << (ok ? "OK" : "MISMATCH") << std::endl;
+    return ok ? 0 : 1;
+}
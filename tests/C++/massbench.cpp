@@ -0,0 +1,65 @@
+#include <iostream>
+#include <chrono>
+#include <algorithm>
+#include "isoSpec++.h"
+
+
+size_t filtered(const char* formula, double threshold, double min_mass, double max_mass)
+{
+    IsoThresholdGenerator gen(Iso(formula), threshold, true);
+    size_t cnt = 0;
+    while(gen.advanceToNextConfiguration())
+        if(min_mass <= gen.mass() and gen.mass() <= max_mass)
+            cnt++;
+    return cnt;
+}
+
+size_t bounded(const char* formula, double threshold, double min_mass, double max_mass)
+{
+    IsoThresholdGeneratorBoundMass gen(Iso(formula), threshold, min_mass, max_mass, true);
+    size_t cnt = 0;
+    while(gen.advanceToNextConfiguration())
+        cnt++;
+    return cnt;
+}
+
+// Best of a few runs, in seconds
+double timed(size_t (*f)(const char*, double, double, double), const char* formula, double threshold, double min_mass, double max_mass, size_t& cnt)
+{
+    double best = 1e100;
+    for(int rr = 0; rr < 5; rr++)
+    {
+        auto t0 = std::chrono::steady_clock::now();
+        cnt = f(formula, threshold, min_mass, max_mass);
+        auto t1 = std::chrono::steady_clock::now();
+        best = std::min(best, std::chrono::duration<double>(t1-t0).count());
+    }
+    return best;
+}
+
+int main()
+{
+    bool ok = true;
+    const char* formulas[] = {"C2000H3200N600O600S20", "C500H800N150O150S10Se4Fe2", "C100H160N30O30S6Se2Fe3Zn2Cl4Br2"};
+    const double thresholds[] = {1e-12, 1e-10, 1e-12};
+    const double widths[] = {0.001, 0.01, 0.1, 1.0};
+    for(unsigned int ii = 0; ii < 3; ii++)
+    {
+        // Around the most probable configuration
+        IsoThresholdGenerator top(Iso(formulas[ii]), 0.9999, false);
+        top.advanceToNextConfiguration();
+        const double centre = top.mass();
+
+        for(unsigned int jj = 0; jj < 4; jj++)
+        {
+            const double min_mass = centre - widths[jj], max_mass = centre + widths[jj];
+            size_t cnt_filtered, cnt_bounded;
+            const double t_filter = timed(filtered, formulas[ii], thresholds[ii], min_mass, max_mass, cnt_filtered);
+            const double t_bound = timed(bounded, formulas[ii], thresholds[ii], min_mass, max_mass, cnt_bounded);
+            ok = ok and cnt_filtered == cnt_bounded;
+            std::cout << formulas[ii] << " +-" << widths[jj] << " Da: " << cnt_bounded << " / " << cnt_filtered << " confs, filtered: "
+                      << t_filter << "s, bounded: " << t_bound << "s" << (cnt_filtered == cnt_bounded ? " OK" : " MISMATCH") << std::endl;
+        }
+    }
+    return ok ? 0 : 1;
+}
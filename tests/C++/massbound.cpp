@@ -0,0 +1,141 @@
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <limits>
+#include <cmath>
+#include <stdexcept>
+#include "isoSpec++.h"
+
+
+typedef std::vector<std::pair<double, double> > Confs;
+
+Confs reference(const char* formula, double threshold, double min_mass, double max_mass)
+{
+    Confs ret;
+    IsoThresholdGenerator gen(Iso(formula), threshold, true);
+    while(gen.advanceToNextConfiguration())
+        if(min_mass <= gen.mass() and gen.mass() <= max_mass)
+            ret.push_back(std::make_pair(gen.mass(), gen.lprob()));
+    std::sort(ret.begin(), ret.end());
+    return ret;
+}
+
+Confs bound(const char* formula, double threshold, double min_mass, double max_mass)
+{
+    Confs ret;
+    IsoThresholdGeneratorBoundMass gen(Iso(formula), threshold, min_mass, max_mass, true);
+    while(gen.advanceToNextConfiguration())
+        ret.push_back(std::make_pair(gen.mass(), gen.lprob()));
+    std::sort(ret.begin(), ret.end());
+    return ret;
+}
+
+bool same(const Confs& a, const Confs& b)
+{
+    if(a.size() != b.size())
+        return false;
+    for(size_t ii = 0; ii < a.size(); ii++)
+        if(fabs(a[ii].first - b[ii].first) > 1e-9 or fabs(a[ii].second - b[ii].second) > 1e-9)
+            return false;
+    return true;
+}
+
+int main()
+{
+    bool ok = true;
+    const double inf = std::numeric_limits<double>::infinity();
+
+    const char* formulas[] = {"C100H160N30O30S6", "C520H817N139O147S8", "Se12", "H2O", "C10Sn4Fe3Cl5"};
+    const double thresholds[] = {1e-9, 1e-6, 1e-8, 1e-12, 1e-7};
+    for(unsigned int ii = 0; ii < 5; ii++)
+    {
+        IsoThresholdGenerator all(Iso(formulas[ii]), thresholds[ii], true);
+        double lightest = inf, heaviest = -inf;
+        size_t total = 0;
+        while(all.advanceToNextConfiguration())
+        {
+            lightest = std::min(lightest, all.mass());
+            heaviest = std::max(heaviest, all.mass());
+            total++;
+        }
+        const double centre = 0.5 * (lightest + heaviest);
+
+        // Narrow, wide, everything, empty and out of range windows
+        const double windows[][2] = {
+            {centre - 0.01, centre + 0.01},
+            {centre - 0.5, centre + 0.5},
+            {centre - 3.0, centre + 1.0},
+            {lightest, lightest + 1.0},
+            {-inf, inf},
+            {centre + 0.001, centre},
+            {heaviest + 1.0, heaviest + 2.0}
+        };
+        for(unsigned int jj = 0; jj < 7; jj++)
+        {
+            Confs r = reference(formulas[ii], thresholds[ii], windows[jj][0], windows[jj][1]);
+            Confs b = bound(formulas[ii], thresholds[ii], windows[jj][0], windows[jj][1]);
+            if(not same(r, b))
+            {
+                std::cout << formulas[ii] << " window " << jj << ": " << b.size() << " vs " << r.size() << std::endl;
+                ok = false;
+            }
+        }
+        ok = bound(formulas[ii], thresholds[ii], -inf, inf).size() == total and ok;
+    }
+
+    // Batches through fill(), the relative threshold
+    IsoThresholdGeneratorBoundMass gen(Iso("C100H160N30O30S6"), 1e-5, 2455.0, 2458.0, false);
+    double masses[7], probs[7];
+    size_t got, cnt = 0;
+    while((got = gen.fill(masses, probs, 7)) > 0)
+        for(size_t ii = 0; ii < got; ii++, cnt++)
+            ok = masses[ii] >= 2455.0 and masses[ii] <= 2458.0 and probs[ii] > 0.0 and ok;
+    IsoThresholdGenerator rel(Iso("C100H160N30O30S6"), 1e-5, false);
+    size_t rel_cnt = 0;
+    while(rel.advanceToNextConfiguration())
+        if(rel.mass() >= 2455.0 and rel.mass() <= 2458.0)
+            rel_cnt++;
+    ok = cnt == rel_cnt and cnt > 0 and ok;
+
+    // Windows around every nominal peak in one pass, against one window at a time
+    const char* multi[] = {"C100H160N30O30S6", "C520H817N139O147S8", "C10Sn4Fe3Cl5", "Se12"};
+    for(unsigned int ii = 0; ii < 4; ii++)
+    {
+        IsoThresholdGenerator top(Iso(multi[ii]), 0.9999, false);
+        top.advanceToNextConfiguration();
+        double mins[40], maxs[40];
+        for(unsigned int jj = 0; jj < 40; jj++)
+        {
+            mins[jj] = top.mass() + (jj - 10.0) * 1.00335 - 0.02 * (1 + jj % 3);
+            maxs[jj] = top.mass() + (jj - 10.0) * 1.00335 + 0.01 * (1 + jj % 4);
+        }
+        std::vector<Confs> per_window(40);
+        IsoThresholdGeneratorBoundMass gen(Iso(multi[ii]), 1e-9, mins, maxs, 40, true);
+        while(gen.advanceToNextConfiguration())
+        {
+            ok = gen.window() < 40 and mins[gen.window()] <= gen.mass() and gen.mass() <= maxs[gen.window()] and ok;
+            per_window[gen.window()].push_back(std::make_pair(gen.mass(), gen.lprob()));
+        }
+        for(unsigned int jj = 0; jj < 40; jj++)
+        {
+            std::sort(per_window[jj].begin(), per_window[jj].end());
+            if(not same(per_window[jj], reference(multi[ii], 1e-9, mins[jj], maxs[jj])))
+            {
+                std::cout << multi[ii] << " window " << jj << " of many differs" << std::endl;
+                ok = false;
+            }
+        }
+    }
+
+    // Overlapping or unsorted windows are refused
+    const double bad_mins[] = {100.0, 100.5}, bad_maxs[] = {101.0, 102.0};
+    try
+    {
+        IsoThresholdGeneratorBoundMass bad(Iso("H2O"), 1e-9, bad_mins, bad_maxs, 2, true);
+        ok = false;
+    }
+    catch(std::invalid_argument&) {}
+
+    std::cout << (ok ? "OK" : "MISMATCH") << std::endl;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,109 @@
+#include <iostream>
+#include <vector>
+#include <cmath>
+#include <string.h>
+#include "isoSpec++.h"
+#include "element_tables.h"
+#include "formula.h"
+
+
+bool check(const char* const* symbols, const int* counts, int dim, double threshold, bool lazy)
+{
+    int elements[8];
+    int no_isotopes = 0;
+    for(int ii = 0; ii < dim; ii++)
+    {
+        elements[ii] = find_element_index(symbols[ii], strlen(symbols[ii]));
+        no_isotopes += elem_table_element_isotopeNo[elements[ii]];
+    }
+
+    IsoThresholdGenerator agg(Iso(dim, elements, counts), threshold, true, 1000, 1000, lazy);
+    const int max_n = agg.max_extra_neutrons();
+    std::vector<double> probs(max_n+1), masses(max_n+1);
+    agg.aggregate_by_neutrons(probs.data(), masses.data());
+
+    // Every peak, binned by the extra neutrons of its isotopes in the tables
+    std::vector<double> ref_probs(max_n+1), ref_masses(max_n+1);
+    std::vector<int> iso_counts(no_isotopes);
+    IsoThresholdGenerator gen(Iso(dim, elements, counts), threshold, true);
+    bool ok = true;
+    while(gen.advanceToNextConfiguration())
+    {
+        gen.get_isotope_counts(iso_counts.data());
+        int n = 0, pos = 0;
+        for(int ii = 0; ii < dim; ii++)
+        {
+            const int first = elem_table_element_first[elements[ii]];
+            for(int jj = 0; jj < elem_table_element_isotopeNo[elements[ii]]; jj++, pos++)
+                n += iso_counts[pos] * (elem_table_extraNeutrons[first+jj] - elem_table_extraNeutrons[first]);
+        }
+        if(n > max_n)
+        {
+            ok = false;
+            continue;
+        }
+        ref_probs[n] += gen.eprob();
+        ref_masses[n] += gen.eprob() * gen.mass();
+    }
+
+    int nonempty = 0;
+    for(int n = 0; n <= max_n; n++)
+    {
+        if(ref_probs[n] > 0.0)
+        {
+            ref_masses[n] /= ref_probs[n];
+            nonempty++;
+        }
+        if(fabs(probs[n] - ref_probs[n]) > 1e-12 * (1.0 + ref_probs[n]) or fabs(masses[n] - ref_masses[n]) > 1e-9 * (1.0 + ref_masses[n]))
+            ok = false;
+    }
+
+    std::cout << symbols[0] << "...: " << nonempty << " of " << max_n+1 << " neutron counts" << (lazy ? " lazy" : "") << (ok ? " OK" : " MISMATCH") << std::endl;
+    return ok;
+}
+
+// The per-isotope extra neutrons of a marginal, against the tables, whatever the atom count
+bool check_marginal(const char* symbol, int atomCnt)
+{
+    const int element = find_element_index(symbol, strlen(symbol));
+    const int first = elem_table_element_first[element];
+    const int isotopeNo = elem_table_element_isotopeNo[element];
+    Marginal m(&elem_table_mass[first], &elem_table_probability[first], isotopeNo, atomCnt);
+    std::vector<int> extra(isotopeNo);
+    m.get_extra_neutrons(extra.data());
+    bool ok = true;
+    for(int jj = 0; jj < isotopeNo; jj++)
+        ok = ok and extra[jj] == elem_table_extraNeutrons[first+jj] - elem_table_extraNeutrons[first];
+    std::cout << symbol << atomCnt << " extra neutrons" << (ok ? " OK" : " MISMATCH") << std::endl;
+    return ok;
+}
+
+int main()
+{
+    bool ok = true;
+
+    ok = check_marginal("Sn", 4) and ok;
+    ok = check_marginal("Sn", 0) and ok;
+    ok = check_marginal("O", 0) and ok;
+
+    const char* protein[] = {"C", "H", "N", "O", "S"};
+    const int protein_counts[] = {520, 817, 139, 147, 8};
+    const char* metals[] = {"Sn", "Fe", "Cl", "Se", "C"};
+    const int metals_counts[] = {4, 3, 5, 2, 10};
+    const char* single[] = {"U"};
+    const int single_counts[] = {3};
+    // Elements may be present with no atoms, as in "C2H6O0S0"
+    const char* absent[] = {"C", "H", "O", "S"};
+    const int absent_counts[] = {2, 6, 0, 0};
+
+    for(int lazy = 0; lazy < 2; lazy++)
+    {
+        ok = check(protein, protein_counts, 5, 1e-9, lazy) and ok;
+        ok = check(metals, metals_counts, 5, 1e-10, lazy) and ok;
+        ok = check(single, single_counts, 1, 1e-12, lazy) and ok;
+        ok = check(absent, absent_counts, 4, 1e-12, lazy) and ok;
+    }
+
+    std::cout << (ok ? "OK" : "MISMATCH") << std::endl;
+    return ok ? 0 : 1;
+}
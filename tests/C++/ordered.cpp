@@ -0,0 +1,99 @@
+#include <iostream>
+#include <cmath>
+#include <vector>
+#include "isoSpec++.h"
+#include "summator.h"
+
+
+bool check(const char* formula, double threshold)
+{
+    IsoThresholdGenerator ref(Iso(formula), threshold, true);
+    unsigned int ref_cnt = 0;
+    Summator ref_s;
+    while(ref.advanceToNextConfiguration())
+    {
+        ref_cnt++;
+        ref_s.add(ref.eprob());
+    }
+
+    IsoOrderedGenerator gen(Iso(formula), log(threshold));
+    unsigned int cnt = 0;
+    Summator s;
+    bool sorted = true;
+    double last = std::numeric_limits<double>::infinity();
+    while(gen.advanceToNextConfiguration())
+    {
+        cnt++;
+        s.add(gen.eprob());
+        if(gen.lprob() > last)
+            sorted = false;
+        last = gen.lprob();
+    }
+
+    bool ok = sorted and cnt == ref_cnt and std::abs(s.get() - ref_s.get()) < 1e-9;
+    std::cout << formula << " confs: " << cnt << " / " << ref_cnt << " prob: " << s.get() << " / " << ref_s.get()
+              << (sorted ? "" : " UNSORTED") << (ok ? " OK" : " MISMATCH") << std::endl;
+    return ok;
+}
+
+bool check_top(const char* formula, unsigned int N)
+{
+    // Early exit: the first N peaks, without a cutoff
+    IsoOrderedGenerator gen{Iso(formula)};
+    unsigned int cnt = 0;
+    double last = std::numeric_limits<double>::infinity();
+    bool ok = true;
+    while(cnt < N and gen.advanceToNextConfiguration())
+    {
+        cnt++;
+        ok = ok and gen.lprob() <= last;
+        last = gen.lprob();
+    }
+    ok = ok and cnt == N;
+    std::cout << formula << " top " << N << " last lprob: " << last << (ok ? " OK" : " MISMATCH") << std::endl;
+    return ok;
+}
+
+bool check_topk(const char* formula, size_t K)
+{
+    IsoOrderedGenerator ref{Iso(formula)};
+    Iso iso(formula);
+    const int allDim = iso.getAllDim();
+    std::vector<double> masses(K), lprobs(K);
+    std::vector<int> counts(K*allDim), ref_counts(allDim);
+    size_t got = getTopK(std::move(iso), K, masses.data(), lprobs.data(), counts.data());
+
+    bool ok = true;
+    size_t cnt = 0;
+    while(cnt < K and ref.advanceToNextConfiguration())
+    {
+        ref.get_isotope_counts(ref_counts.data());
+        // Ties may come in a different order, the values may not
+        ok = ok and cnt < got and lprobs[cnt] == ref.lprob();
+        if(ok and masses[cnt] == ref.mass())
+            for(int ii=0; ii<allDim; ii++)
+                ok = ok and counts[cnt*allDim+ii] == ref_counts[ii];
+        cnt++;
+    }
+    ok = ok and cnt == got;
+    std::cout << formula << " top-K " << K << ": " << got << (ok ? " OK" : " MISMATCH") << std::endl;
+    return ok;
+}
+
+int main()
+{
+    bool ok = true;
+    ok = check("C100H202", 1e-12) and ok;
+    ok = check("C520H817N139O147S8", 1e-8) and ok;
+    ok = check("C1000H1000O1000N1000S1000", 1e-6) and ok;
+    ok = check("S1", 1e-30) and ok;
+    ok = check_top("C1000H1000O1000N1000S1000", 1000) and ok;
+    ok = check_topk("C1000H1000O1000N1000S1000", 1) and ok;
+    ok = check_topk("C1000H1000O1000N1000S1000", 50) and ok;
+    ok = check_topk("C1000H1000O1000N1000S1000", 5000) and ok;
+    ok = check_topk("C100H202", 10000) and ok;
+    ok = check_topk("S1", 10) and ok;
+
+    std::cout << (ok ? "OK" : "MISMATCH") << std::endl;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,127 @@
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include <cmath>
+#include <cstdint>
+#include <string.h>
+#include "isoSpec++.h"
+#include "formula.h"
+#include "element_tables.h"
+
+
+std::vector<std::pair<double, double> > enumerate(const char* formula)
+{
+    std::vector<std::pair<double, double> > ret;
+    IsoThresholdGenerator gen(Iso(formula), 1e-6, false);
+    while(gen.advanceToNextConfiguration())
+        ret.push_back(std::make_pair(gen.mass(), gen.lprob()));
+    std::sort(ret.begin(), ret.end());
+    return ret;
+}
+
+bool same(const char* f1, const char* f2)
+{
+    std::vector<std::pair<double, double> > a = enumerate(f1), b = enumerate(f2);
+    if(a.size() != b.size())
+        return false;
+    for(size_t ii = 0; ii < a.size(); ii++)
+        if(std::abs(a[ii].first - b[ii].first) > 1e-9 or std::abs(a[ii].second - b[ii].second) > 1e-9)
+            return false;
+    return true;
+}
+
+bool invalid(const char* formula)
+{
+    try {
+        Iso iso(formula);
+    }
+    catch(std::invalid_argument&) {
+        return true;
+    }
+    return false;
+}
+
+int main()
+{
+    bool ok = true;
+
+    // Counts default to 1, repeated elements add up, parentheses multiply
+    ok = same("CH3COOH", "C2H4O2") and ok;
+    ok = same("C2H5(CH2)10OH", "C12H26O1") and ok;
+    ok = same("((CH2)2(NH)3)4S", "C8H28N12S1") and ok;
+    ok = same("Fe2(SO4)3", "Fe2S3O12") and ok;
+
+    FormulaEntry entries[MAX_FORMULA_ENTRIES];
+    ok = parse_formula_entries("C6H12O6", entries) == 3 and ok;
+    ok = entries[0].atomCnt == 6 and entries[1].atomCnt == 12 and entries[2].atomCnt == 6 and ok;
+    ok = entries[0].isotopeNo == 2 and entries[2].isotopeNo == 3 and not entries[0].labelled and ok;
+
+    // Labelled isotopes are separate, with a single isotope
+    ok = parse_formula_entries("[13C]2C4H12[18O]O5", entries) == 5 and ok;
+    ok = entries[0].labelled and entries[0].isotopeNo == 1 and entries[0].atomCnt == 2 and ok;
+    ok = entries[1].first == entries[0].first - 1 and entries[1].atomCnt == 4 and ok;
+    {
+        IsoThresholdGenerator gen(Iso("[13C]6"), 1e-6, false);
+        ok = gen.advanceToNextConfiguration() and std::abs(gen.mass() - 6*13.0033548378) < 1e-6 and std::abs(gen.eprob() - 1.0) < 1e-12 and ok;
+        ok = not gen.advanceToNextConfiguration() and ok;
+    }
+
+    int isotopeNo;
+    ok = find_element("Sn", 2, &isotopeNo) >= 0 and isotopeNo == 10 and ok;
+    ok = find_element("Xy", 2, &isotopeNo) < 0 and find_element("c", 1, &isotopeNo) < 0 and ok;
+
+    // The per-element tables cover the isotope tables, one element at a time
+    int total = 0;
+    for(int ii = 0; ii < NUMBER_OF_ELEMENTS; ii++)
+    {
+        const int first = elem_table_element_first[ii];
+        const int n = elem_table_element_isotopeNo[ii];
+        ok = first == total and ok;
+        for(int jj = first; jj < first + n; jj++)
+            ok = elem_table_atomicNo[jj] == elem_table_atomicNo[first] and ok;
+        ok = (first + n == NUMBER_OF_ISOTOPIC_ENTRIES or elem_table_atomicNo[first+n] != elem_table_atomicNo[first]) and ok;
+        ok = find_element_index(elem_table_symbol[first], strlen(elem_table_symbol[first])) == ii and ok;
+        total += n;
+    }
+    ok = total == NUMBER_OF_ISOTOPIC_ENTRIES and ok;
+    ok = reinterpret_cast<uintptr_t>(elem_table_mass) % 64 == 0 and ok;
+
+    // An Iso from element indices is the one of the formula
+    {
+        const char* symbols[] = {"C", "H", "N", "O", "S"};
+        const int counts[] = {100, 160, 30, 30, 4};
+        int elements[5];
+        for(int ii = 0; ii < 5; ii++)
+            elements[ii] = find_element_index(symbols[ii], 1);
+        IsoThresholdGenerator a(Iso(5, elements, counts), 1e-6, false);
+        IsoThresholdGenerator b(Iso("C100H160N30O30S4"), 1e-6, false);
+        bool more = true;
+        while(more)
+        {
+            more = a.advanceToNextConfiguration();
+            ok = more == b.advanceToNextConfiguration() and ok;
+            ok = (not more or (a.mass() == b.mass() and a.lprob() == b.lprob())) and ok;
+        }
+        const int wrong[] = {0, NUMBER_OF_ELEMENTS};
+        bool thrown = false;
+        try {
+            Iso iso(2, wrong, counts);
+        }
+        catch(std::invalid_argument&) {
+            thrown = true;
+        }
+        ok = thrown and ok;
+    }
+
+    const char* bad[] = {"", "c2", "Xy2", "C2H(", "C2)H", "[13C", "[12N]2", "[C]2", "C99999999999", "H2O!", "(H2O)999999999(H2O)999999999"};
+    for(unsigned int ii = 0; ii < 11; ii++)
+        if(not invalid(bad[ii]))
+        {
+            std::cout << "accepted: " << bad[ii] << std::endl;
+            ok = false;
+        }
+
+    std::cout << (ok ? "OK" : "MISMATCH") << std::endl;
+    return ok ? 0 : 1;
+}
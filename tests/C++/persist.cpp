@@ -0,0 +1,74 @@
+#include <iostream>
+#include <vector>
+#include <stdio.h>
+#include "isoSpec++.h"
+#include "marginalCache.h"
+
+
+std::vector<double> enumerate(const char* formula, double threshold)
+{
+    std::vector<double> ret;
+    IsoThresholdGenerator gen(Iso(formula), threshold, false);
+    while(gen.advanceToNextConfiguration())
+    {
+        ret.push_back(gen.mass());
+        ret.push_back(gen.lprob());
+    }
+    return ret;
+}
+
+int main()
+{
+    bool ok = true;
+    const char* formulas[] = {"C100H202", "C520H817N139O147S8", "C50H80O12S2", "S1", "H2O1", "Se20Sn3"};
+    const double thresholds[] = {1e-3, 1e-6, 1e-9};
+    const char* path = "/tmp/isospec_marginal_cache_test.bin";
+
+    std::vector<std::vector<double> > ref;
+    for(unsigned int ii=0; ii<6; ii++)
+        for(unsigned int jj=0; jj<3; jj++)
+            ref.push_back(enumerate(formulas[ii], thresholds[jj]));
+
+    // Fill the cache at the lowest threshold and save it
+    MarginalCache& cache = MarginalCache::global();
+    cache.set_capacity(1000000);
+    for(unsigned int ii=0; ii<6; ii++)
+        enumerate(formulas[ii], 1e-9);
+    ok = cache.save(path);
+
+    // Fresh start: everything has to come from the file
+    cache.set_capacity(0);
+    cache.clear();
+    ok = ok and cache.map_file(path);
+    for(unsigned int ii=0; ii<6; ii++)
+        for(unsigned int jj=0; jj<3; jj++)
+            ok = enumerate(formulas[ii], thresholds[jj]) == ref[ii*3+jj] and ok;
+    MarginalCacheStats s = cache.get_stats();
+    std::cout << "hits: " << s.hits << " mapped: " << s.mapped_hits << " misses: " << s.misses << std::endl;
+    ok = ok and s.misses == 0 and s.mapped_hits == s.hits and s.hits > 0;
+
+    // Saving again keeps what is mapped
+    const char* path2 = "/tmp/isospec_marginal_cache_test2.bin";
+    ok = ok and cache.save(path2);
+    MarginalCache other;
+    ok = ok and other.map_file(path2);
+
+    // A truncated copy is refused
+    const char* path3 = "/tmp/isospec_marginal_cache_test3.bin";
+    std::vector<char> data(1 << 20);
+    FILE* f = fopen(path2, "rb");
+    size_t len = fread(data.data(), 1, data.size(), f);
+    fclose(f);
+    f = fopen(path3, "wb");
+    fwrite(data.data(), 1, len / 2, f);
+    fclose(f);
+    ok = ok and not other.map_file(path3);
+    ok = ok and not other.map_file("/nonexistent/file");
+
+    remove(path);
+    remove(path2);
+    remove(path3);
+
+    std::cout << (ok ? "OK" : "MISMATCH") << std::endl;
+    return ok ? 0 : 1;
+}
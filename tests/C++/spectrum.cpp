@@ -0,0 +1,92 @@
+#include <iostream>
+#include <vector>
+#include <map>
+#include <cmath>
+#include "isoSpec++.h"
+#include "spectrum2.h"
+
+
+bool check(const char* formula, double threshold, double width, unsigned int n_threads)
+{
+    // Enumerate and bin in one thread
+    IsoThresholdGenerator gen(Iso(formula), threshold, false);
+    std::vector<std::pair<long, double> > confs;
+    long lo = 0, hi = 0;
+    while(gen.advanceToNextConfiguration())
+    {
+        const long b = static_cast<long>(floor(gen.mass()/width));
+        lo = confs.empty() ? b : std::min(lo, b);
+        hi = confs.empty() ? b : std::max(hi, b);
+        confs.push_back(std::make_pair(b, gen.eprob()));
+    }
+    std::vector<double> ref(hi - lo + 1, 0.0);
+    double ref_prob = 0.0;
+    for(size_t ii = 0; ii < confs.size(); ii++)
+    {
+        ref[confs[ii].first - lo] += confs[ii].second;
+        ref_prob += confs[ii].second;
+    }
+
+    Spectrum s(Iso(formula), width, threshold, false);
+    s.run(n_threads);
+
+    bool ok = s.get_total_confs() == confs.size() and std::abs(s.get_total_prob() - ref_prob) < 1e-9;
+    // The reachable range covers every bucket with something in it
+    const long first = static_cast<long>(floor(s.get_bucket_mass(0)/width + 0.5));
+    ok = ok and first <= lo and hi < first + static_cast<long>(s.get_n_buckets());
+    for(unsigned long ii = 0; ok and ii < s.get_n_buckets(); ii++)
+    {
+        const long b = first + static_cast<long>(ii);
+        const double expected = lo <= b and b <= hi ? ref[b - lo] : 0.0;
+        ok = std::abs(s.get_probs()[ii] - expected) <= 1e-12 * (1.0 + expected);
+    }
+
+    std::cout << formula << " threads: " << n_threads << " width: " << width << " buckets: " << s.get_n_buckets()
+              << " confs: " << s.get_total_confs() << " / " << confs.size() << (ok ? " OK" : " MISMATCH") << std::endl;
+    return ok;
+}
+
+// Bucket ii of s as an absolute bucket number
+long bucket_no(const Spectrum& s, unsigned long ii, double width)
+{
+    return static_cast<long>(floor(s.get_bucket_mass(ii)/width + 0.5));
+}
+
+bool check_add(const char* formula, const char* other_formula, double width)
+{
+    Spectrum s(Iso(formula), width, 1e-6, true);
+    Spectrum other(Iso(other_formula), width, 1e-6, true);
+    s.run(2);
+    other.run(1);
+    std::map<long, double> expected;
+    for(unsigned long ii = 0; ii < s.get_n_buckets(); ii++)
+        expected[bucket_no(s, ii, width)] += s.get_probs()[ii];
+    for(unsigned long ii = 0; ii < other.get_n_buckets(); ii++)
+        expected[bucket_no(other, ii, width)] += other.get_probs()[ii];
+    const unsigned int confs = s.get_total_confs() + other.get_total_confs();
+
+    // It has to be widened for the other one
+    s.add_other(other);
+    bool ok = s.get_total_confs() == confs and s.get_n_buckets() == expected.size()
+              and bucket_no(s, 0, width) == expected.begin()->first;
+    for(unsigned long ii = 0; ok and ii < s.get_n_buckets(); ii++)
+        ok = std::abs(s.get_probs()[ii] - expected[bucket_no(s, ii, width)]) <= 1e-15;
+
+    std::cout << formula << " + " << other_formula << " buckets: " << s.get_n_buckets() << (ok ? " OK" : " MISMATCH") << std::endl;
+    return ok;
+}
+
+int main()
+{
+    bool ok = true;
+    ok = check("H2O", 1e-6, 1.0, 2) and ok;
+    ok = check("C520H817N139O147S8", 1e-8, 0.01, 3) and ok;
+    ok = check("C2000H3200N600O600S20", 1e-6, 0.001, 4) and ok;
+    ok = check("C10Sn4Fe3Cl5Se2", 1e-8, 0.5, 2) and ok;
+    // A range over several tiles
+    ok = check("C2000H3200N600O600S20", 1e-4, 0.00001, 3) and ok;
+    ok = check_add("C100H160N30O30S6", "C100H161N30O30S6", 0.01) and ok;
+    ok = check_add("C100H161N30O30S6", "C100H160N30O30S6", 0.01) and ok;
+    std::cout << (ok ? "OK" : "MISMATCH") << std::endl;
+    return ok ? 0 : 1;
+}
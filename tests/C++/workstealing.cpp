@@ -0,0 +1,94 @@
+#include <iostream>
+#include <pthread.h>
+#include "isoSpec++.h"
+#include "summator.h"
+
+
+struct WorkerArgs
+{
+    Iso* iso;
+    ThresholdWorkPool* pool;
+    unsigned int thread_id;
+    unsigned int cnt;
+    double prob;
+};
+
+void* worker(void* arg)
+{
+    WorkerArgs* wa = reinterpret_cast<WorkerArgs*>(arg);
+    IsoThresholdGeneratorWS gen(std::move(*wa->iso), *wa->pool, wa->thread_id);
+    Summator s;
+    wa->cnt = 0;
+    if(wa->thread_id % 2 == 0)
+        while(gen.advanceToNextConfiguration())
+        {
+            wa->cnt++;
+            s.add(gen.eprob());
+        }
+    else
+    {
+        // Odd threads exercise the block interface
+        double masses[100], probs[100];
+        size_t got;
+        while((got = gen.fill(masses, probs, 100)) > 0)
+            for(size_t ii=0; ii<got; ii++)
+            {
+                wa->cnt++;
+                s.add(probs[ii]);
+            }
+    }
+    wa->prob = s.get();
+    return NULL;
+}
+
+bool check(const char* formula, double threshold, unsigned int n_threads)
+{
+    IsoThresholdGenerator ref(Iso(formula), threshold, false);
+    unsigned int ref_cnt = 0;
+    Summator ref_s;
+    while(ref.advanceToNextConfiguration())
+    {
+        ref_cnt++;
+        ref_s.add(ref.eprob());
+    }
+
+    Iso iso(formula);
+    ThresholdWorkPool pool(iso, threshold, false, n_threads);
+    pthread_t* threads = new pthread_t[n_threads];
+    WorkerArgs* args = new WorkerArgs[n_threads];
+    for(unsigned int ii=0; ii<n_threads; ii++)
+    {
+        args[ii].iso = &iso;
+        args[ii].pool = &pool;
+        args[ii].thread_id = ii;
+        pthread_create(&threads[ii], NULL, worker, &args[ii]);
+    }
+
+    unsigned int cnt = 0;
+    Summator s;
+    for(unsigned int ii=0; ii<n_threads; ii++)
+    {
+        pthread_join(threads[ii], NULL);
+        cnt += args[ii].cnt;
+        s.add(args[ii].prob);
+    }
+
+    std::cout << formula << " threads: " << n_threads << " tasks: " << pool.get_no_tasks() << " confs: " << cnt << " / " << ref_cnt
+              << " prob: " << s.get() << " / " << ref_s.get() << std::endl;
+
+    delete[] threads;
+    delete[] args;
+    return cnt == ref_cnt and std::abs(s.get() - ref_s.get()) < 1e-9;
+}
+
+int main()
+{
+    bool ok = true;
+    const char* formulas[] = {"C100H202", "C520H817N139O147S8", "C1000H1000O1000N1000S1000", "S1"};
+    for(unsigned int ii=0; ii<4; ii++)
+        for(unsigned int n_threads = 1; n_threads <= 8; n_threads *= 2)
+            ok = check(formulas[ii], 1e-6, n_threads) and ok;
+
+    std::cout << (ok ? "OK" : "MISMATCH") << std::endl;
+    return ok ? 0 : 1;
+}